@@ -16,7 +16,7 @@ INCLUDE_DIR=""          # Which directories do we want to include.
 LIBRARIES=""            # What libraries do we want to include
 
 if platform.system()=="Linux":
-    ARGUMENTS="-D LINUX" # -D is a #define sent to preprocessor
+    ARGUMENTS="-D LINUX -pthread" # -D is a #define sent to preprocessor
     INCLUDE_DIR="-I ./include/ -I ./include/glm -I./thirdparty/imgui/ -I./thirdparty/imgui/backends/"
     LIBRARIES="-ldl `pkg-config sdl3 --libs --cflags`"
 elif platform.system()=="Darwin":
@@ -13,6 +13,9 @@ struct AABB {
     min = glm::min(min, aabb.min);
     max = glm::max(max, aabb.max);
   }
+  bool empty() const {
+    return min.x > max.x || min.y > max.y || min.z > max.z;
+  }
   float surfaceArea() const {
     glm::vec3 extent = max - min;
     return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
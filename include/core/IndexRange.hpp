@@ -0,0 +1,44 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Contiguous range of elements, e.g. the part of a buffer that changed
+struct IndexRange {
+  size_t first = 0;
+  size_t count = 0;
+
+  bool empty() const { return count == 0; }
+
+  void extend(size_t index) { extend(index, index + 1); }
+  // Grows the range to cover [begin, end)
+  void extend(size_t begin, size_t end) {
+    if (empty()) {
+      first = begin;
+      count = end - begin;
+      return;
+    }
+    size_t last = std::max(first + count, end);
+    first = std::min(first, begin);
+    count = last - first;
+  }
+};
+
+// Sorts the indices into ranges, joining ranges fewer than maxGap elements
+// apart since one larger upload beats many tiny ones
+inline std::vector<IndexRange> toRanges(std::vector<uint32_t> indices,
+                                        size_t maxGap) {
+  std::sort(indices.begin(), indices.end());
+  std::vector<IndexRange> ranges;
+  for (uint32_t index : indices) {
+    if (!ranges.empty() &&
+        index < ranges.back().first + ranges.back().count + maxGap) {
+      ranges.back().extend(index);
+    } else {
+      ranges.push_back({index, 1});
+    }
+  }
+  return ranges;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Read only view of a whole file. Memory mapped where the platform allows,
+// so the pages are only read in when touched, otherwise read into memory
+class MappedFile {
+public:
+  MappedFile() = default;
+  explicit MappedFile(const std::string &path) { open(path); }
+  ~MappedFile() { close(); }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  // False if the file is missing or unreadable
+  bool open(const std::string &path);
+  void close();
+
+  bool isOpen() const { return _data != nullptr; }
+  const unsigned char *data() const { return _data; }
+  size_t size() const { return _size; }
+
+private:
+  const unsigned char *_data = nullptr;
+  size_t _size = 0;
+  bool _mapped = false;
+  std::vector<unsigned char> _buffer; // Without mmap
+};
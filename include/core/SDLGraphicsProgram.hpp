@@ -26,8 +26,15 @@ private:
 
   StorageBuffer _vertexBuffer;
   StorageBuffer _gpuObjectBuffer;
+  StorageBuffer _triangleBuffer;
   StorageBuffer _bvhBuffer;
+  StorageBuffer _parentBuffer;
   StorageBuffer _materialBuffer;
+  StorageBuffer _topLevelBuffer;
+  StorageBuffer _topLevelParentBuffer;
+  StorageBuffer _instanceBuffer;
+  StorageBuffer _wideBvhBuffer;
+  StorageBuffer _lightBuffer;
 
   Window *_window;
   Renderer *_renderer;
@@ -38,8 +45,14 @@ private:
   void update(float deltaTime);
   void render() const;
 
-  void initCornellBox();
-  void initObjects();
+  void drawTraceControls();
+  void drawBVHControls();
+  void drawBVHStats();
+  void drawObjectControls();
+  void rebuildBVH();
+  void refitBVH();
+  // Uploads only what adding or removing an object changed
+  void uploadEdit(const Scene::EditChanges &changes);
 
   void initBuffers();
 };
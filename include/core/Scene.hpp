@@ -1,5 +1,6 @@
 #pragma once
 
+#include <string>
 #include <vector>
 
 #include "core/Face.hpp"
@@ -7,18 +8,176 @@
 #include "rendering/BVH.hpp"
 #include "rendering/Sphere.hpp"
 #include "rendering/Texture.hpp"
+#include "rendering/WideBVH.hpp"
 
+#include "gpumodel/GpuInstance.hpp"
+#include "gpumodel/GpuLight.hpp"
+#include "gpumodel/GpuObject.hpp"
+#include "gpumodel/GpuTriangle.hpp"
 #include "gpumodel/Material.hpp"
 #include "gpumodel/Vertex.hpp"
 
 struct Scene {
+  // Everything the compute shader reads, flattened for upload
+  struct GpuData {
+    std::vector<Vertex> vertices;
+    std::vector<GpuObject> objects;
+    std::vector<GpuTriangle> triangles; // One per object, zero for spheres
+    std::vector<BVHNode> nodes; // Bottom level BVHs back to back
+    std::vector<uint32_t> parents; // Of every node, see BVH::linkParents
+    std::vector<uint32_t> wideNodes; // nodes collapsed, if usesWideBvh()
+    // What the nodes were built with, the settings below can change since
+    unsigned int bvhWidth = 2;
+    bool compressedBvh = false;
+    std::vector<BVHNode> topLevelNodes;
+    std::vector<uint32_t> topLevelParents;
+    std::vector<GpuInstance> instances; // In top level BVH order
+    // Faces of objects with a LIGHT material, for light sampling
+    std::vector<GpuLight> lights;
+    float lightArea = 0.0f; // Of all the lights together
+
+    bool usesWideBvh() const { return bvhWidth > 2 || compressedBvh; }
+  };
+
+  // What a refit touched, so only those parts need to be uploaded
+  struct RefitChanges {
+    IndexRange vertices;
+    IndexRange triangles;
+    IndexRange nodes;
+    bool topLevel = false; // Instances and top level nodes changed
+    bool wideNodes = false;
+    bool lights = false;
+  };
+
+  // What adding or removing an object touched. Buffers can grow, but only
+  // the listed ranges of the nodes and objects (and their triangles) changed
+  struct EditChanges {
+    IndexRange vertices;
+    std::vector<IndexRange> nodes;
+    std::vector<IndexRange> parents;
+    std::vector<IndexRange> objects;
+    bool materials = false;
+    IndexRange textures; // Appended to textures, not on the GPU yet
+    bool topLevel = false; // Instances and top level nodes changed
+    bool wideNodes = false;
+    bool lights = false;
+  };
+
   std::vector<Sphere> spheres;
   std::vector<Object> objects;
   std::vector<Material> materials;     // All the materials used in the scene
   std::vector<Texture> textures;       // All the textures used in the scene
+  GpuData gpu;                         // As of the last update/refit
+
+  // Without instancing, bvh covers every face in world space and the top
+  // level holds a single identity instance of it. With instancing, every
+  // distinct mesh gets its own BVH in local space, so moving objects only
+  // rebuilds the top level
+  bool instancing = false;
   BVH bvh;
+  BVH topLevelBvh;
+  BVH::BuildMode bvhBuildMode = BVH::BuildMode::Parallel;
+  // Used for the bottom level BVHs, the top level's few instances keep the
+  // defaults
+  BVH::BuildSettings bvhSettings;
+  // One per bottom level BVH, as of the last update
+  std::vector<BVHStats> bvhStats;
+  // Optimizes the bottom level BVHs' treelets after building
+  bool restructureBvh = false;
+  // Renumbers the bottom level BVHs' nodes last, so nodes a ray visits
+  // together share cache lines
+  BVH::NodeLayout bvhLayout = BVH::NodeLayout::BuildOrder;
+  // Saves the bottom level BVHs under bvhCacheDir, named by a hash of their
+  // objects, vertices and build settings, and loads them instead of
+  // building while the hash matches
+  bool cacheBvh = true;
+  std::string bvhCacheDir = "cache/bvh";
+  // Children per node the shader traverses, 2 for the binary BVHs or 4 or 8
+  // to collapse them into a WideBVH
+  unsigned int bvhWidth = 2;
+  // Quantizes the collapsed nodes' bounds to a byte per side, for a much
+  // smaller buffer at the cost of slightly looser boxes
+  bool compressedBvh = false;
+
+  // Where the camera sees the whole Cornell box from
+  inline static const glm::vec3 CORNELL_BOX_CAMERA{277.5f, 277.5f, 800.0f};
+
+  // The Cornell box's walls, light and blocks
+  void initCornellBox();
+  // A sphere and the bunny inside the box
+  void initObjects();
 
   void update();
+  // Applies transform changes, either by moving vertices and refitting the
+  // BVH or by moving instances. Adding or removing objects needs an update
+  RefitChanges refit();
+  // Adds an object without a full update. Its faces are inserted into the
+  // world BVH, or with instancing it reuses the BVH of an object with the
+  // same mesh or appends one for its own
+  EditChanges addObject(const Object &object);
+  // Removes its faces from the world BVH, or just its instance. Meshes no
+  // object uses any more stay in the buffers until the next update
+  EditChanges removeObject(size_t index);
+  // Builds the BVH with every mode, with and without treelet restructuring,
+  // and prints how they compare
+  void compareBVHBuilds() const;
+  // Traces random rays through the binary, 4 and 8 wide BVHs, plain and
+  // compressed, and prints how many nodes each visits and its size
+  void compareBVHWidths() const;
+  // Traces random rays through the BVH in every node layout and prints how
+  // fast each is and how close together parents and children ended up
+  void compareBVHLayouts() const;
+  // Loads each model into its own BVH and prints how many closest and any
+  // hit queries per second it answers at every SIMD level, for camera rays
+  // that the queries trace in packets and for random ones they trace alone
+  static void compareRayQueries(const std::vector<std::string> &modelFiles);
+  std::vector<GpuObject> getGpuObjects() const;
   std::vector<Vertex> getVertices() const;
   std::vector<Face> getFaces() const;
+
+private:
+  std::vector<glm::mat4> _modelMatrices; // Used for the last update/refit
+  // Where each object's vertices start in gpu.vertices, removed objects
+  // leave gaps
+  std::vector<unsigned int> _vertexOffsets;
+  // One per object (if instancing) then one for the spheres, unordered
+  std::vector<GpuInstance> _instances;
+  std::vector<AABB> _instanceBounds; // Object space
+  std::vector<unsigned int> _bottomLevelRoots; // In gpu.nodes
+  WideBVH _wideBvh;
+
+  void buildFlat();
+  void buildInstanced();
+  // Builds a BVH over the objects and appends it to the GPU data, returning
+  // its root node
+  unsigned int appendBottomLevel(const std::vector<GpuObject> &gpuObjects);
+  void buildTopLevel();
+  // Loads the BVH from the cache or builds, restructures and saves it
+  void buildBottomLevel(BVH &bottomLevel,
+                        const std::vector<GpuObject> &gpuObjects);
+  void restructureBottomLevel(BVH &bottomLevel) const;
+  void collapseBottomLevels();
+  // Sets up the triangles of gpu.objects[begin, end) from gpu.vertices,
+  // returning the ones that changed
+  IndexRange updateTriangles(size_t begin, size_t end);
+  // Gathers the faces of every light object into gpu.lights in world space
+  // and sets up their alias table
+  void updateLights();
+  // Copies what an edit of the world BVH changed into the GPU data
+  void applyBVHChanges(const BVH::Changes &bvhChanges, EditChanges &changes);
+  // Adds the object's material and textures if the scene lacks them,
+  // returns whether it added a material
+  bool addMaterials(const Object &object);
+
+  std::vector<GpuObject> getSphereObjects() const;
+  // Start anywhere in the box and go in any direction, seeded so every run
+  // traces the same ones
+  static std::vector<Ray> getRandomRays(const AABB &bounds, size_t count);
+  // A size x size image of the box from outside it, in blocks of 4x2 pixels
+  // so neighbouring rays point the same way. size must be a multiple of 4
+  static std::vector<Ray> getCameraRays(const AABB &bounds, unsigned int size);
+  // Without a material, instances decide it
+  static std::vector<GpuObject> getMeshObjects(const Mesh &mesh,
+                                               unsigned int vertexOffset);
+  glm::ivec2 getTextureIndices(const Object &object) const;
 };
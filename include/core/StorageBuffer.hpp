@@ -4,6 +4,8 @@
 
 #include <vector>
 
+#include "core/IndexRange.hpp"
+
 class StorageBuffer {
 public:
   GLuint ssbo = 0;
@@ -17,12 +19,33 @@ public:
   template <typename T>
   void createStorageBuffer(const std::vector<T> &data, GLenum usage,
                            unsigned int bindingPoint) {
-    glGenBuffers(1, &ssbo);
+    // Calling this again reallocates the existing buffer
+    if (ssbo == 0) {
+      glGenBuffers(1, &ssbo);
+    }
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
     glBufferData(GL_SHADER_STORAGE_BUFFER, data.size() * sizeof(T), data.data(),
                  usage);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, bindingPoint, ssbo);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    _capacity = data.size() * sizeof(T);
+    _usage = usage;
+    _bindingPoint = bindingPoint;
+  }
+
+  // Leaves the contents undefined, for buffers only shaders write
+  void allocateStorageBuffer(size_t size, GLenum usage,
+                             unsigned int bindingPoint) {
+    if (ssbo == 0) {
+      glGenBuffers(1, &ssbo);
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, size, nullptr, usage);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, bindingPoint, ssbo);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    _capacity = size;
+    _usage = usage;
+    _bindingPoint = bindingPoint;
   }
 
   template <typename T>
@@ -32,4 +55,43 @@ public:
                     data.data());
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
   }
+
+  // Uploads only the given range of elements
+  template <typename T>
+  void updateStorageBuffer(const std::vector<T> &data,
+                           const IndexRange &range) const {
+    if (range.empty()) {
+      return;
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, range.first * sizeof(T),
+                    range.count * sizeof(T), data.data() + range.first);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  }
+
+  // Uploads only the given ranges. If data outgrew the buffer, reallocates
+  // it with room to spare and uploads everything once
+  template <typename T>
+  void updateStorageBuffer(const std::vector<T> &data,
+                           const std::vector<IndexRange> &ranges) {
+    size_t size = data.size() * sizeof(T);
+    if (size <= _capacity) {
+      for (const auto &range : ranges) {
+        updateStorageBuffer(data, range);
+      }
+      return;
+    }
+
+    _capacity = size + size / 2;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, _capacity, nullptr, _usage);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, size, data.data());
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, _bindingPoint, ssbo);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+  }
+
+private:
+  size_t _capacity = 0; // In bytes
+  GLenum _usage = GL_DYNAMIC_DRAW;
+  unsigned int _bindingPoint = 0;
 };
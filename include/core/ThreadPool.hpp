@@ -0,0 +1,91 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool. Every worker owns a deque: it pushes and pops its
+// own tasks from the back and steals from the front of the others when idle.
+// Threads that are not workers (e.g. the main thread) help out while waiting.
+class ThreadPool {
+public:
+  explicit ThreadPool(
+      unsigned int numThreads = std::thread::hardware_concurrency());
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  // Queue a task. Called from a worker, it goes to that worker's deque
+  void submit(std::function<void()> task);
+
+  // Block until every submitted task has finished, running tasks meanwhile.
+  // Must not be called from inside a task
+  void wait();
+
+  // Run one queued task on the calling thread, false if there was none
+  bool runPendingTask();
+
+  // Number of threads working on tasks, including the waiting caller
+  unsigned int size() const { return _threads.size() + 1; }
+
+  // Split [0, count) into chunks and run function(begin, end) on each. Safe
+  // to call from inside a task since it only waits for its own chunks
+  template <typename Function>
+  void parallelFor(unsigned int count, unsigned int minChunk,
+                   Function &&function) {
+    unsigned int numChunks =
+        std::max(1u, std::min(size() * 4, count / std::max(1u, minChunk)));
+    if (numChunks == 1) {
+      function(0u, count);
+      return;
+    }
+
+    std::atomic<unsigned int> remaining{numChunks};
+    unsigned int chunkSize = (count + numChunks - 1) / numChunks;
+    for (unsigned int i = 0; i < numChunks; i++) {
+      unsigned int begin = std::min(count, i * chunkSize);
+      unsigned int end = std::min(count, begin + chunkSize);
+      submit([&function, &remaining, begin, end] {
+        function(begin, end);
+        remaining--;
+      });
+    }
+
+    while (remaining > 0) {
+      if (!runPendingTask()) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  // Pool shared by the BVH builders and the CPU renderers
+  static ThreadPool &global();
+
+private:
+  struct Queue {
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+  };
+
+  // One queue per worker plus a shared one for outside threads
+  std::vector<std::unique_ptr<Queue>> _queues;
+  std::vector<std::thread> _threads;
+
+  std::atomic<unsigned int> _pending{0}; // Submitted but not finished
+  std::atomic<unsigned int> _queued{0};  // Sitting in a queue
+  std::atomic<bool> _stop{false};
+
+  std::mutex _sleepMutex;
+  std::condition_variable _sleepCondition;
+
+  void workerLoop(unsigned int index);
+  unsigned int queueIndex() const;
+  bool popTask(unsigned int index, std::function<void()> &task);
+};
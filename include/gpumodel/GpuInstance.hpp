@@ -0,0 +1,15 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+// An object placed in the top level BVH, pointing at its bottom level BVH
+struct GpuInstance {
+  // Instances of shared meshes set this, the objects' own materials and
+  // textures are used otherwise
+  static constexpr uint32_t USE_OBJECT_MATERIAL = 0xFFFFFFFF;
+
+  alignas(16) glm::mat4 worldToObject{1.0f};
+  uint32_t rootNode{0}; // Root of the bottom level BVH in the node buffer
+  uint32_t materialIdx{USE_OBJECT_MATERIAL};
+  glm::ivec2 textureIndices{-1, -1}; // Diffuse, Normal, -1 if no texture
+};
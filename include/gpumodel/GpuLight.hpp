@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstdint>
+#include <glm/glm.hpp>
+
+// An emissive face in world space, matching Light in compute.glsl. The
+// lights double as an alias table (Vose 1991) weighted by area: the shader
+// picks one uniformly, then keeps it with aliasProbability or takes its
+// alias instead
+struct GpuLight {
+  glm::vec3 v0{0.0f};
+  float aliasProbability{1.0f};
+  glm::vec3 edge1{0.0f}; // v1 - v0
+  uint32_t alias{0};
+  glm::vec3 edge2{0.0f}; // v2 - v0
+  uint32_t materialIdx{0};
+};
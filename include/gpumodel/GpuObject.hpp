@@ -2,12 +2,21 @@
 
 #include <glm/glm.hpp>
 
-enum class ObjectType { Face, Sphere };
+// Box is for the objects of top level BVHs, which never reach the GPU, and
+// for the slots BVH::removeObject frees. Those do reach the GPU, but no leaf
+// covers them, so traversal never reads one
+enum class ObjectType { Face, Sphere, Box };
 
 struct GpuObject {
-  alignas(16) glm::vec4 data; // Triangle: v0, v1, v2, 0.0f
-                              // Sphere: center, radius
+  // Face: vertex indices v0, v1, v2, 0
+  // Sphere: bits of center, radius, read with getSphere
+  // Box: index of its bounds, 0, 0, 0
+  // Integer indices stay exact past the 2^24 vertices a float can count
+  alignas(16) glm::uvec4 data;
   ObjectType type;
   uint32_t materialIdx;
   glm::ivec2 textureIndices{-1, -1}; // Diffuse, Normal, -1 if no texture
+
+  // Center and radius of a sphere
+  glm::vec4 getSphere() const { return glm::uintBitsToFloat(data); }
 };
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+// A face set up for the shader's Moller-Trumbore test, at the same index as
+// its GpuObject. Traversal reads these instead of gathering three vertices,
+// the vertices are only read for the closest hit's texture coordinates
+struct GpuTriangle {
+  glm::vec4 v0{0.0f};
+  glm::vec4 edge1{0.0f}; // v1 - v0
+  glm::vec4 edge2{0.0f}; // v2 - v0
+};
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+// Buffers of the wavefront path tracer in wavefront.glsl. The host only
+// needs their sizes and the queues' layout, the shaders fill in the rest
+
+// One per pixel, carried between the passes of a sample
+struct GpuPath {
+  glm::vec3 origin{0.0f};
+  uint32_t rngState{0}; // See startSample in compute.glsl
+  glm::vec3 direction{0.0f};
+  float bsdfPdf{0.0f}; // See shadeHit in compute.glsl
+  glm::vec3 throughput{1.0f};
+  uint32_t sampleDimension{0}; // Next pair the path draws
+};
+
+// What shading needs of a path's closest hit, written by the extend pass
+struct GpuPathHit {
+  glm::vec3 normal{0.0f}; // Facing the ray
+  float t{0.0f};
+  glm::vec2 uv{0.0f}; // Texture coordinates
+  uint32_t materialIdx{0};
+  uint32_t flags{0}; // HIT_FRONT_FACE, HIT_TEXTURED, HIT_FACE
+};
+
+// A queue's length next to the glDispatchComputeIndirect arguments that
+// cover it. Appending grows numGroupsX every WAVEFRONT_GROUP_SIZE paths
+struct GpuDispatchQueue {
+  uint32_t numGroupsX{0};
+  uint32_t numGroupsY{1};
+  uint32_t numGroupsZ{1};
+  uint32_t count{0};
+};
@@ -1,29 +1,114 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
 #include <glm/glm.hpp>
+#include <string>
 #include <vector>
 
 #include "core/AABB.hpp"
+#include "core/IndexRange.hpp"
+#include "core/ThreadPool.hpp"
 
+#include "rendering/BVHBinning.hpp"
+#include "rendering/BVHBuildArena.hpp"
 #include "rendering/BVHNode.hpp"
 #include "rendering/BVHObject.hpp"
+#include "rendering/BVHStats.hpp"
+#include "rendering/Ray.hpp"
 
 #include "gpumodel/GpuObject.hpp"
 #include "gpumodel/Vertex.hpp"
 
 #include <iostream>
 
-struct Bin {
-  AABB aabb;
-  unsigned int numObjects = 0;
-};
-
 class BVH {
 public:
+  // Serial and Parallel produce the same binned SAH tree, Parallel only
+  // numbers nodes differently. LBVH sorts by Morton code instead, building
+  // much faster but with a worse tree. SBVH also splits objects that straddle
+  // a plane, referencing them from several leaves, for the best tree but the
+  // slowest build
+  enum class BuildMode { Serial, Parallel, LBVH, SBVH };
+
+  // Largest sweepThreshold, the sweep keeps an area per object on the stack
+  static constexpr uint MAX_SWEEP_OBJECTS = 256;
+
+  // Tunables of the builders, applied to the next build
+  struct BuildSettings {
+    unsigned int binCount = 16; // Per axis, up to MAX_BIN_COUNT
+    unsigned int leafSize = 2;  // Nodes this small are never split
+    // Nodes with fewer objects are split by sorting them and trying every
+    // split between neighbours instead of binning. Up to MAX_SWEEP_OBJECTS
+    unsigned int sweepThreshold = 32;
+    // Relative costs of visiting a node and intersecting an object, the SAH
+    // only depends on their ratio
+    float traversalCost = 1.0f;
+    float intersectionCost = 1.0f;
+  };
+
+  // Order of the nodes in memory. Every layout keeps sibling pairs next to
+  // each other and parents before their children. BuildOrder leaves them
+  // as the builder (or restructuring) numbered them. DepthFirst puts every
+  // second child's subtree right after its parent, then the first child's
+  // (see reorderNodes). VanEmdeBoas splits the tree at half its height and
+  // lays out the top, then each bottom subtree, each the same way, so a
+  // subtree of any height sits in one block of memory
+  enum class NodeLayout { BuildOrder, BreadthFirst, DepthFirst, VanEmdeBoas };
+
+  // Nodes and objects an edit rewrote, merged into ranges to upload
+  struct Changes {
+    std::vector<IndexRange> nodes;
+    std::vector<IndexRange> objects;
+  };
+
   BVH() = default;
 
   void buildBVH(const std::vector<GpuObject> &gpuObjects,
-                const std::vector<Vertex> &vertices);
+                const std::vector<Vertex> &vertices,
+                BuildMode mode = BuildMode::Parallel);
+  // Builds over plain boxes, e.g. the instances of a top level BVH. Leaf
+  // objects are Box objects whose data.x is the index into bounds
+  void buildBVH(const std::vector<AABB> &bounds,
+                BuildMode mode = BuildMode::Serial);
+  // Refits every bound to moved vertices without changing the topology.
+  // Returns the nodes whose bounds changed
+  IndexRange refit(const std::vector<Vertex> &vertices);
+  // Builds a BVH over the objects and inserts it as one subtree, next to
+  // the node where it adds the least SAH cost (Bittner et al. 2015), then
+  // rotates the nodes above it (Kopta et al. 2012). Costs about as much as
+  // building the new objects alone, but the tree drifts from what a
+  // rebuild would give
+  Changes insert(const std::vector<GpuObject> &gpuObjects,
+                 const std::vector<Vertex> &vertices);
+  // Removes every object the predicate matches. A leaf left empty is
+  // replaced by its sibling and the nodes above are rotated. The freed
+  // slots stay in getGpuObjects() as Box objects until inserts reuse them.
+  // The last object is never removed, an empty tree has no root
+  template <typename Predicate> Changes removeIf(Predicate predicate) {
+    std::vector<uint32_t> positions;
+    for (uint32_t i = 0; i < _objects.size(); i++) {
+      if (predicate(_objects[i])) {
+        positions.push_back(i);
+      }
+    }
+    return removeObjects(std::move(positions));
+  }
+  // Rebuilds every treelet of up to TREELET_LEAVES subtrees into the shape
+  // with the lowest SAH cost (Karras and Aila 2013), bottom up and in
+  // parallel across subtrees. Works after any build mode and never makes
+  // the tree worse
+  void restructureTreelets();
+  // Renumbers the nodes in the layout, the tree itself stays the same
+  void reorderNodes(NodeLayout layout);
+  // Points the children of nodes [begin, end) back at them in parents,
+  // which grows to match nodes, for traversals that climb back up the tree
+  // instead of keeping a stack. nodes can hold several trees back to back,
+  // their roots' entries are never read. Returns the entries that changed
+  static IndexRange linkParents(const std::vector<BVHNode> &nodes,
+                                size_t begin, size_t end,
+                                std::vector<uint32_t> &parents);
+
   void updateNodeBounds(unsigned int nodeIndex,
                         const std::vector<Vertex> &vertices);
   void subdivide(unsigned int nodeIndex, const std::vector<Vertex> &vertices);
@@ -36,16 +121,183 @@ public:
   glm::vec3 getCentroid(const GpuObject &object,
                         const std::vector<Vertex> &vertices) const;
 
+  // Closest hit within closest, the same way hitBlas in compute.glsl finds
+  // it. objects must be in getGpuObjects() order
+  float intersect(const Ray &ray, const std::vector<GpuObject> &objects,
+                  const std::vector<Vertex> &vertices, float closest,
+                  TraversalStats &stats) const;
+
+  // Closest hit of each ray within its [tMin, tMax], traced on the global
+  // pool. Runs of rays that all point into the same octant go through the
+  // tree together as packets of 4 (SSE) or 8 (AVX2), testing each box and
+  // triangle against the whole packet at once. Other rays, and every ray
+  // without SIMD, are traced one at a time
+  std::vector<RayHit> intersect(const std::vector<RayQuery> &queries,
+                                const std::vector<Vertex> &vertices) const;
+  // Whatever hit each ray finds first within its [tMin, tMax], for
+  // visibility checks that only need to know whether it is blocked
+  std::vector<RayHit> intersectAny(const std::vector<RayQuery> &queries,
+                                   const std::vector<Vertex> &vertices) const;
+
+  // Hash of everything a build's result depends on, to key saved trees by.
+  // extra covers what the caller does to the tree afterwards, e.g. whether
+  // it restructured it
+  static uint64_t getCacheKey(const std::vector<GpuObject> &gpuObjects,
+                              const std::vector<Vertex> &vertices,
+                              BuildMode mode, const BuildSettings &settings,
+                              uint64_t extra = 0);
+  // Writes the nodes, objects and objects' bounds to path, tagged with key
+  bool save(const std::string &path, uint64_t key) const;
+  // Maps the file and takes its tree if it was saved with key by this
+  // version. Otherwise returns false and leaves the BVH as it was
+  bool load(const std::string &path, uint64_t key);
+
+  // Clamped to what the builders support
+  void setBuildSettings(const BuildSettings &settings);
+  const BuildSettings &getBuildSettings() const { return _settings; }
+
   const std::vector<BVHNode> &getNodes() const { return _nodes; }
-  std::vector<GpuObject> getGpuObjects() const;
+  // In leaf order, gathered once at the end of the build
+  const std::vector<GpuObject> &getGpuObjects() const { return _objects; }
+  // Can exceed the number of objects built from, SBVH duplicates them
+  size_t getObjectCount() const { return _objects.size(); }
 
-  friend std::ostream &operator<<(std::ostream &os, const BVH &bvh);
+  BuildMode getBuildMode() const { return _buildMode; }
+  float getBuildTime() const { return _buildTime; } // In milliseconds
+  // Expected cost of tracing a ray through the tree, relative to the root
+  float getSAHCost() const;
+  // Walks the whole tree, the EPO estimate also samples the objects' surfaces
+  BVHStats getStats(const std::vector<Vertex> &vertices) const;
 
 private:
   unsigned int _nodesUsed = 1;
   std::vector<BVHNode> _nodes;
-  std::vector<BVHObject> _objects;
+  std::vector<GpuObject> _objects;
+  // Kept after the build, refit rewrites the bounds in place
+  BVHBuildArena _arena;
+
+  // Parent of every node and leaf of every object, only kept while the tree
+  // is being edited. Anything that renumbers nodes clears them
+  std::vector<uint32_t> _parents;
+  std::vector<uint32_t> _objectLeaves; // NO_LEAF for free slots
+  // Object slots removals freed, reused by inserted single object leaves
+  std::vector<uint32_t> _freeObjects;
+  // What the current edit touched
+  std::vector<uint32_t> _dirtyNodes;
+  std::vector<uint32_t> _dirtyObjects;
+
+  BuildMode _buildMode = BuildMode::Parallel;
+  BuildSettings _settings;
+  float _buildTime = 0.0f;
+
+  void subdivideParallel(unsigned int nodeIndex,
+                         const std::vector<Vertex> &vertices,
+                         std::atomic<unsigned int> &nodesUsed,
+                         ThreadPool &pool);
+  float findBestSplitParallel(const BVHNode &node, int &splitAxis,
+                              float &splitPos, ThreadPool &pool) const;
+
+  // Builds the tree over the objects already written to _arena, then gathers
+  // them into _objects in leaf order
+  void build(const std::vector<GpuObject> &gpuObjects,
+             const std::vector<Vertex> &vertices, BuildMode mode);
+  void buildLBVH(const std::vector<Vertex> &vertices, ThreadPool &pool);
+  // Recomputes a node's bounds from its objects or children
+  void refitNode(unsigned int nodeIndex, const std::vector<Vertex> &vertices);
+
+  // Restructures the subtree's treelets bottom up, filling in the SAH cost
+  // of every node in it
+  void restructureSubtree(unsigned int nodeIndex, unsigned int depth,
+                          std::vector<float> &costs, ThreadPool &pool);
+  void restructureTreelet(unsigned int rootIndex, std::vector<float> &costs);
+
+  Changes removeObjects(std::vector<uint32_t> positions);
+  void removeObject(uint32_t position);
+  // Builds _parents and _objectLeaves if an edit has not already
+  void prepareEdit();
+  // Turns the dirty lists into ranges and clears them
+  Changes finishEdit();
+  // Best node to become the sibling of a subtree with the given bounds
+  unsigned int findInsertSibling(const AABB &bounds) const;
+  // Points the node's children or objects back at it after it moved
+  void linkChildren(unsigned int nodeIndex);
+  // Moves the last sibling pair into the freed pair at first. Returns
+  // where a node that was in the last pair ended up
+  unsigned int compactPair(unsigned int first, unsigned int nodeIndex);
+  // Refits the nodes from nodeIndex up to the root, rotating each one
+  void refitUpwards(unsigned int nodeIndex);
+  // Swaps a child of the node with a grandchild on the other side if that
+  // shrinks the SAH cost, picking the swap that shrinks it the most
+  void rotate(unsigned int nodeIndex);
+  void setBoundsFromChildren(unsigned int nodeIndex);
+
+  // Whether the subtree holds the object, adding the cost of every node in
+  // it that contains the point but not the object
+  bool addOverlapCost(unsigned int nodeIndex, const glm::vec3 &point,
+                      const GpuObject &object, float epsilon,
+                      float &cost) const;
+
+  void buildSBVH(const std::vector<GpuObject> &gpuObjects,
+                 const std::vector<Vertex> &vertices);
+  void subdivideSpatial(unsigned int nodeIndex,
+                        std::vector<BVHObject> &references,
+                        const std::vector<Vertex> &vertices, float rootArea,
+                        unsigned int depth);
+  float findSpatialSplit(const std::vector<BVHObject> &references,
+                         const AABB &bounds, int &splitAxis, float &splitPos,
+                         const std::vector<Vertex> &vertices) const;
+  // Bounds of the part of the object between lo and hi along axis
+  AABB clipObject(const BVHObject &object, int axis, float lo, float hi,
+                  const std::vector<Vertex> &vertices) const;
+
+  // Bins whole references, SBVH's object splits
+  float findObjectSplit(const BVHObject *objects, unsigned int count,
+                        int &splitAxis, float &splitPos) const;
+
+  // Sweeps the bins of one axis and keeps the split if it beats bestCost
+  void evaluateBins(const Bin *bins, float min, float max,
+                    int axis, float &bestCost, int &splitAxis,
+                    float &splitPos) const;
+  // Partitions the node's objects around the plane, returns the first right
+  unsigned int partition(const BVHNode &node, int splitAxis,
+                         float splitPos);
+  // Moves the objects of the node's first object's type to the front,
+  // returning false if they are all of that type
+  bool splitTypes(const BVHNode &node, unsigned int &splitIndex);
+  // Exact SAH over every split between neighbours along each axis. Leaves
+  // the node's objects sorted along splitAxis, split before splitIndex
+  float findSweepSplit(const BVHNode &node, int &splitAxis,
+                       unsigned int &splitIndex);
+  // Splits the node's objects if the SAH says it pays off, returning the
+  // first right one. Binning runs on pool if given and the node is large.
+  // A node that would become a leaf mixing types is split by type instead
+  bool splitObjects(const BVHNode &node, const std::vector<Vertex> &vertices,
+                    ThreadPool *pool, unsigned int &splitIndex);
+
+  // Nodes with more objects bin on all threads, smaller ones bin serially
+  static constexpr uint PARALLEL_BINNING_THRESHOLD = 16384;
+  // Subtrees with fewer objects are built by the task that reached them
+  static constexpr uint PARALLEL_TASK_THRESHOLD = 512;
+
+  // Bumped whenever the file layout or a builder's output changes, so old
+  // saved trees are rebuilt instead of loaded
+  static constexpr uint32_t FILE_VERSION = 4;
+
+  static constexpr uint32_t NO_LEAF = UINT32_MAX;
+  // Dirty ranges closer than this many elements are uploaded as one
+  static constexpr size_t UPLOAD_GAP = 64;
+
+  // Surface points sampled for the EPO estimate
+  static constexpr uint EPO_SAMPLES = 4096;
+
+  // Treelets are optimized over every way of grouping this many subtrees
+  static constexpr uint TREELET_LEAVES = 7;
+  // Subtrees above this depth are restructured as separate tasks
+  static constexpr uint PARALLEL_TREELET_DEPTH = 8;
 
-  static constexpr uint MIN_OBJECTS = 2;
-  static constexpr uint BIN_COUNT = 16;
+  // Spatial splits are only tried where the object split children overlap
+  // by more than this fraction of the root's area (Stich et al. 2009)
+  static constexpr float SPATIAL_SPLIT_ALPHA = 1e-5f;
+  // Keeps SBVH depth within the shader's traversal stack
+  static constexpr uint SBVH_MAX_DEPTH = 48;
 };
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <glm/glm.hpp>
+
+#include "core/AABB.hpp"
+
+#include "rendering/BVHBuildArena.hpp"
+
+struct Bin {
+  AABB aabb;
+  unsigned int numObjects = 0;
+};
+
+// Kernels behind the binned SAH builders. Each has a scalar, an SSE and an
+// AVX2 version, picked at runtime from what the CPU supports. All of them
+// give bit for bit the same results, so the tree never depends on the CPU.
+// BVH::intersect picks its ray packet width from the same level
+enum class SimdLevel { Scalar, SSE, AVX2 };
+
+// Most bins a kernel handles per axis
+constexpr unsigned int MAX_BIN_COUNT = 64;
+
+// Best level the CPU runs, detected once
+SimdLevel getSupportedSimdLevel();
+// Level the kernels use, the supported one unless lowered to compare
+SimdLevel getSimdLevel();
+// Clamped to the supported level
+void setSimdLevel(SimdLevel level);
+const char *getSimdLevelName(SimdLevel level);
+
+// Bounds of the centroids of the count objects at indices
+AABB getCentroidBounds(const BVHBuildArena &arena, const uint32_t *indices,
+                       unsigned int count);
+
+// Bins the objects by centroid along all three axes in one pass, into
+// bins[axis * binCount + bin]. The bins split centroidBounds evenly, a flat
+// axis puts everything into its first bin. Overwrites what bins held
+void binObjects(const BVHBuildArena &arena, const uint32_t *indices,
+                unsigned int count, const AABB &centroidBounds,
+                unsigned int binCount, Bin *bins);
+
+// SAH cost of splitting after each of the first binCount - 1 bins, the
+// left and right areas weighted by their object counts. NaN if one side is
+// empty
+void sweepBins(const Bin *bins, unsigned int binCount, float *costs);
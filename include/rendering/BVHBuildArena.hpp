@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "core/AABB.hpp"
+
+#include "gpumodel/GpuObject.hpp"
+
+// What the builders need to know about each object, one array per axis and
+// indexed by the object's slot. Builders only ever move the 32 bit indices,
+// the bounds and centroids stay where they were written. The arrays keep
+// their capacity, so rebuilding a BVH over as many objects does not allocate
+struct BVHBuildArena {
+  std::vector<float> centroids[3];
+  std::vector<float> boundsMin[3];
+  std::vector<float> boundsMax[3];
+  // Leaves never mix types, so the shader picks the test once per leaf
+  std::vector<ObjectType> types;
+  // Slot of the object at each position, permuted by the build
+  std::vector<uint32_t> indices;
+
+  // Morton codes and radix sort scratch for LBVH
+  std::vector<uint32_t> codes;
+  std::vector<uint32_t> tempCodes;
+  std::vector<uint32_t> tempIndices;
+
+  size_t size() const { return indices.size(); }
+
+  void resize(size_t size) {
+    for (int axis = 0; axis < 3; axis++) {
+      centroids[axis].resize(size);
+      boundsMin[axis].resize(size);
+      boundsMax[axis].resize(size);
+    }
+    types.resize(size);
+    indices.resize(size);
+  }
+
+  void set(uint32_t slot, const AABB &aabb, const glm::vec3 &centroid) {
+    setBounds(slot, aabb);
+    for (int axis = 0; axis < 3; axis++) {
+      centroids[axis][slot] = centroid[axis];
+    }
+  }
+
+  void setBounds(uint32_t slot, const AABB &aabb) {
+    for (int axis = 0; axis < 3; axis++) {
+      boundsMin[axis][slot] = aabb.min[axis];
+      boundsMax[axis][slot] = aabb.max[axis];
+    }
+  }
+
+  AABB getBounds(uint32_t slot) const {
+    return {{boundsMin[0][slot], boundsMin[1][slot], boundsMin[2][slot]},
+            {boundsMax[0][slot], boundsMax[1][slot], boundsMax[2][slot]}};
+  }
+
+  glm::vec3 getCentroid(uint32_t slot) const {
+    return {centroids[0][slot], centroids[1][slot], centroids[2][slot]};
+  }
+};
@@ -7,8 +7,7 @@
 #include <glm/glm.hpp>
 
 struct BVHObject {
-  glm::vec4 data; // Triangle: v0, v1, v2, 0.0f
-                  // Sphere: center, radius
+  glm::uvec4 data; // Same as GpuObject::data
   ObjectType type;
   uint32_t materialIdx;
   glm::ivec2 textureIndices{-1, -1}; // Diffuse, Normal, -1 if no texture
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <ostream>
+
+// Numbers to judge a built BVH by, see BVH::getStats
+struct BVHStats {
+  // Leaves with 1, 2, ... objects, the last bucket also counts larger ones
+  static constexpr size_t LEAF_HISTOGRAM_SIZE = 8;
+
+  float sahCost = 0.0f;
+  // Of the leaves, the root is at depth 0
+  unsigned int minDepth = 0;
+  float avgDepth = 0.0f;
+  unsigned int maxDepth = 0;
+  std::array<size_t, LEAF_HISTOGRAM_SIZE> leafSizes{};
+  size_t numNodes = 0;
+  size_t numLeaves = 0;
+  size_t numObjects = 0; // References, SBVH can duplicate objects
+  // Surface area shared by sibling boxes relative to the root's, rays
+  // through it have to enter both
+  float overlap = 0.0f;
+  // Estimated end point overlap (Aila et al. 2013): the cost of the nodes a
+  // random surface point lies in without belonging to them. It predicts ray
+  // tracing cost better than the SAH cost when boxes overlap
+  float epo = 0.0f;
+  size_t memoryBytes = 0; // Nodes and objects as uploaded
+};
+
+std::ostream &operator<<(std::ostream &os, const BVHStats &stats);
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "core/Camera.hpp"
+#include "core/Scene.hpp"
+#include "rendering/Sampler.hpp"
+
+// Path traces the scene on the CPU, for machines without a GL context. It
+// reads the same flattened buffers as compute.glsl and scatters rays the
+// same way, so its images match the window's. Textures only live on the
+// GPU, so textured objects use their material's color
+class CpuRenderer {
+public:
+  CpuRenderer(unsigned int width, unsigned int height);
+
+  // Adds samplesPerPixel samples to every pixel, averaged with the earlier
+  // ones like the shader's frames. Tiles of the image go to the threads of
+  // the global pool as they finish their last one
+  void render(const Scene &scene, unsigned int samplesPerPixel);
+  // Clamped to [0, 1] like the window shows it, throws if it cannot write
+  void savePPM(const std::string &fileName) const;
+
+  Camera &getCamera() { return _camera; }
+
+  void resetFrameCount();
+  unsigned int getSampleCount() const { return _sampleCount; }
+  // Renderer::getLightSampling
+  bool &getLightSampling() { return _lightSampling; }
+  // Renderer::getSamplerType
+  SamplerType &getSamplerType() { return _samplerType; }
+
+private:
+  static constexpr unsigned int TILE_SIZE = 16;
+
+  Camera _camera;
+  unsigned int _width;
+  unsigned int _height;
+  // Averages so far, rows from the bottom up like the GL image
+  std::vector<glm::vec3> _pixels;
+  unsigned int _sampleCount = 0;
+  bool _lightSampling = true;
+  SamplerType _samplerType = SamplerType::Sobol;
+};
@@ -17,6 +17,8 @@ class PPM {
 public:
   // Constructor loads a filename with the .ppm extension
   PPM(std::string fileName);
+  // Constructor creates a black image to fill in with setPixel
+  PPM(int width, int height);
 
   // NOTE: commented out as a destructor is not needed here
   // Destructor clears any memory that has been allocated
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "gpumodel/GpuObject.hpp"
+#include "gpumodel/GpuTriangle.hpp"
+#include "gpumodel/Vertex.hpp"
+
+// CPU versions of the intersection tests in compute.glsl, so tools can trace
+// the same BVHs the shader does
+
+struct Ray {
+  glm::vec3 origin;
+  glm::vec3 direction;
+};
+
+// A ray of a batched BVH query, looking for hits within [tMin, tMax]
+struct RayQuery {
+  Ray ray;
+  float tMin = 0.001f;
+  float tMax = INFINITY;
+};
+
+// Result of a query, t stays at the ray's tMax on a miss
+struct RayHit {
+  static constexpr uint32_t NO_HIT = UINT32_MAX;
+
+  float t = INFINITY;
+  glm::vec2 uv{0.0f}; // Barycentric coordinates of v1 and v2 on triangles
+  uint32_t objectIdx = NO_HIT; // Into the BVH's getGpuObjects()
+
+  bool hit() const { return objectIdx != NO_HIT; }
+};
+
+// Entry and exit distances of the ray through the box, a miss if x > y
+inline glm::vec2 intersectAABB(const Ray &ray, const glm::vec3 &boxMin,
+                               const glm::vec3 &boxMax) {
+  glm::vec3 tMin = (boxMin - ray.origin) / ray.direction;
+  glm::vec3 tMax = (boxMax - ray.origin) / ray.direction;
+  glm::vec3 t1 = glm::min(tMin, tMax);
+  glm::vec3 t2 = glm::max(tMin, tMax);
+  float tNear = std::max(std::max(t1.x, t1.y), t1.z);
+  float tFar = std::min(std::min(t2.x, t2.y), t2.z);
+  return {tNear, tFar};
+}
+
+// Takes the edges a = v1 - v0 and b = v2 - v0, like GpuTriangle stores them
+inline bool intersectTriangleEdges(const Ray &ray, const glm::vec3 &v0,
+                                   const glm::vec3 &a, const glm::vec3 &b,
+                                   float &t, glm::vec2 &uv) {
+  glm::vec3 pvec = glm::cross(ray.direction, b);
+  float det = glm::dot(a, pvec);
+  glm::vec3 n = glm::cross(b, a);
+  if (det * det <
+      1e-8f * glm::dot(n, n) * glm::dot(ray.direction, ray.direction)) {
+    return false;
+  }
+
+  float idet = 1.0f / det;
+  glm::vec3 tvec = ray.origin - v0;
+  float u = glm::dot(tvec, pvec) * idet;
+  if (u < 0.0f || u > 1.0f) {
+    return false;
+  }
+
+  glm::vec3 qvec = glm::cross(tvec, a);
+  float v = glm::dot(ray.direction, qvec) * idet;
+  if (v < 0.0f || u + v > 1.0f) {
+    return false;
+  }
+
+  t = glm::dot(b, qvec) * idet;
+  uv = {u, v};
+  return true;
+}
+
+inline bool intersectTriangle(const Ray &ray, const glm::vec3 &v0,
+                              const glm::vec3 &v1, const glm::vec3 &v2,
+                              float &t, glm::vec2 &uv) {
+  return intersectTriangleEdges(ray, v0, v1 - v0, v2 - v0, t, uv);
+}
+
+inline bool intersectTriangle(const Ray &ray, const glm::vec3 &v0,
+                              const glm::vec3 &v1, const glm::vec3 &v2,
+                              float &t) {
+  glm::vec2 uv;
+  return intersectTriangle(ray, v0, v1, v2, t, uv);
+}
+
+inline bool intersectSphere(const Ray &ray, const glm::vec4 &sphere,
+                            float tMin, float tMax, float &t) {
+  glm::vec3 oc = glm::vec3(sphere) - ray.origin;
+  float a = glm::dot(ray.direction, ray.direction);
+  float h = glm::dot(oc, ray.direction);
+  float c = glm::dot(oc, oc) - sphere.w * sphere.w;
+  float discriminant = h * h - a * c;
+  if (discriminant < 0.0f) {
+    return false;
+  }
+
+  float sqrtd = std::sqrt(discriminant);
+  t = (h - sqrtd) / a;
+  if (t < tMin || t > tMax) {
+    t = (h + sqrtd) / a;
+    if (t < tMin || t > tMax) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Distance to the object if it is hit within [tMin, tMax]
+inline bool intersectObject(const Ray &ray, const GpuObject &object,
+                            const std::vector<Vertex> &vertices, float tMin,
+                            float tMax, float &t) {
+  if (object.type == ObjectType::Sphere) {
+    return intersectSphere(ray, object.getSphere(), tMin, tMax, t);
+  }
+  if (object.type != ObjectType::Face) {
+    return false;
+  }
+  return intersectTriangle(ray, vertices[object.data.x].position,
+                           vertices[object.data.y].position,
+                           vertices[object.data.z].position, t) &&
+         t >= tMin && t <= tMax;
+}
+
+// Same as above from the object's precomputed triangle, like hitFace does
+inline bool intersectObject(const Ray &ray, const GpuObject &object,
+                            const GpuTriangle &triangle, float tMin,
+                            float tMax, float &t) {
+  if (object.type == ObjectType::Sphere) {
+    return intersectSphere(ray, object.getSphere(), tMin, tMax, t);
+  }
+  if (object.type != ObjectType::Face) {
+    return false;
+  }
+  glm::vec2 uv;
+  return intersectTriangleEdges(ray, glm::vec3(triangle.v0),
+                                glm::vec3(triangle.edge1),
+                                glm::vec3(triangle.edge2), t, uv) &&
+         t >= tMin && t <= tMax;
+}
+
+// Work done while tracing, to compare BVH layouts
+struct TraversalStats {
+  size_t nodeVisits = 0;
+  size_t boxTests = 0;
+  size_t objectTests = 0;
+};
@@ -2,8 +2,10 @@
 
 #include "core/Camera.hpp"
 #include "core/Scene.hpp"
+#include "core/StorageBuffer.hpp"
 
 #include "rendering/Mesh.hpp"
+#include "rendering/Sampler.hpp"
 #include "rendering/Texture.hpp"
 #include "rendering/VertexBufferLayout.hpp"
 
@@ -14,6 +16,12 @@ class Entity;
 
 class Renderer {
 public:
+  // Tiles runs compute.glsl as one invocation per pixel. PersistentThreads
+  // runs it as a fixed number of groups whose invocations pull pixels from
+  // a global counter until the frame is done. Wavefront traces in separate
+  // generate, extend, shade and accumulate passes (wavefront.glsl)
+  enum class TraceMode { Tiles, PersistentThreads, Wavefront };
+
   Renderer(const Window &window);
 
   void render(const Scene &scene) const;
@@ -25,15 +33,57 @@ public:
 
   void flipDebug() { _debug = !_debug; }
 
+  TraceMode getTraceMode() const { return _traceMode; }
+  void setTraceMode(TraceMode mode) { _traceMode = mode; }
+  // Groups of 64 PersistentThreads launches, enough to fill the GPU
+  unsigned int &getPersistentGroups() { return _persistentGroups; }
+  // Binary BVHs are traversed through their parent links instead of a
+  // fixed size stack, so no depth is too deep
+  bool &getStacklessBvh() { return _stacklessBvh; }
+  // Samples the scene's lights at every diffuse bounce (next event
+  // estimation), weighted against scattering with MIS
+  bool &getLightSampling() { return _lightSampling; }
+  // Where the paths' random numbers come from, see Sampler.hpp. The shaders
+  // mirror Sampler, so the CpuRenderer converges to the same image
+  SamplerType &getSamplerType() { return _samplerType; }
+
   void createDebugFBO(unsigned int textureID);
 
 private:
   Camera _camera;
   uint _frameCount = 0;
 
+  // Match SAMPLES and MAX_BOUNCES in compute.glsl
+  static constexpr unsigned int SAMPLES_PER_FRAME = 4;
+  static constexpr unsigned int MAX_BOUNCES = 32;
+  // Matches WAVEFRONT_GROUP_SIZE in wavefront.glsl
+  static constexpr unsigned int WAVEFRONT_GROUP_SIZE = 64;
+  // Indices into the dispatch queue buffer, see wavefront.glsl
+  static constexpr unsigned int HIT_QUEUE = 2;
+
   Shader _shader;
   Shader _computeShader;
 
+  TraceMode _traceMode = TraceMode::Tiles;
+  unsigned int _persistentGroups = 512;
+  bool _stacklessBvh = true;
+  bool _lightSampling = true;
+  SamplerType _samplerType = SamplerType::Sobol;
+  StorageBuffer _blueNoiseBuffer; // getBlueNoise's mask
+  Shader _persistentShader;
+  StorageBuffer _workBuffer; // Next pixel to hand out
+
+  Shader _generateShader;
+  Shader _extendShader;
+  Shader _shadeShader;
+  Shader _accumulateShader;
+  StorageBuffer _pathBuffer;
+  StorageBuffer _pathHitBuffer;
+  StorageBuffer _rayQueueBuffer;
+  StorageBuffer _hitQueueBuffer;
+  StorageBuffer _dispatchQueueBuffer;
+  StorageBuffer _radianceBuffer;
+
   Mesh _screenQuad;
   VertexBufferLayout _screenQuadLayout;
   Texture _texture;
@@ -43,4 +93,12 @@ private:
   GLuint _debugFBO = 0;
 
   const Window *_window;
+
+  // Sets what compute.glsl's main reads, for Tiles and PersistentThreads
+  void setFrameUniforms(const Shader &shader, const Scene &scene) const;
+  // Sets what traversal and shadeHit read
+  void setTraceUniforms(const Shader &shader, const Scene &scene) const;
+  void traceWavefront(const Scene &scene) const;
+  // Empties the queue, or fills it with count paths
+  void setQueue(unsigned int queue, unsigned int count = 0) const;
 };
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <vector>
+
+// Where the path tracer's random numbers come from, matching u_Sampler in
+// compute.glsl. Random is a PCG stream per pixel and sample. Sobol draws
+// every pair of dimensions from a 2D Sobol sequence, shuffled and Owen
+// scrambled per pixel and pair (Burley 2020), so each pixel's samples stay
+// stratified however many it takes. BlueNoise scrambles the sequence the
+// same way for every pixel and shifts each pixel's copy by a tileable blue
+// noise mask instead, so the error left at low sample counts looks like
+// blue noise rather than white (Georgiev and Fajardo 2016)
+enum class SamplerType { Random, Sobol, BlueNoise };
+
+// Side of the blue noise mask, BLUE_NOISE_SIZE in compute.glsl
+constexpr unsigned int BLUE_NOISE_SIZE = 64;
+
+// Ranks of a BLUE_NOISE_SIZE x BLUE_NOISE_SIZE void and cluster mask
+// (Ulichney 1993) scaled to [0, 1), row by row. Generated on the first
+// call, seeded so every run gets the same mask
+const std::vector<float> &getBlueNoise();
+
+// PCG hash, also what seeds the shader's streams
+uint32_t hashUint(uint32_t value);
+// Owen scrambles the bits of value from the top down (Laine and Karras 2011)
+uint32_t owenScramble(uint32_t value, uint32_t seed);
+// The first two dimensions of the Sobol sequence, as 32 bit fractions
+glm::uvec2 sobol2D(uint32_t index);
+
+// The CPU renderer's copy of the shader's sampler, one per path sample.
+// Every call draws the next pair of dimensions, 1D draws waste the second
+class Sampler {
+public:
+  // index counts the pixel's samples over all passes
+  Sampler(SamplerType type, glm::uvec2 pixel, uint32_t width, uint32_t index);
+
+  // In [0, 1)
+  glm::vec2 next2D();
+  float next1D() { return next2D().x; }
+
+private:
+  SamplerType _type;
+  glm::uvec2 _pixel;
+  uint32_t _pixelSeed;
+  uint32_t _index;
+  uint32_t _dimension = 0;
+  uint32_t _rngState; // Random's stream
+
+  float nextRandom();
+};
@@ -15,6 +15,10 @@ public:
   Shader() = default;
   Shader(const std::string &vertexPath, const std::string &fragmentPath);
   Shader(const std::string &computePath);
+  // Compiles the files joined in order, with defines added after the first
+  // one's #version line. Lets several programs share one shader library
+  Shader(const std::vector<std::string> &computePaths,
+         const std::string &defines);
   ~Shader() { glDeleteProgram(id); }
 
   void load(const std::string &vertexPath, const std::string &fragmentPath);
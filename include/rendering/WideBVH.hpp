@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "core/AABB.hpp"
+
+#include "rendering/BVHNode.hpp"
+#include "rendering/Ray.hpp"
+
+#include "gpumodel/GpuObject.hpp"
+#include "gpumodel/Vertex.hpp"
+
+// A binary BVH collapsed into nodes with up to 4 or 8 children, so a ray
+// tests all of them in one step and needs fewer levels and stack entries.
+// Nodes are stored as flat 32 bit words (the shader reads them as a uint
+// array, so one shader handles every width) with the children's fields laid
+// out one after another, e.g. for width 4:
+//   minX[4] minY[4] minZ[4] maxX[4] maxY[4] maxZ[4] child[4] numObjects[4]
+// A child is a node index if numObjects is 0 and its first object otherwise.
+// Used children come first, the rest have child set to INVALID_CHILD.
+//
+// Compressed nodes replace the float bounds with one byte per side, relative
+// to the node's own box (Ylitie et al. 2017):
+//   origin.xyz, exponents, qMinX[4] .. qMaxZ[4] (4 per word), child[4],
+//   numObjects[4]
+// A child box is origin + q * 2^exponent per axis, rounded outwards so it
+// always contains the real one. Width 2 compressed is the compact
+// alternative to the binary BVHNode
+class WideBVH {
+public:
+  enum Field { MIN_X, MIN_Y, MIN_Z, MAX_X, MAX_Y, MAX_Z };
+  static constexpr unsigned int MAX_WIDTH = 8;
+  static constexpr uint32_t INVALID_CHILD = 0xFFFFFFFF;
+  // Words before the quantized bounds of a compressed node
+  static constexpr unsigned int COMPRESSED_HEADER_SIZE = 4;
+
+  WideBVH() = default;
+
+  // Collapses the binary BVHs rooted at roots, which share nodes and keep
+  // their object indices
+  void collapse(const std::vector<BVHNode> &nodes,
+                const std::vector<unsigned int> &roots, unsigned int width,
+                bool compressed = false);
+
+  // Wide node a collapsed binary root became
+  unsigned int getRoot(unsigned int binaryRoot) const;
+
+  // Closest hit within closest, starting at the given wide node
+  float intersect(const Ray &ray, unsigned int root,
+                  const std::vector<GpuObject> &objects,
+                  const std::vector<Vertex> &vertices, float closest,
+                  TraversalStats &stats) const;
+
+  // As the shader decodes it, so possibly larger than the original
+  AABB getChildBounds(unsigned int node, unsigned int child) const;
+  uint32_t getChild(unsigned int node, unsigned int child) const {
+    return _data[node * getNodeSize() + getChildOffset() + child];
+  }
+  uint32_t getNumObjects(unsigned int node, unsigned int child) const {
+    return _data[node * getNodeSize() + getChildOffset() + _width + child];
+  }
+
+  unsigned int getWidth() const { return _width; }
+  bool isCompressed() const { return _compressed; }
+  const std::vector<uint32_t> &getData() const { return _data; }
+  size_t getNodeCount() const { return _data.size() / getNodeSize(); }
+  // In 32 bit words
+  size_t getNodeSize() const { return getChildOffset() + 2 * _width; }
+
+private:
+  unsigned int _width = 4;
+  bool _compressed = false;
+  std::vector<uint32_t> _data;
+  std::vector<std::pair<unsigned int, unsigned int>> _roots; // Binary, wide
+
+  unsigned int collapseNode(const std::vector<BVHNode> &nodes,
+                            unsigned int nodeIndex);
+  void writeBounds(unsigned int node, const AABB *bounds,
+                   unsigned int numChildren);
+  void writeCompressedBounds(unsigned int node, const AABB *bounds,
+                             unsigned int numChildren);
+
+  // Where child[] starts within a node
+  size_t getChildOffset() const {
+    // One byte per side per child, 4 to a word
+    return _compressed ? COMPRESSED_HEADER_SIZE + (6 * _width + 3) / 4
+                       : 6 * _width;
+  }
+  float getFloat(size_t word) const;
+  void setFloat(size_t word, float value);
+};
@@ -1,6 +1,13 @@
 #version 460 core
 
+// wavefront.glsl adds its stages' mains to this file, the megakernel's main
+// at the bottom only exists without WAVEFRONT_STAGE. PERSISTENT_THREADS
+// swaps it for one that runs a fixed number of groups pulling pixels
+#if defined(PERSISTENT_THREADS)
+layout(local_size_x = 64, local_size_y = 1, local_size_z = 1) in;
+#elif !defined(WAVEFRONT_STAGE)
 layout(local_size_x = 32, local_size_y = 32, local_size_z = 1) in;
+#endif
 
 #define PI 3.14159265358979323846
 
@@ -19,9 +26,10 @@ struct Hit {
     vec3 position;
     float t;
     ivec2 textureIds; // Diffuse, Normal, -1 if no texture
-    vec2 uv;
+    vec2 uv; // Barycentric coordinates until the closest hit is known
     vec3 normal;
     uint materialIdx;
+    uint objectIdx;
     bool frontFace;
 };
 
@@ -40,12 +48,19 @@ struct Vertex {
 #define TYPE_SPHERE 1
 
 struct Object {
-    vec4 data; // Sphere: center, radius; Face: v0, v1, v2, empty
+    uvec4 data; // Face: v0, v1, v2, empty; Sphere: bits of center, radius
     uint type;
     uint materialIdx;
     ivec2 textureIds; // vec2(diffuse, normal); -1 if no texture
 };
 
+// Precomputed intersection data of objects[i], matching GpuTriangle
+struct Triangle {
+    vec4 v0;
+    vec4 edge1; // v1 - v0
+    vec4 edge2; // v2 - v0
+};
+
 struct BVHNode {
     vec3 aabbMin;
     uint leftFirst;
@@ -53,6 +68,22 @@ struct BVHNode {
     uint numObjects;
 };
 
+#define USE_OBJECT_MATERIAL 0xFFFFFFFFu
+
+struct Instance {
+    mat4 worldToObject;
+    uint rootNode; // Root of the instance's bottom level BVH in bvh[]
+    uint materialIdx; // Overrides the objects' unless USE_OBJECT_MATERIAL
+    ivec2 textureIds;
+};
+
+// Wide BVH node fields, matching WideBVH::Field
+#define WIDE_MIN_X 0u
+#define WIDE_MAX_X 3u
+#define COMPRESSED_HEADER_SIZE 4u
+#define MAX_BVH_WIDTH 8
+#define INVALID_CHILD 0xFFFFFFFFu
+
 #define LAMBERTIAN 0
 #define DIELECTRIC 1
 #define LIGHT 2
@@ -63,6 +94,17 @@ struct Material {
     float typeData; // Lambert: smoothness; Dielectric: refraction index
 };
 
+// An emissive face in world space and its alias table entry, matching
+// GpuLight
+struct Light {
+    vec3 v0;
+    float aliasProbability;
+    vec3 edge1;
+    uint alias;
+    vec3 edge2;
+    uint materialIdx;
+};
+
 layout(std430, binding = 1) readonly buffer VertexBuffer {
     Vertex vertices[];
 };
@@ -79,46 +121,160 @@ layout(std430, binding = 4) buffer MaterialBuffer {
     Material materials[];
 };
 
+layout(std430, binding = 5) readonly buffer TopLevelBuffer {
+    BVHNode topLevel[];
+};
+
+layout(std430, binding = 6) readonly buffer InstanceBuffer {
+    Instance instances[];
+};
+
+layout(std430, binding = 7) readonly buffer WideBVHBuffer {
+    uint wideBvh[];
+};
+
+// Traversal only reads these, vertices[] is left to the closest hit
+layout(std430, binding = 8) readonly buffer TriangleBuffer {
+    Triangle triangles[];
+};
+
+// Parent of every node in bvh[] and topLevel[], see BVH::linkParents
+layout(std430, binding = 16) readonly buffer BVHParentBuffer {
+    uint bvhParents[];
+};
+
+layout(std430, binding = 17) readonly buffer TopLevelParentBuffer {
+    uint topLevelParents[];
+};
+
+layout(std430, binding = 18) readonly buffer LightBuffer {
+    Light lights[];
+};
+
+// 2 traverses bvh[] unless compressed, 4 and 8 the collapsed wideBvh[]
+uniform uint u_BvhWidth;
+// Binary BVHs climb back up through the parents instead of keeping a stack
+uniform bool u_StacklessBvh;
+// wideBvh[] holds quantized nodes
+uniform bool u_CompressedBvh;
+
 uniform sampler2D u_DiffuseTexture;
 
-float stepRngFloat(inout uint state) {
-    state = state * 747796405 + 2891336453;
-    uint word = ((state >> ((state >> 28) + 4)) ^ state) * 277803737;
-    word = (word >> 22) ^ word;
-    return float(word) / 4294967296.0f;
+// 0 turns light sampling off, paths then only find lights by scattering
+// into them
+uniform uint u_LightCount;
+uniform float u_LightArea; // Of all the lights together
+
+// Sampler, see Sampler.hpp for what each u_Sampler does. Paths draw their
+// numbers a pair of dimensions at a time with sample2D
+#define SAMPLER_RANDOM 0u
+#define SAMPLER_SOBOL 1u
+#define SAMPLER_BLUE_NOISE 2u
+uniform uint u_Sampler;
+
+#define BLUE_NOISE_SIZE 64u
+// Void and cluster ranks in [0, 1), row by row
+layout(std430, binding = 19) readonly buffer BlueNoiseBuffer {
+    float blueNoise[];
+};
+
+// Set by startSample for the path sample being traced
+uvec2 samplePixel;
+uint samplePixelSeed;
+uint sampleIndex; // Of the pixel's samples over all frames
+uint sampleDimension; // Next pair to draw
+uint rngState; // SAMPLER_RANDOM's stream
+
+// In [0, 1)
+float toUnitFloat(uint value) {
+    return float(value >> 8) / 16777216.0;
+}
+
+uint hashUint(uint value) {
+    uint state = value * 747796405u + 2891336453u;
+    uint word = ((state >> ((state >> 28) + 4u)) ^ state) * 277803737u;
+    return (word >> 22) ^ word;
 }
 
-uint rngState = (600 * gl_GlobalInvocationID.x + gl_GlobalInvocationID.y) * (u_FrameCount + 1);
 float rand() {
-    return stepRngFloat(rngState);
+    rngState = rngState * 747796405u + 2891336453u;
+    uint word = ((rngState >> ((rngState >> 28) + 4u)) ^ rngState) * 277803737u;
+    return toUnitFloat((word >> 22) ^ word);
 }
 
-float rand(float min, float max) {
-    return min + (max - min) * rand();
+// Owen scrambles the bits of value from the top down (Laine and Karras 2011)
+uint owenScramble(uint value, uint seed) {
+    value = bitfieldReverse(value);
+    value += seed;
+    value ^= value * 0x6C50B47Cu;
+    value ^= value * 0xB82F1E52u;
+    value ^= value * 0xC7AFE638u;
+    value ^= value * 0x8D22F6E6u;
+    return bitfieldReverse(value);
 }
 
-// Random value in normal distribution with mean 0 and standard deviation 1
-float randomNormalDistribution() {
-    float theta = 2.0 * PI * rand();
-    float rho = sqrt(-2.0 * log(rand()));
-    return rho * cos(theta);
+// The first two Sobol dimensions, the second's direction numbers are the
+// rows of Pascal's triangle mod 2
+uvec2 sobol2D(uint index) {
+    uvec2 point = uvec2(bitfieldReverse(index), 0u);
+    for (uint direction = 1u << 31; index != 0u; index >>= 1, direction ^= direction >> 1) {
+        if ((index & 1u) != 0u) {
+            point.y ^= direction;
+        }
+    }
+    return point;
 }
 
-vec3 randomUnitVector() {
-    float x = randomNormalDistribution();
-    float y = randomNormalDistribution();
-    float z = randomNormalDistribution();
-    return normalize(vec3(x, y, z));
+void startSample(uvec2 pixel, uint index) {
+    samplePixel = pixel;
+    samplePixelSeed = hashUint(pixel.y * uint(imageSize(imgOutput).x) + pixel.x);
+    sampleIndex = index;
+    sampleDimension = 0u;
+    rngState = hashUint(samplePixelSeed ^ hashUint(index));
+}
+
+vec2 sample2D() {
+    uint dimension = sampleDimension++;
+    if (u_Sampler == SAMPLER_RANDOM) {
+        float x = rand();
+        return vec2(x, rand());
+    }
+
+    // Every pair gets its own shuffle and scramble, blue noise shares them
+    // between pixels
+    uint seed = hashUint(dimension ^ (u_Sampler == SAMPLER_SOBOL ? samplePixelSeed : 0x9E3779B9u));
+    uvec2 point = sobol2D(owenScramble(sampleIndex, seed));
+    vec2 u = vec2(toUnitFloat(owenScramble(point.x, hashUint(seed ^ 1u))),
+            toUnitFloat(owenScramble(point.y, hashUint(seed ^ 2u))));
+    if (u_Sampler == SAMPLER_BLUE_NOISE) {
+        // Each pair reads the mask from its own offset along the R2 sequence
+        uvec2 offset = uvec2(fract(float(dimension) * vec2(0.7548776662, 0.5698402910)) * float(BLUE_NOISE_SIZE));
+        uvec2 texelX = (samplePixel + offset) % BLUE_NOISE_SIZE;
+        uvec2 texelY = (samplePixel + offset + BLUE_NOISE_SIZE / 2u) % BLUE_NOISE_SIZE;
+        u = fract(u + vec2(blueNoise[texelX.y * BLUE_NOISE_SIZE + texelX.x],
+                blueNoise[texelY.y * BLUE_NOISE_SIZE + texelY.x]));
+    }
+    return u;
 }
 
-vec3 randomOnHemisphere(vec3 normal) {
-    vec3 dir = randomUnitVector();
-    return dir * sign(dot(dir, normal));
+// Takes a whole pair to keep the ones after it aligned
+float sample1D() {
+    return sample2D().x;
+}
+
+// Uniform over the sphere from a single pair
+vec3 randomUnitVector() {
+    vec2 u = sample2D();
+    float z = 1.0 - 2.0 * u.x;
+    float r = sqrt(max(0.0, 1.0 - z * z));
+    float phi = 2.0 * PI * u.y;
+    return vec3(r * cos(phi), r * sin(phi), z);
 }
 
 vec2 randomInUnitCircle() {
-    float theta = 2.0 * PI * rand();
-    float rho = sqrt(rand());
+    vec2 u = sample2D();
+    float theta = 2.0 * PI * u.x;
+    float rho = sqrt(u.y);
     return vec2(cos(theta), sin(theta)) * rho;
 }
 
@@ -139,10 +295,11 @@ vec2 intersectAABB(Ray ray, vec3 boxMin, vec3 boxMax) {
 }
 
 bool hitSphere(Ray ray, Object sphere, float tMin, float tMax, out Hit hit) {
-    vec3 oc = sphere.data.xyz - ray.origin;
+    vec4 centerRadius = uintBitsToFloat(sphere.data);
+    vec3 oc = centerRadius.xyz - ray.origin;
     float a = dot(ray.direction, ray.direction);
     float h = dot(oc, ray.direction);
-    float c = dot(oc, oc) - sphere.data.w * sphere.data.w;
+    float c = dot(oc, oc) - centerRadius.w * centerRadius.w;
     float discriminant = h * h - a * c;
 
     if (discriminant < 0.0) {
@@ -162,7 +319,7 @@ bool hitSphere(Ray ray, Object sphere, float tMin, float tMax, out Hit hit) {
     hit.t = t;
     hit.position = ray.origin + ray.direction * t;
     // TODO: UV mapping
-    hit.normal = (hit.position - sphere.data.xyz) / sphere.data.w;
+    hit.normal = (hit.position - centerRadius.xyz) / centerRadius.w;
     hit.materialIdx = sphere.materialIdx;
     hit.textureIds = ivec2(-1);
     setHitFaceNormal(hit, ray, hit.normal);
@@ -171,22 +328,20 @@ bool hitSphere(Ray ray, Object sphere, float tMin, float tMax, out Hit hit) {
 
 // Returns true if the ray intersects the triangle
 // and the tuv values (t and barycentric coords) and the normal
-bool triIntersect(Ray ray, Object face, out vec3 tuv, out vec3 n) {
+bool triIntersect(Ray ray, Triangle triangle, out vec3 tuv, out vec3 n) {
     // Moller-Trumbore algorithm
-    vec3 v0 = vertices[int(face.data.x)].position;
-    vec3 v1 = vertices[int(face.data.y)].position;
-    vec3 v2 = vertices[int(face.data.z)].position;
-    vec3 a = v1 - v0;
-    vec3 b = v2 - v0;
+    vec3 v0 = triangle.v0.xyz;
+    vec3 a = triangle.edge1.xyz;
+    vec3 b = triangle.edge2.xyz;
 
     vec3 pvec = cross(ray.direction, b);
     float det = dot(a, pvec);
-    if (abs(det) < 0.0001) {
+    n = cross(b, a);
+    // Relative to the triangle and ray sizes, which change under instancing
+    if (det * det < 1e-8 * dot(n, n) * dot(ray.direction, ray.direction)) {
         return false;
     }
 
-    n = cross(b, a);
-
     float idet = 1.0 / det;
     vec3 tvec = ray.origin - v0;
     float u = dot(tvec, pvec) * idet;
@@ -207,20 +362,17 @@ bool triIntersect(Ray ray, Object face, out vec3 tuv, out vec3 n) {
     return true;
 }
 
-bool hitFace(Ray ray, Object face, float tMin, float tMax, out Hit hit) {
+// Only reads the face's object record once it is hit
+bool hitFace(Ray ray, uint objectIdx, float tMin, float tMax, out Hit hit) {
     vec3 tuv;
     vec3 n;
-    if (triIntersect(ray, face, tuv, n) && tuv.x >= tMin && tuv.x <= tMax) {
+    if (triIntersect(ray, triangles[objectIdx], tuv, n) && tuv.x >= tMin && tuv.x <= tMax) {
+        Object face = objects[objectIdx];
         hit.t = tuv.x;
         hit.position = ray.origin + ray.direction * tuv.x;
         hit.materialIdx = face.materialIdx;
         hit.textureIds = face.textureIds;
-        if (hit.textureIds.x != -1) {
-            vec2 uv0 = vertices[int(face.data.x)].texCoord;
-            vec2 uv1 = vertices[int(face.data.y)].texCoord;
-            vec2 uv2 = vertices[int(face.data.z)].texCoord;
-            hit.uv = uv0 * (1.0 - tuv.y - tuv.z) + uv1 * tuv.y + uv2 * tuv.z;
-        }
+        hit.uv = tuv.yz;
         // There is a normal map for this face
         // if (hit.textureIds.y != -1) {
         //     // TODO: Implement normal mapping
@@ -233,18 +385,121 @@ bool hitFace(Ray ray, Object face, float tMin, float tMax, out Hit hit) {
     return false;
 }
 
-#define MAX_STACK_SIZE 64
-BVHNode root = bvh[0];
-bool hitBvh(Ray ray, out Hit hit) {
+// Intersects objects [first, first + count), keeping the closest hit. The
+// builders never mix types in a leaf, so the test is picked once per leaf
+bool hitObjects(Ray ray, uint first, uint count, inout float closest, inout Hit hit) {
     float tMin = 0.001;
-    float tMax = 5000.0;
+    bool hitAnything = false;
+
+    if (objects[first].type == TYPE_SPHERE) {
+        for (uint i = first; i < first + count; i++) {
+            Hit tempHit;
+            if (hitSphere(ray, objects[i], tMin, closest, tempHit)) {
+                hitAnything = true;
+                closest = tempHit.t;
+                hit = tempHit;
+                hit.objectIdx = i;
+            }
+        }
+    } else {
+        for (uint i = first; i < first + count; i++) {
+            Hit tempHit;
+            if (hitFace(ray, i, tMin, closest, tempHit)) {
+                hitAnything = true;
+                closest = tempHit.t;
+                hit = tempHit;
+                hit.objectIdx = i;
+            }
+        }
+    }
+
+    return hitAnything;
+}
+
+// Stackless traversal (Hapala et al. 2011) walks the tree from node to
+// node, entering each one from its parent, its sibling or a child
+#define FROM_PARENT 0u
+#define FROM_SIBLING 1u
+#define FROM_CHILD 2u
+
+bool hitNodeBounds(Ray ray, BVHNode node, float closest) {
+    vec2 nodeIntersect = intersectAABB(ray, node.aabbMin, node.aabbMax);
+    return nodeIntersect.x <= nodeIntersect.y
+            && nodeIntersect.x < closest
+            && nodeIntersect.y > 0.0;
+}
+
+// The child the ray reaches first along the line between the two centers.
+// Unlike their entry distances it never depends on closest, so climbing
+// back up from a child still knows whether its sibling comes next
+uint nearChild(Ray ray, BVHNode left, BVHNode right, uint leftIdx) {
+    vec3 toRight = (right.aabbMin + right.aabbMax) - (left.aabbMin + left.aabbMax);
+    return dot(ray.direction, toRight) >= 0.0 ? leftIdx : leftIdx + 1;
+}
+
+uint nearBlasChild(Ray ray, uint leftIdx) {
+    return nearChild(ray, bvh[leftIdx], bvh[leftIdx + 1], leftIdx);
+}
 
+// Finds the same hits as hitBinaryBlas at any depth, in place of its stack
+bool hitStacklessBlas(Ray ray, uint rootNode, inout float closest, inout Hit hit) {
+    bool hitAnything = false;
+    uint current = rootNode;
+    uint state = FROM_PARENT;
+
+    while (true) {
+        if (state == FROM_CHILD) {
+            if (current == rootNode) {
+                break;
+            }
+            // Coming up from the near child goes on to the far one
+            uint parent = bvhParents[current];
+            uint first = bvh[parent].leftFirst;
+            if (current == nearBlasChild(ray, first)) {
+                current = current == first ? first + 1 : first;
+                state = FROM_SIBLING;
+            } else {
+                current = parent;
+            }
+            continue;
+        }
+
+        BVHNode node = bvh[current];
+        bool hitNode = hitNodeBounds(ray, node, closest);
+        if (hitNode && node.numObjects == 0) {
+            current = nearBlasChild(ray, node.leftFirst);
+            state = FROM_PARENT;
+            continue;
+        }
+        if (hitNode) {
+            hitAnything = hitObjects(ray, node.leftFirst, node.numObjects, closest, hit) || hitAnything;
+        }
+
+        // Done with the node, a near child moves on to its sibling
+        if (current == rootNode) {
+            break;
+        }
+        uint parent = bvhParents[current];
+        if (state == FROM_PARENT) {
+            uint first = bvh[parent].leftFirst;
+            current = current == first ? first + 1 : first;
+            state = FROM_SIBLING;
+        } else {
+            current = parent;
+            state = FROM_CHILD;
+        }
+    }
+
+    return hitAnything;
+}
+
+#define MAX_STACK_SIZE 64
+bool hitBinaryBlas(Ray ray, uint rootNode, inout float closest, inout Hit hit) {
     bool hitAnything = false;
-    float closest = tMax;
 
     uint stack[MAX_STACK_SIZE];
     uint stackSize = 0;
-    stack[stackSize++] = 0;
+    stack[stackSize++] = rootNode;
 
     while (stackSize > 0 && stackSize < MAX_STACK_SIZE) {
         uint nodeIdx = stack[--stackSize];
@@ -252,22 +507,7 @@ bool hitBvh(Ray ray, out Hit hit) {
 
         // Check if the node is a leaf
         if (node.numObjects != 0) {
-            for (int i = 0; i < node.numObjects; i++) {
-                Object obj = objects[node.leftFirst + i];
-                Hit tempHit;
-                bool hitObj = false;
-                if (obj.type == TYPE_SPHERE) {
-                    hitObj = hitSphere(ray, obj, tMin, closest, tempHit);
-                } else if (obj.type == TYPE_FACE) {
-                    hitObj = hitFace(ray, obj, tMin, closest, tempHit);
-                }
-
-                if (hitObj) {
-                    hitAnything = true;
-                    closest = tempHit.t;
-                    hit = tempHit;
-                }
-            }
+            hitAnything = hitObjects(ray, node.leftFirst, node.numObjects, closest, hit) || hitAnything;
             continue;
         }
 
@@ -299,6 +539,248 @@ bool hitBvh(Ray ray, out Hit hit) {
     return hitAnything;
 }
 
+// Where child[] starts within a wide node, numObjects[] follows it
+uint wideChildOffset() {
+    return u_CompressedBvh ? COMPRESSED_HEADER_SIZE + (6u * u_BvhWidth + 3u) / 4u : 6u * u_BvhWidth;
+}
+
+uint wideNodeSize() {
+    return wideChildOffset() + 2u * u_BvhWidth;
+}
+
+// Decodes the bounds of a wide node's child, see WideBVH.hpp for the layouts
+void wideChildBounds(uint base, uint child, out vec3 boxMin, out vec3 boxMax) {
+    uint width = u_BvhWidth;
+    if (!u_CompressedBvh) {
+        for (uint axis = 0; axis < 3; axis++) {
+            boxMin[axis] = uintBitsToFloat(wideBvh[base + (WIDE_MIN_X + axis) * width + child]);
+            boxMax[axis] = uintBitsToFloat(wideBvh[base + (WIDE_MAX_X + axis) * width + child]);
+        }
+        return;
+    }
+
+    // The exponents are stored biased like a float's, so they are the scales
+    uint exponents = wideBvh[base + 3];
+    for (uint axis = 0; axis < 3; axis++) {
+        float origin = uintBitsToFloat(wideBvh[base + axis]);
+        float scale = uintBitsToFloat(((exponents >> (8 * axis)) & 0xFFu) << 23);
+        uint minByte = (WIDE_MIN_X + axis) * width + child;
+        uint maxByte = (WIDE_MAX_X + axis) * width + child;
+        uint qMin = (wideBvh[base + COMPRESSED_HEADER_SIZE + minByte / 4] >> (8 * (minByte % 4))) & 0xFFu;
+        uint qMax = (wideBvh[base + COMPRESSED_HEADER_SIZE + maxByte / 4] >> (8 * (maxByte % 4))) & 0xFFu;
+        boxMin[axis] = origin + float(qMin) * scale;
+        boxMax[axis] = origin + float(qMax) * scale;
+    }
+}
+
+// Tests all children of a node at once, see WideBVH.hpp for the layout
+bool hitWideBlas(Ray ray, uint rootNode, inout float closest, inout Hit hit) {
+    bool hitAnything = false;
+    uint width = u_BvhWidth;
+    uint nodeSize = wideNodeSize();
+    uint childOffset = wideChildOffset();
+
+    uint stack[MAX_STACK_SIZE];
+    uint stackSize = 0;
+    stack[stackSize++] = rootNode;
+
+    while (stackSize > 0) {
+        uint base = stack[--stackSize] * nodeSize;
+
+        // Inner children that were hit, sorted far to near
+        float childDist[MAX_BVH_WIDTH];
+        uint childNode[MAX_BVH_WIDTH];
+        uint numHits = 0;
+
+        for (uint i = 0; i < width; i++) {
+            uint child = wideBvh[base + childOffset + i];
+            if (child == INVALID_CHILD) {
+                break;
+            }
+
+            vec3 boxMin;
+            vec3 boxMax;
+            wideChildBounds(base, i, boxMin, boxMax);
+            vec2 childIntersect = intersectAABB(ray, boxMin, boxMax);
+            if (childIntersect.x > childIntersect.y
+                    || childIntersect.x >= closest
+                    || childIntersect.y <= 0.0) {
+                continue;
+            }
+
+            // Leaves are intersected right away, shrinking closest for the rest
+            uint numObjects = wideBvh[base + childOffset + width + i];
+            if (numObjects != 0) {
+                hitAnything = hitObjects(ray, child, numObjects, closest, hit) || hitAnything;
+                continue;
+            }
+
+            uint k = numHits++;
+            while (k > 0 && childDist[k - 1] < childIntersect.x) {
+                childDist[k] = childDist[k - 1];
+                childNode[k] = childNode[k - 1];
+                k--;
+            }
+            childDist[k] = childIntersect.x;
+            childNode[k] = child;
+        }
+
+        // The closest child ends up on top
+        for (uint i = 0; i < numHits && stackSize < MAX_STACK_SIZE; i++) {
+            stack[stackSize++] = childNode[i];
+        }
+    }
+
+    return hitAnything;
+}
+
+// Traverses the bottom level BVH starting at rootNode for hits closer than
+// closest, in the space of ray
+bool hitBlas(Ray ray, uint rootNode, inout float closest, inout Hit hit) {
+    if (u_BvhWidth == 2 && !u_CompressedBvh) {
+        if (u_StacklessBvh) {
+            return hitStacklessBlas(ray, rootNode, closest, hit);
+        }
+        return hitBinaryBlas(ray, rootNode, closest, hit);
+    }
+    return hitWideBlas(ray, rootNode, closest, hit);
+}
+
+// Traces the instances [first, first + count) of a top level leaf
+bool hitInstances(Ray ray, uint first, uint count, inout float closest, inout Hit hit) {
+    bool hitAnything = false;
+    for (uint i = first; i < first + count; i++) {
+        Instance instance = instances[i];
+
+        // The direction is not renormalized so t is the same in both spaces
+        Ray localRay;
+        localRay.origin = (instance.worldToObject * vec4(ray.origin, 1.0)).xyz;
+        localRay.direction = mat3(instance.worldToObject) * ray.direction;
+
+        Hit tempHit;
+        if (hitBlas(localRay, instance.rootNode, closest, tempHit)) {
+            hitAnything = true;
+            hit = tempHit;
+            hit.position = ray.origin + ray.direction * hit.t;
+            // The inverse transpose keeps the normal facing the ray
+            hit.normal = normalize(transpose(mat3(instance.worldToObject)) * hit.normal);
+            if (instance.materialIdx != USE_OBJECT_MATERIAL) {
+                hit.materialIdx = instance.materialIdx;
+                hit.textureIds = instance.textureIds;
+            }
+        }
+    }
+    return hitAnything;
+}
+
+uint nearTopLevelChild(Ray ray, uint leftIdx) {
+    return nearChild(ray, topLevel[leftIdx], topLevel[leftIdx + 1], leftIdx);
+}
+
+// hitStacklessBlas over topLevel[], starting from its root
+bool hitStacklessTopLevel(Ray ray, inout float closest, inout Hit hit) {
+    bool hitAnything = false;
+    uint current = 0;
+    uint state = FROM_PARENT;
+
+    while (true) {
+        if (state == FROM_CHILD) {
+            if (current == 0u) {
+                break;
+            }
+            uint parent = topLevelParents[current];
+            uint first = topLevel[parent].leftFirst;
+            if (current == nearTopLevelChild(ray, first)) {
+                current = current == first ? first + 1 : first;
+                state = FROM_SIBLING;
+            } else {
+                current = parent;
+            }
+            continue;
+        }
+
+        BVHNode node = topLevel[current];
+        bool hitNode = hitNodeBounds(ray, node, closest);
+        if (hitNode && node.numObjects == 0) {
+            current = nearTopLevelChild(ray, node.leftFirst);
+            state = FROM_PARENT;
+            continue;
+        }
+        if (hitNode) {
+            hitAnything = hitInstances(ray, node.leftFirst, node.numObjects, closest, hit) || hitAnything;
+        }
+
+        if (current == 0u) {
+            break;
+        }
+        uint parent = topLevelParents[current];
+        if (state == FROM_PARENT) {
+            uint first = topLevel[parent].leftFirst;
+            current = current == first ? first + 1 : first;
+            state = FROM_SIBLING;
+        } else {
+            current = parent;
+            state = FROM_CHILD;
+        }
+    }
+
+    return hitAnything;
+}
+
+#define MAX_TOP_LEVEL_STACK_SIZE 32
+bool hitStackTopLevel(Ray ray, inout float closest, inout Hit hit) {
+    bool hitAnything = false;
+
+    uint stack[MAX_TOP_LEVEL_STACK_SIZE];
+    uint stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0 && stackSize < MAX_TOP_LEVEL_STACK_SIZE - 1) {
+        BVHNode node = topLevel[stack[--stackSize]];
+        if (!hitNodeBounds(ray, node, closest)) {
+            continue;
+        }
+
+        if (node.numObjects == 0) {
+            stack[stackSize++] = node.leftFirst + 1;
+            stack[stackSize++] = node.leftFirst;
+            continue;
+        }
+
+        hitAnything = hitInstances(ray, node.leftFirst, node.numObjects, closest, hit) || hitAnything;
+    }
+
+    return hitAnything;
+}
+
+bool traceBvh(Ray ray, inout float closest, inout Hit hit) {
+    return u_StacklessBvh
+            ? hitStacklessTopLevel(ray, closest, hit)
+            : hitStackTopLevel(ray, closest, hit);
+}
+
+// Whether anything is in the way along the ray before maxT
+bool occluded(Ray ray, float maxT) {
+    Hit hit;
+    return traceBvh(ray, maxT, hit);
+}
+
+bool hitBvh(Ray ray, out Hit hit) {
+    float closest = 5000.0;
+    bool hitAnything = traceBvh(ray, closest, hit);
+
+    // Only the closest hit needs its texture coordinates
+    if (hitAnything && hit.textureIds.x != -1) {
+        Object face = objects[hit.objectIdx];
+        vec2 uv0 = vertices[face.data.x].texCoord;
+        vec2 uv1 = vertices[face.data.y].texCoord;
+        vec2 uv2 = vertices[face.data.z].texCoord;
+        hit.uv = uv0 * (1.0 - hit.uv.x - hit.uv.y) + uv1 * hit.uv.x + uv2 * hit.uv.y;
+    }
+
+    return hitAnything;
+}
+
 vec3 reflect(vec3 v, vec3 n) {
     return v - 2.0 * dot(v, n) * n;
 }
@@ -344,7 +826,7 @@ bool scatter(Hit hit, out vec3 albedo, inout Ray scattered) {
         float sinTheta = sqrt(1.0 - cosTheta * cosTheta);
 
         bool cannotRefract = ri * sinTheta > 1.0;
-        if (cannotRefract || reflectance(cosTheta, ri) > rand()) {
+        if (cannotRefract || reflectance(cosTheta, ri) > sample1D()) {
             scattered.direction = reflect(scattered.direction, hit.normal);
         } else {
             scattered.direction = refract(scattered.direction, hit.normal, ri);
@@ -356,30 +838,117 @@ bool scatter(Hit hit, out vec3 albedo, inout Ray scattered) {
     return true;
 }
 
-#define MAX_BOUNCES 10
-vec3 rayColor(Ray
-    ray) {
-    Hit hit;
+// Solid angle density of light sampling picking a point at dist whose
+// light's normal makes cosLight with the direction to it. Lights are picked
+// by area, so every point on every light is equally likely
+float lightPdf(float dist, float cosLight) {
+    return dist * dist / (max(cosLight, 1e-6) * u_LightArea);
+}
 
-    vec3 finalColor = vec3(1.0);
-    for (int i = 0; i < MAX_BOUNCES; i++) {
-        if (hitBvh(ray, hit)) {
-            vec3 albedo;
-            bool scatters = scatter(hit, albedo, ray);
-            if (hit.textureIds.x != -1) {
-                albedo = texture(u_DiffuseTexture, hit.uv).rgb;
-            }
-            finalColor *= albedo;
-            if (!scatters) {
-                break;
-            }
-        } else {
-            finalColor *= 0.0;
+// Power heuristic (Veach 1997) weight of a sample from the strategy with
+// density pdf, against the other's
+float misWeight(float pdf, float otherPdf) {
+    return pdf * pdf / (pdf * pdf + otherPdf * otherPdf);
+}
+
+// Light reaching a diffuse hit straight from a random point on a random
+// light, weighted against scattering into the same point
+vec3 sampleLight(Hit hit, vec3 albedo) {
+    float pick = sample1D() * float(u_LightCount);
+    uint lightIdx = min(uint(pick), u_LightCount - 1u);
+    if (fract(pick) >= lights[lightIdx].aliasProbability) {
+        lightIdx = lights[lightIdx].alias;
+    }
+    Light light = lights[lightIdx];
+
+    // Uniform over the triangle
+    vec2 u = sample2D();
+    float s = sqrt(u.x);
+    float t = u.y;
+    vec3 point = light.v0 + light.edge1 * (s * (1.0 - t)) + light.edge2 * (s * t);
+
+    vec3 toLight = point - hit.position;
+    float dist = length(toLight);
+    Ray shadow;
+    shadow.origin = hit.position;
+    shadow.direction = toLight / dist;
+    // Lights emit from both sides, like scattering into them
+    float cosSurface = dot(hit.normal, shadow.direction);
+    float cosLight = abs(dot(normalize(cross(light.edge1, light.edge2)), shadow.direction));
+    if (cosSurface <= 0.0 || cosLight <= 0.0 || occluded(shadow, dist * 0.999)) {
+        return vec3(0.0);
+    }
+
+    float pdf = lightPdf(dist, cosLight);
+    float bsdfPdf = cosSurface / PI;
+    vec3 brdf = albedo / PI;
+    return brdf * materials[light.materialIdx].albedo * cosSurface
+            * misWeight(pdf, bsdfPdf) / pdf;
+}
+
+// Russian roulette can end paths from this bounce on, the cap only guards
+// against paths that never lose energy, like between two mirrors
+#define MIN_BOUNCES 3u
+#define MAX_BOUNCES 32u
+
+// One bounce of a path at its closest hit: adds what the hit emits and what
+// light sampling finds to radiance, then scatters ray and returns whether
+// the path goes on. bsdfPdf is the density the ray was scattered with, 0
+// for camera rays and after specular bounces. onFace is whether the hit
+// object is a face, which light sampling could have picked
+bool shadeHit(Hit hit, bool onFace, uint bounce, inout Ray ray,
+        inout vec3 throughput, inout vec3 radiance, inout float bsdfPdf) {
+    Material material = materials[hit.materialIdx];
+    if (material.type == LIGHT) {
+        float weight = 1.0;
+        if (bsdfPdf > 0.0 && onFace && u_LightCount > 0u) {
+            float cosLight = abs(dot(hit.normal, ray.direction));
+            weight = misWeight(bsdfPdf, lightPdf(hit.t, cosLight));
+        }
+        radiance += throughput * material.albedo * weight;
+        return false;
+    }
+
+    vec3 albedo;
+    scatter(hit, albedo, ray);
+    if (hit.textureIds.x != -1) {
+        albedo = texture(u_DiffuseTexture, hit.uv).rgb;
+    }
+
+    // Smooth lambertians reflect part of the way, which has no density
+    bool diffuse = material.type == LAMBERTIAN && material.typeData == 0.0;
+    if (diffuse && u_LightCount > 0u) {
+        radiance += throughput * sampleLight(hit, albedo);
+    }
+    bsdfPdf = diffuse ? max(dot(hit.normal, ray.direction), 0.0) / PI : 0.0;
+    throughput *= albedo;
+
+    if (bounce >= MIN_BOUNCES) {
+        float survival = min(max(throughput.r, max(throughput.g, throughput.b)), 0.95);
+        if (sample1D() >= survival) {
+            return false;
+        }
+        throughput /= survival;
+    }
+    return true;
+}
+
+vec3 rayColor(Ray ray) {
+    vec3 throughput = vec3(1.0);
+    vec3 radiance = vec3(0.0);
+    float bsdfPdf = 0.0;
+    for (uint bounce = 0u; bounce < MAX_BOUNCES; bounce++) {
+        Hit hit;
+        if (!hitBvh(ray, hit)) {
+            break;
+        }
+        bool onFace = objects[hit.objectIdx].type == TYPE_FACE;
+        if (!shadeHit(hit, onFace, bounce, ray, throughput, radiance, bsdfPdf)) {
             break;
         }
     }
 
-    return finalColor;
+    return radiance;
 }
 
 ONB createONB(vec3 vec, vec3 up) {
@@ -390,10 +959,8 @@ ONB createONB(vec3 vec, vec3 up) {
     return onb;
 }
 
-#define SAMPLES 4
-void main() {
-    vec2 imageSize = vec2(imageSize(imgOutput));
-
+// Ray through a random point within half a pixel of the pixel's corner
+Ray getCameraRay(vec2 pixel, vec2 imageSize) {
     float vfov = 40.0;
     float theta = vfov * PI / 180.0;
     float h = tan(theta / 2.0);
@@ -414,40 +981,55 @@ void main() {
     // Upper left corner of the viewport, (0,0) is at top left corner
     vec3 upperLeftCorner = origin - (horizontal / 2.0) - (vertical / 2.0) + (focalLength * onb.w);
 
-    // Get the pixel's position in the image
-    vec2 uv = (gl_GlobalInvocationID.xy) / imageSize.xy;
-
     // anti-aliasing
-    int sqrtSamples = int(sqrt(float(SAMPLES)));
-    double recipSqrtSamples = 1.0 / sqrtSamples;
+    vec2 offset = randomInUnitCircle() * 0.5;
+    vec2 sampleUv = (pixel + offset) / imageSize;
+    Ray ray;
+    ray.origin = origin;
+    ray.direction = upperLeftCorner + sampleUv.x * horizontal + sampleUv.y * vertical - origin;
+    ray.direction = normalize(ray.direction);
+    return ray;
+}
+
+#define SAMPLES 4
+
+// Traces the frame's samples of the pixel and blends them into the image
+void tracePixel(uvec2 pixel, vec2 imageSize) {
     vec3 colorAccumulator = vec3(0.0);
-    // for (int i = 0; i < sqrtSamples; i++) {
-    //     for (int j = 0; j < sqrtSamples; j++) {
-    //         vec2 offset = vec2((i + rand()) * recipSqrtSamples - 0.5, (j + rand()) * recipSqrtSamples - 0.5);
-    //         vec2 sampleUv = uv + offset / imageSize;
-    //         Ray ray;
-    //         ray.origin = origin;
-    //         ray.direction = upperLeftCorner + sampleUv.x * horizontal + sampleUv.y * vertical - origin;
-    //         ray.direction = normalize(ray.direction);
-    //         // Get the color of the pixel at where the ray intersects the scene
-    //         colorAccumulator += rayColor(ray);
-    //     }
-    // }
     for (int i = 0; i < SAMPLES; i++) {
-        vec2 offset = randomInUnitCircle() * 0.5;
-        vec2 sampleUv = uv + offset / imageSize;
-        Ray ray;
-        ray.origin = origin;
-        ray.direction = upperLeftCorner + sampleUv.x * horizontal + sampleUv.y * vertical - origin;
-        ray.direction = normalize(ray.direction);
+        startSample(pixel, u_FrameCount * uint(SAMPLES) + uint(i));
+        Ray ray = getCameraRay(vec2(pixel), imageSize);
         // Get the color of the pixel at where the ray intersects the scene
         colorAccumulator += rayColor(ray);
     }
 
     vec3 pixelColor = colorAccumulator / SAMPLES;
 
-    vec4 oldColor = imageLoad(imgOutput, ivec2(gl_GlobalInvocationID.xy)).rgba * min(1.0, u_FrameCount);
+    vec4 oldColor = imageLoad(imgOutput, ivec2(pixel)).rgba * min(1.0, u_FrameCount);
     vec4 finalColor = (oldColor * u_FrameCount + vec4(pixelColor, 1.0)) / (u_FrameCount + 1.0);
 
-    imageStore(imgOutput, ivec2(gl_GlobalInvocationID.xy), finalColor);
+    imageStore(imgOutput, ivec2(pixel), finalColor);
+}
+
+#if defined(PERSISTENT_THREADS)
+// Pixels handed out so far this frame, reset before every dispatch
+layout(std430, binding = 15) buffer WorkBuffer {
+    uint nextPixel;
+};
+
+// Every invocation takes the next pixel as soon as it is done with one, so
+// short paths never wait on long ones in their group. Neighbouring lanes
+// still get neighbouring pixels
+void main() {
+    ivec2 size = imageSize(imgOutput);
+    uint pixelCount = uint(size.x * size.y);
+    for (uint pixelIdx = atomicAdd(nextPixel, 1u); pixelIdx < pixelCount;
+            pixelIdx = atomicAdd(nextPixel, 1u)) {
+        tracePixel(uvec2(pixelIdx % uint(size.x), pixelIdx / uint(size.x)), vec2(size));
+    }
+}
+#elif !defined(WAVEFRONT_STAGE)
+void main() {
+    tracePixel(gl_GlobalInvocationID.xy, vec2(imageSize(imgOutput)));
 }
+#endif
@@ -0,0 +1,210 @@
+// Wavefront path tracing, appended to compute.glsl and compiled once per
+// stage with WAVEFRONT_STAGE and one of WAVEFRONT_GENERATE, WAVEFRONT_EXTEND,
+// WAVEFRONT_SHADE or WAVEFRONT_ACCUMULATE defined. Instead of one invocation
+// following its path through every bounce like rayColor, each pass runs one
+// step for every path still alive. Paths move between the passes through
+// queues of path indices, so every pass only launches the work left
+
+#define WAVEFRONT_GROUP_SIZE 64
+layout(local_size_x = WAVEFRONT_GROUP_SIZE, local_size_y = 1, local_size_z = 1) in;
+
+// Matching GpuPath
+struct Path {
+    vec3 origin;
+    uint rngState; // See startSample
+    vec3 direction;
+    float bsdfPdf; // See shadeHit
+    vec3 throughput;
+    uint sampleDimension; // Next pair the path draws
+};
+
+#define HIT_FRONT_FACE 1u
+#define HIT_TEXTURED 2u
+#define HIT_FACE 4u
+
+// Matching GpuPathHit
+struct PathHit {
+    vec3 normal; // Facing the ray
+    float t;
+    vec2 uv; // Texture coordinates
+    uint materialIdx;
+    uint flags;
+};
+
+// Matching GpuDispatchQueue, the first three are glDispatchComputeIndirect's
+struct DispatchQueue {
+    uint numGroupsX;
+    uint numGroupsY;
+    uint numGroupsZ;
+    uint count;
+};
+
+// queues[0] and [1] count the two halves of rayQueue[], one is extended
+// this bounce while shading fills the other for the next. queues[2] counts
+// hitQueue[]
+#define HIT_QUEUE 2u
+
+// Indexed by pixel, y * width + x
+layout(std430, binding = 9) buffer PathBuffer {
+    Path paths[];
+};
+
+layout(std430, binding = 10) buffer PathHitBuffer {
+    PathHit pathHits[];
+};
+
+layout(std430, binding = 11) buffer RayQueueBuffer {
+    uint rayQueue[]; // Two queues of u_PathCount each
+};
+
+layout(std430, binding = 12) buffer HitQueueBuffer {
+    uint hitQueue[];
+};
+
+layout(std430, binding = 13) buffer DispatchQueueBuffer {
+    DispatchQueue queues[];
+};
+
+// Sum of the frame's samples so far, cleared when accumulated
+layout(std430, binding = 14) buffer RadianceBuffer {
+    vec4 radiance[];
+};
+
+uniform uint u_PathCount;
+uniform uint u_RayQueue; // Half of rayQueue[] this bounce extends
+uniform uint u_Sample; // Of the frame
+uniform uint u_Bounce;
+uniform uint u_SampleCount; // Samples the frame summed into radiance[]
+
+// Returns the slot to write to, growing the queue's dispatch by a group
+// whenever the slot starts one
+uint pushQueue(uint queue) {
+    uint slot = atomicAdd(queues[queue].count, 1u);
+    if (slot % uint(WAVEFRONT_GROUP_SIZE) == 0u) {
+        atomicAdd(queues[queue].numGroupsX, 1u);
+    }
+    return slot;
+}
+
+#ifdef WAVEFRONT_GENERATE
+// Starts a camera path at every pixel, queue 0 lists all of them
+void main() {
+    uint pathIdx = gl_GlobalInvocationID.x;
+    if (pathIdx >= u_PathCount) {
+        return;
+    }
+
+    ivec2 size = imageSize(imgOutput);
+    uvec2 pixel = uvec2(pathIdx % uint(size.x), pathIdx / uint(size.x));
+    startSample(pixel, u_FrameCount * uint(SAMPLES) + u_Sample);
+
+    Ray ray = getCameraRay(vec2(pixel), vec2(size));
+    Path path;
+    path.origin = ray.origin;
+    path.direction = ray.direction;
+    path.bsdfPdf = 0.0;
+    path.throughput = vec3(1.0);
+    path.rngState = rngState;
+    path.sampleDimension = sampleDimension;
+    paths[pathIdx] = path;
+    rayQueue[pathIdx] = pathIdx;
+}
+#endif
+
+#ifdef WAVEFRONT_EXTEND
+// Traces the queued rays, queueing the paths that hit something for shading
+void main() {
+    if (gl_GlobalInvocationID.x >= queues[u_RayQueue].count) {
+        return;
+    }
+    uint pathIdx = rayQueue[u_RayQueue * u_PathCount + gl_GlobalInvocationID.x];
+
+    Ray ray;
+    ray.origin = paths[pathIdx].origin;
+    ray.direction = paths[pathIdx].direction;
+    Hit hit;
+    // A miss ends the path, like rayColor
+    if (!hitBvh(ray, hit)) {
+        return;
+    }
+
+    PathHit pathHit;
+    pathHit.normal = hit.normal;
+    pathHit.t = hit.t;
+    pathHit.uv = hit.uv;
+    pathHit.materialIdx = hit.materialIdx;
+    pathHit.flags = (hit.frontFace ? HIT_FRONT_FACE : 0u)
+            | (hit.textureIds.x != -1 ? HIT_TEXTURED : 0u)
+            | (objects[hit.objectIdx].type == TYPE_FACE ? HIT_FACE : 0u);
+    pathHits[pathIdx] = pathHit;
+    hitQueue[pushQueue(HIT_QUEUE)] = pathIdx;
+}
+#endif
+
+#ifdef WAVEFRONT_SHADE
+// Shades the queued hits like rayColor, adding what they find to the pixel.
+// Paths that go on are queued for the next bounce. Sorting the hit queue by
+// material type would let each type get its own kernel
+void main() {
+    if (gl_GlobalInvocationID.x >= queues[HIT_QUEUE].count) {
+        return;
+    }
+    uint pathIdx = hitQueue[gl_GlobalInvocationID.x];
+    Path path = paths[pathIdx];
+    PathHit pathHit = pathHits[pathIdx];
+    // Picks up the sample where the last bounce left it
+    uint width = uint(imageSize(imgOutput).x);
+    startSample(uvec2(pathIdx % width, pathIdx / width), u_FrameCount * uint(SAMPLES) + u_Sample);
+    rngState = path.rngState;
+    sampleDimension = path.sampleDimension;
+
+    Ray ray;
+    ray.origin = path.origin;
+    ray.direction = path.direction;
+    Hit hit;
+    hit.position = ray.origin + ray.direction * pathHit.t;
+    hit.t = pathHit.t;
+    hit.normal = pathHit.normal;
+    hit.frontFace = (pathHit.flags & HIT_FRONT_FACE) != 0u;
+    hit.materialIdx = pathHit.materialIdx;
+    hit.uv = pathHit.uv;
+    // Only whether it is textured matters past the closest hit
+    hit.textureIds = (pathHit.flags & HIT_TEXTURED) != 0u ? ivec2(0) : ivec2(-1);
+
+    vec3 found = vec3(0.0);
+    bool goesOn = shadeHit(hit, (pathHit.flags & HIT_FACE) != 0u, u_Bounce, ray,
+            path.throughput, found, path.bsdfPdf);
+    radiance[pathIdx] += vec4(found, 0.0);
+
+    path.origin = ray.origin;
+    path.direction = ray.direction;
+    path.rngState = rngState;
+    path.sampleDimension = sampleDimension;
+    paths[pathIdx] = path;
+
+    if (goesOn && u_Bounce + 1u < MAX_BOUNCES) {
+        uint nextQueue = 1u - u_RayQueue;
+        rayQueue[nextQueue * u_PathCount + pushQueue(nextQueue)] = pathIdx;
+    }
+}
+#endif
+
+#ifdef WAVEFRONT_ACCUMULATE
+// Averages the frame's samples into the image like the megakernel does
+void main() {
+    uint pathIdx = gl_GlobalInvocationID.x;
+    if (pathIdx >= u_PathCount) {
+        return;
+    }
+
+    ivec2 size = imageSize(imgOutput);
+    ivec2 pixel = ivec2(pathIdx % uint(size.x), pathIdx / uint(size.x));
+    vec3 pixelColor = radiance[pathIdx].rgb / float(u_SampleCount);
+    radiance[pathIdx] = vec4(0.0);
+
+    vec4 oldColor = imageLoad(imgOutput, pixel).rgba * min(1.0, u_FrameCount);
+    vec4 finalColor = (oldColor * u_FrameCount + vec4(pixelColor, 1.0)) / (u_FrameCount + 1.0);
+
+    imageStore(imgOutput, pixel, finalColor);
+}
+#endif
@@ -0,0 +1,67 @@
+#include "core/MappedFile.hpp"
+
+#include <fstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MAPPED_FILE_MMAP
+#endif
+
+bool MappedFile::open(const std::string &path) {
+  close();
+
+#ifdef MAPPED_FILE_MMAP
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+    ::close(fd);
+    return false;
+  }
+  void *data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping keeps the file alive on its own
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  _data = static_cast<const unsigned char *>(data);
+  _size = info.st_size;
+  _mapped = true;
+  return true;
+#else
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  if (!file.is_open()) {
+    return false;
+  }
+  std::streamsize size = file.tellg();
+  if (size <= 0) {
+    return false;
+  }
+  _buffer.resize(size);
+  file.seekg(0);
+  if (!file.read(reinterpret_cast<char *>(_buffer.data()), size)) {
+    _buffer.clear();
+    return false;
+  }
+  _data = _buffer.data();
+  _size = _buffer.size();
+  return true;
+#endif
+}
+
+void MappedFile::close() {
+#ifdef MAPPED_FILE_MMAP
+  if (_mapped) {
+    munmap(const_cast<unsigned char *>(_data), _size);
+  }
+#endif
+  _buffer.clear();
+  _data = nullptr;
+  _size = 0;
+  _mapped = false;
+}
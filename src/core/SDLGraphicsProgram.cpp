@@ -1,5 +1,6 @@
 #include "core/SDLGraphicsProgram.hpp"
 
+#include <algorithm>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/mat4x4.hpp>
 #include <glm/vec3.hpp>
@@ -14,8 +15,9 @@
 
 SDLGraphicsProgram::SDLGraphicsProgram(Window *window, Renderer *renderer)
     : _window(window), _renderer(renderer) {
-  initCornellBox();
-  initObjects();
+  _scene.initCornellBox();
+  _scene.initObjects();
+  _renderer->getCamera().setPosition(Scene::CORNELL_BOX_CAMERA);
 
   _scene.update();
   initBuffers();
@@ -131,8 +133,12 @@ void SDLGraphicsProgram::run() {
 
   _vertexBuffer.bind();
   _gpuObjectBuffer.bind();
+  _triangleBuffer.bind();
   _bvhBuffer.bind();
   _materialBuffer.bind();
+  _topLevelBuffer.bind();
+  _instanceBuffer.bind();
+  _wideBvhBuffer.bind();
 
   _lastTime = SDL_GetTicks();
   while (!_quit) {
@@ -148,6 +154,9 @@ void SDLGraphicsProgram::run() {
     // TODO: Abstract out later?
     ImGui::Begin("Ray Tracer", NULL, ImGuiWindowFlags_None);
     ImGui::Text("FPS: %.2f", 1000.0f / delta);
+    drawTraceControls();
+    drawBVHControls();
+    drawObjectControls();
     ImGui::End();
 
     render();
@@ -156,6 +165,251 @@ void SDLGraphicsProgram::run() {
   }
 }
 
+void SDLGraphicsProgram::drawTraceControls() {
+  static const char *traceModes[] = {"Tiles", "Persistent threads",
+                                     "Wavefront"};
+  int traceMode = static_cast<int>(_renderer->getTraceMode());
+  if (ImGui::Combo("Trace mode", &traceMode, traceModes,
+                   IM_ARRAYSIZE(traceModes))) {
+    _renderer->setTraceMode(static_cast<Renderer::TraceMode>(traceMode));
+    _renderer->resetFrameCount();
+  }
+
+  if (_renderer->getTraceMode() == Renderer::TraceMode::PersistentThreads) {
+    int groups = _renderer->getPersistentGroups();
+    if (ImGui::SliderInt("Persistent groups", &groups, 1, 4096)) {
+      _renderer->getPersistentGroups() = groups;
+    }
+  }
+
+  if (ImGui::Checkbox("Stackless traversal", &_renderer->getStacklessBvh())) {
+    _renderer->resetFrameCount();
+  }
+  if (ImGui::Checkbox("Light sampling", &_renderer->getLightSampling())) {
+    _renderer->resetFrameCount();
+  }
+
+  static const char *samplers[] = {"Random", "Sobol", "Blue noise"};
+  int sampler = static_cast<int>(_renderer->getSamplerType());
+  if (ImGui::Combo("Sampler", &sampler, samplers, IM_ARRAYSIZE(samplers))) {
+    _renderer->getSamplerType() = static_cast<SamplerType>(sampler);
+    _renderer->resetFrameCount();
+  }
+}
+
+void SDLGraphicsProgram::drawBVHControls() {
+  if (!ImGui::CollapsingHeader("BVH")) {
+    return;
+  }
+
+  static const char *buildModes[] = {"Serial SAH", "Parallel SAH", "LBVH",
+                                     "SBVH"};
+  int buildMode = static_cast<int>(_scene.bvhBuildMode);
+  if (ImGui::Combo("Build mode", &buildMode, buildModes,
+                   IM_ARRAYSIZE(buildModes))) {
+    _scene.bvhBuildMode = static_cast<BVH::BuildMode>(buildMode);
+  }
+
+  ImGui::Checkbox("Restructure treelets", &_scene.restructureBvh);
+  static const char *layouts[] = {"Build order", "Breadth first",
+                                  "Depth first", "van Emde Boas"};
+  int layout = static_cast<int>(_scene.bvhLayout);
+  if (ImGui::Combo("Node layout", &layout, layouts, IM_ARRAYSIZE(layouts))) {
+    _scene.bvhLayout = static_cast<BVH::NodeLayout>(layout);
+  }
+  ImGui::Checkbox("Cache BVHs", &_scene.cacheBvh);
+
+  // Applied on the next rebuild
+  BVH::BuildSettings &settings = _scene.bvhSettings;
+  int binCount = settings.binCount;
+  if (ImGui::SliderInt("Bins", &binCount, 4, MAX_BIN_COUNT)) {
+    settings.binCount = binCount;
+  }
+  int sweepThreshold = settings.sweepThreshold;
+  if (ImGui::SliderInt("Exact sweep below", &sweepThreshold, 0,
+                       BVH::MAX_SWEEP_OBJECTS)) {
+    settings.sweepThreshold = sweepThreshold;
+  }
+  int leafSize = settings.leafSize;
+  if (ImGui::SliderInt("Leaf size", &leafSize, 1, 8)) {
+    settings.leafSize = leafSize;
+  }
+  ImGui::SliderFloat("Traversal cost", &settings.traversalCost, 0.0f, 4.0f,
+                     "%.2f x intersection");
+
+  static const char *widths[] = {"Binary", "BVH4", "BVH8"};
+  static const unsigned int widthValues[] = {2, 4, 8};
+  int width = std::find(std::begin(widthValues), std::end(widthValues),
+                        _scene.bvhWidth) -
+              std::begin(widthValues);
+  if (ImGui::Combo("Width", &width, widths, IM_ARRAYSIZE(widths))) {
+    _scene.bvhWidth = widthValues[width];
+  }
+
+  ImGui::Checkbox("Compressed nodes", &_scene.compressedBvh);
+  ImGui::Checkbox("Instancing", &_scene.instancing);
+
+  ImGui::Text("Nodes: %zu", _scene.gpu.nodes.size());
+  if (_scene.gpu.usesWideBvh()) {
+    ImGui::Text("Wide node memory: %zuKB",
+                _scene.gpu.wideNodes.size() * sizeof(uint32_t) / 1024);
+  }
+  ImGui::Text("Object references: %zu", _scene.gpu.objects.size());
+  ImGui::Text("Instances: %zu", _scene.gpu.instances.size());
+  ImGui::Text("Build time: %.2fms", _scene.bvh.getBuildTime());
+  ImGui::Text("Binning kernels: %s", getSimdLevelName(getSimdLevel()));
+  drawBVHStats();
+
+  if (ImGui::Button("Rebuild")) {
+    rebuildBVH();
+  }
+  ImGui::SameLine();
+  if (ImGui::Button("Compare builds")) {
+    _scene.compareBVHBuilds();
+  }
+  ImGui::SameLine();
+  if (ImGui::Button("Compare widths")) {
+    _scene.compareBVHWidths();
+  }
+  ImGui::SameLine();
+  if (ImGui::Button("Compare layouts")) {
+    _scene.compareBVHLayouts();
+  }
+}
+
+void SDLGraphicsProgram::drawBVHStats() {
+  for (size_t i = 0; i < _scene.bvhStats.size(); i++) {
+    const BVHStats &stats = _scene.bvhStats[i];
+    if (_scene.bvhStats.size() > 1) {
+      ImGui::Separator();
+      ImGui::Text("Bottom level %zu", i);
+    }
+
+    ImGui::Text("SAH cost: %.2f, EPO: %.2f", stats.sahCost, stats.epo);
+    ImGui::Text("Sibling overlap: %.2f", stats.overlap);
+    ImGui::Text("Leaf depth min/avg/max: %u/%.1f/%u", stats.minDepth,
+                stats.avgDepth, stats.maxDepth);
+    ImGui::Text("Leaves: %zu, memory: %zuKB", stats.numLeaves,
+                stats.memoryBytes / 1024);
+    for (size_t size = 0; size < stats.leafSizes.size(); size++) {
+      ImGui::BulletText("%zu%s objects: %zu", size + 1,
+                        size + 1 == stats.leafSizes.size() ? "+" : "",
+                        stats.leafSizes[size]);
+    }
+  }
+}
+
+void SDLGraphicsProgram::drawObjectControls() {
+  if (!ImGui::CollapsingHeader("Objects") || _scene.objects.empty()) {
+    return;
+  }
+
+  // Spawning and deleting edit the BVH in place instead of rebuilding it
+  static const char *spawnNames[] = {"Cube", "Reduced bunny", "Bunny"};
+  static const char *spawnModels[] = {
+      "res/models/cube/cube.obj",
+      "res/models/bunny/bunny_centered_reduced_fixed.obj",
+      "res/models/bunny/bunny_centered_fixed.obj"};
+  static int spawnModel = 0;
+  ImGui::Combo("Model", &spawnModel, spawnNames, IM_ARRAYSIZE(spawnNames));
+  if (ImGui::Button("Spawn")) {
+    const Camera &camera = _renderer->getCamera();
+    Object object(spawnModels[spawnModel]);
+    object.transform.setPosition(camera.getPosition() +
+                                 camera.getViewDirection() * 300.0f);
+    object.transform.setScale(50.0f, 50.0f, 50.0f);
+    uploadEdit(_scene.addObject(object));
+  }
+
+  static int selected = 0;
+  selected = std::min<int>(selected, _scene.objects.size() - 1);
+  ImGui::SameLine();
+  // The world BVH always keeps an object
+  if (ImGui::Button("Delete object") && _scene.objects.size() > 1) {
+    uploadEdit(_scene.removeObject(selected));
+    selected = std::min<int>(selected, _scene.objects.size() - 1);
+  }
+
+  ImGui::SliderInt("Object", &selected, 0, _scene.objects.size() - 1);
+  Transform &transform = _scene.objects[selected].transform;
+
+  // Moving an object only refits the BVH (or moves its instance), rebuild
+  // for a better tree
+  glm::vec3 position = transform.getPosition();
+  glm::vec3 rotation = transform.getRotation();
+  bool moved = ImGui::DragFloat3("Position", &position.x, 1.0f);
+  moved |= ImGui::DragFloat3("Rotation", &rotation.x, 1.0f);
+  if (moved) {
+    transform.setPosition(position);
+    transform.setRotation(rotation);
+    refitBVH();
+  }
+}
+
+void SDLGraphicsProgram::refitBVH() {
+  auto changes = _scene.refit();
+  _vertexBuffer.updateStorageBuffer(_scene.gpu.vertices, changes.vertices);
+  _triangleBuffer.updateStorageBuffer(_scene.gpu.triangles, changes.triangles);
+  _bvhBuffer.updateStorageBuffer(_scene.gpu.nodes, changes.nodes);
+  if (changes.topLevel) {
+    // Small enough to reallocate, the top level node count can change
+    _topLevelBuffer.createStorageBuffer(_scene.gpu.topLevelNodes,
+                                        GL_DYNAMIC_DRAW, 5);
+    _topLevelParentBuffer.createStorageBuffer(_scene.gpu.topLevelParents,
+                                              GL_DYNAMIC_DRAW, 17);
+    _instanceBuffer.createStorageBuffer(_scene.gpu.instances, GL_DYNAMIC_DRAW,
+                                        6);
+  }
+  if (changes.wideNodes) {
+    _wideBvhBuffer.updateStorageBuffer(_scene.gpu.wideNodes);
+  }
+  if (changes.lights) {
+    _lightBuffer.updateStorageBuffer(_scene.gpu.lights);
+  }
+  _renderer->resetFrameCount();
+}
+
+void SDLGraphicsProgram::uploadEdit(const Scene::EditChanges &changes) {
+  _vertexBuffer.updateStorageBuffer(_scene.gpu.vertices,
+                                    std::vector<IndexRange>{changes.vertices});
+  _gpuObjectBuffer.updateStorageBuffer(_scene.gpu.objects, changes.objects);
+  _triangleBuffer.updateStorageBuffer(_scene.gpu.triangles, changes.objects);
+  _bvhBuffer.updateStorageBuffer(_scene.gpu.nodes, changes.nodes);
+  _parentBuffer.updateStorageBuffer(_scene.gpu.parents, changes.parents);
+  if (changes.materials) {
+    _materialBuffer.createStorageBuffer(_scene.materials, GL_STATIC_DRAW, 4);
+  }
+  // The scene's copies share the spawned object's textures, which go away
+  // with it, so they get their own. Rendering binds them every frame
+  for (size_t i = changes.textures.first;
+       i < changes.textures.first + changes.textures.count; i++) {
+    _scene.textures[i].loadFromFile();
+  }
+  if (changes.topLevel) {
+    _topLevelBuffer.createStorageBuffer(_scene.gpu.topLevelNodes,
+                                        GL_DYNAMIC_DRAW, 5);
+    _topLevelParentBuffer.createStorageBuffer(_scene.gpu.topLevelParents,
+                                              GL_DYNAMIC_DRAW, 17);
+    _instanceBuffer.createStorageBuffer(_scene.gpu.instances, GL_DYNAMIC_DRAW,
+                                        6);
+  }
+  if (changes.wideNodes) {
+    // Collapsing redoes the whole buffer
+    _wideBvhBuffer.createStorageBuffer(_scene.gpu.wideNodes, GL_DYNAMIC_DRAW,
+                                       7);
+  }
+  if (changes.lights) {
+    _lightBuffer.createStorageBuffer(_scene.gpu.lights, GL_DYNAMIC_DRAW, 18);
+  }
+  _renderer->resetFrameCount();
+}
+
+void SDLGraphicsProgram::rebuildBVH() {
+  _scene.update();
+  initBuffers();
+  _renderer->resetFrameCount();
+}
+
 void SDLGraphicsProgram::getOpenGLVersionInfo() {
   std::cout << "Vendor: " << glGetString(GL_VENDOR) << "\n";
   std::cout << "Renderer: " << glGetString(GL_RENDERER) << "\n";
@@ -164,121 +418,19 @@ void SDLGraphicsProgram::getOpenGLVersionInfo() {
             << "\n";
 }
 
-void SDLGraphicsProgram::initCornellBox() {
-  Material white = Material::lambertian(glm::vec3(0.73f));
-  Material red = Material::lambertian(glm::vec3(0.65f, 0.05f, 0.05f));
-  Material green = Material::lambertian(glm::vec3(0.12f, 0.45f, 0.15f));
-
-  Mesh quadMesh;
-  quadMesh.vertices = {
-      {{-0.5f, -0.5f, 0.0f}},
-      {{0.5f, -0.5f, 0.0f}},
-      {{0.5f, 0.5f, 0.0f}},
-      {{-0.5f, 0.5f, 0.0f}},
-  };
-  quadMesh.indices = {0, 1, 2, 0, 2, 3};
-
-  Object quadObj(quadMesh, white);
-
-  // Floor
-  quadObj.transform.setPosition(277.5f, 0.0f, -277.5f);
-  quadObj.transform.setRotation(-90.0f, 0.0f, 0.0f);
-  quadObj.transform.setScale(555.0f, 555.0f, 1.0f);
-  _scene.objects.push_back(quadObj);
-
-  // Ceiling
-  quadObj.transform.setPosition(277.5f, 555.0f, -277.5f);
-  quadObj.transform.setRotation(90.0f, 0.0f, 0.0f);
-  _scene.objects.push_back(quadObj);
-
-  // Back wall
-  quadObj.transform.setPosition(277.5f, 277.5f, -555.0f);
-  quadObj.transform.setRotation(0.0f, 0.0f, 0.0f);
-  _scene.objects.push_back(quadObj);
-
-  // Left wall
-  quadObj.material = red;
-  quadObj.transform.setPosition(0.0f, 277.5f, -277.5f);
-  quadObj.transform.setRotation(0.0f, 90.0f, 0.0f);
-  _scene.objects.push_back(quadObj);
-
-  // Right wall
-  quadObj.material = green;
-  quadObj.transform.setPosition(555.0f, 277.5f, -277.5f);
-  quadObj.transform.setRotation(0.0f, -90.0f, 0.0f);
-  _scene.objects.push_back(quadObj);
-
-  // Light
-  quadObj.material = Material::light();
-  quadObj.transform.setPosition(277.5f, 554.0f, -277.5f);
-  quadObj.transform.setRotation(90.0f, 0.0f, 0.0f);
-  quadObj.transform.setScale(130.0f, 105.0f, 1.0f);
-  _scene.objects.push_back(quadObj);
-
-  Mesh cubeMesh;
-  cubeMesh.vertices = {
-      // front
-      {{-0.5f, -0.5f, 0.5f}},
-      {{0.5f, -0.5f, 0.5f}},
-      {{0.5f, 0.5f, 0.5f}},
-      {{-0.5f, 0.5f, 0.5f}},
-      // back
-      {{-0.5f, -0.5f, -0.5f}},
-      {{0.5f, -0.5f, -0.5f}},
-      {{0.5f, 0.5f, -0.5f}},
-      {{-0.5f, 0.5f, -0.5f}},
-  };
-  cubeMesh.indices = {
-      0, 1, 2, 0, 2, 3, // front
-      1, 5, 6, 1, 6, 2, // right
-      5, 4, 7, 5, 7, 6, // back
-      4, 0, 3, 4, 3, 7, // left
-      3, 2, 6, 3, 6, 7, // top
-      4, 5, 1, 4, 1, 0, // bottom
-  };
-
-  Object cubeObj(cubeMesh, white);
-
-  // Short block
-  cubeObj.transform.setPosition(369.5f, 82.5f, -169.0f);
-  cubeObj.transform.setRotation(0.0f, -18.0f, 0.0f);
-  cubeObj.transform.setScale(165.0f, 165.0f, 165.0f);
-  _scene.objects.push_back(cubeObj);
-
-  // Tall block
-  cubeObj.transform.setPosition(186.5f, 165.0f, -351.25f);
-  cubeObj.transform.setRotation(0.0f, 15.0f, 0.0f);
-  cubeObj.transform.setScale(165.0f, 330.0f, 165.0f);
-  _scene.objects.push_back(cubeObj);
-
-  // Move the camera
-  _renderer->getCamera().setPosition(277.5f, 277.5f, 800.0f);
-}
-
-void SDLGraphicsProgram::initObjects() {
-  // Add some spheres
-  // _scene.spheres.push_back(
-  //     {{369.5f, 250.0f, -169.0f}, 80.0f, Material::dielectric()});
-  _scene.spheres.push_back(
-      {{186.5f, 420.0f, -351.25f}, 90.0f, Material::metal()});
-
-  Object &bunny =
-      _scene.objects.emplace_back("res/models/bunny/bunny_centered_fixed.obj");
-  bunny.transform.setPosition(369.5f, 215.0f, -169.0f);
-  bunny.transform.setScale(100.0f, 100.0f, 100.0f);
-
-  // Textured cube
-  // Object &texturedCube =
-  //     _scene.objects.emplace_back("res/models/textured_cube/cube.obj");
-  // texturedCube.transform.setPosition(369.5f, 250.0f, -200.0f);
-  // texturedCube.transform.setScale(50.0f, 50.0f, 50.0f);
-  // texturedCube.transform.setRotation(45.0f, 45.0f, 0.0f);
-}
-
 void SDLGraphicsProgram::initBuffers() {
-  _vertexBuffer.createStorageBuffer(_scene.getVertices(), GL_STATIC_DRAW, 1);
-  _gpuObjectBuffer.createStorageBuffer(_scene.bvh.getGpuObjects(),
-                                       GL_STATIC_DRAW, 2);
-  _bvhBuffer.createStorageBuffer(_scene.bvh.getNodes(), GL_STATIC_DRAW, 3);
+  _vertexBuffer.createStorageBuffer(_scene.gpu.vertices, GL_DYNAMIC_DRAW, 1);
+  _gpuObjectBuffer.createStorageBuffer(_scene.gpu.objects, GL_DYNAMIC_DRAW, 2);
+  _bvhBuffer.createStorageBuffer(_scene.gpu.nodes, GL_DYNAMIC_DRAW, 3);
   _materialBuffer.createStorageBuffer(_scene.materials, GL_STATIC_DRAW, 4);
+  _topLevelBuffer.createStorageBuffer(_scene.gpu.topLevelNodes,
+                                      GL_DYNAMIC_DRAW, 5);
+  _topLevelParentBuffer.createStorageBuffer(_scene.gpu.topLevelParents,
+                                            GL_DYNAMIC_DRAW, 17);
+  _instanceBuffer.createStorageBuffer(_scene.gpu.instances, GL_DYNAMIC_DRAW,
+                                      6);
+  _wideBvhBuffer.createStorageBuffer(_scene.gpu.wideNodes, GL_DYNAMIC_DRAW, 7);
+  _triangleBuffer.createStorageBuffer(_scene.gpu.triangles, GL_DYNAMIC_DRAW, 8);
+  _parentBuffer.createStorageBuffer(_scene.gpu.parents, GL_DYNAMIC_DRAW, 16);
+  _lightBuffer.createStorageBuffer(_scene.gpu.lights, GL_DYNAMIC_DRAW, 18);
 }
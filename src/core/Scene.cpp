@@ -1,67 +1,920 @@
 #include "core/Scene.hpp"
 
 #include <algorithm>
+#include <chrono>
+#include <cstdio>
 #include <iostream>
+#include <random>
+#include <string>
 
 #include <SDL3/SDL.h>
 
-void Scene::update() {
-  for (int i = 0; i < objects.size(); i++) {
-    auto &object = objects[i];
+namespace {
+bool sameMesh(const Mesh &a, const Mesh &b) {
+  return a.indices == b.indices &&
+         std::equal(a.vertices.begin(), a.vertices.end(), b.vertices.begin(),
+                    b.vertices.end(),
+                    [](const MeshVertex &a, const MeshVertex &b) {
+                      return a.position == b.position && a.uv == b.uv;
+                    });
+}
+} // namespace
 
+void Scene::update() {
+  for (auto &object : objects) {
     object.transform.computeModelMatrix();
+    addMaterials(object);
+  }
 
-    // Add the object's material to the materials vector if it doesn't exist
-    const auto &material = object.material;
+  // Add the spheres' materials to the materials vector if they don't exist
+  for (const auto &sphere : spheres) {
+    const auto &material = sphere.material;
     auto materialIt = std::find(materials.begin(), materials.end(), material);
     if (materialIt == materials.end()) {
       materials.push_back(material);
     }
+  }
 
-    // Add the object's textures to the textures vector if they don't exist
-    for (const auto &texture : object.textures) {
-      auto textureIt = std::find(textures.begin(), textures.end(), texture);
-      if (textureIt == textures.end()) {
-        textures.push_back(texture);
+  _modelMatrices.clear();
+  for (const auto &object : objects) {
+    _modelMatrices.push_back(object.transform.getModelMatrix());
+  }
+
+  // Time how long it takes to build the BVH
+  auto start = SDL_GetTicks();
+  if (instancing) {
+    buildInstanced();
+  } else {
+    buildFlat();
+  }
+  gpu.bvhWidth = bvhWidth;
+  gpu.compressedBvh = compressedBvh;
+  collapseBottomLevels();
+  buildTopLevel();
+  updateLights();
+  auto end = SDL_GetTicks();
+  std::cout << "BVH build time: " << end - start << "ms" << std::endl;
+}
+
+void Scene::buildFlat() {
+  gpu = {};
+  gpu.vertices = getVertices();
+  _vertexOffsets.clear();
+  unsigned int vertexOffset = 0;
+  for (const auto &object : objects) {
+    _vertexOffsets.push_back(vertexOffset);
+    vertexOffset += object.mesh.vertices.size();
+  }
+  buildBottomLevel(bvh, getGpuObjects());
+  bvhStats = {bvh.getStats(gpu.vertices)};
+  std::cout << "BVH stats:\n" << bvhStats.back() << std::flush;
+  gpu.objects = bvh.getGpuObjects();
+  updateTriangles(0, gpu.objects.size());
+  gpu.nodes = bvh.getNodes();
+  BVH::linkParents(gpu.nodes, 0, gpu.nodes.size(), gpu.parents);
+
+  const BVHNode &root = gpu.nodes[0];
+  _bottomLevelRoots = {0};
+  _instances = {GpuInstance{}};
+  _instanceBounds = {{root.aabbMin, root.aabbMax}};
+}
+
+void Scene::buildInstanced() {
+  gpu = {};
+  bvh = {};
+  bvhStats.clear();
+  _bottomLevelRoots.clear();
+  _instances.clear();
+  _instanceBounds.clear();
+  _vertexOffsets.clear();
+
+  // Objects sharing a mesh share its BVH
+  std::vector<const Mesh *> meshes;
+  std::vector<unsigned int> meshRoots;
+  std::vector<unsigned int> meshOffsets;
+  for (const auto &object : objects) {
+    auto meshIt =
+        std::find_if(meshes.begin(), meshes.end(), [&](const Mesh *mesh) {
+          return sameMesh(*mesh, object.mesh);
+        });
+    size_t meshIdx = std::distance(meshes.begin(), meshIt);
+
+    if (meshIt == meshes.end()) {
+      unsigned int offset = gpu.vertices.size();
+      for (const auto &vertex : object.mesh.vertices) {
+        gpu.vertices.push_back({vertex.position, vertex.uv});
       }
+
+      meshes.push_back(&object.mesh);
+      meshRoots.push_back(
+          appendBottomLevel(getMeshObjects(object.mesh, offset)));
+      meshOffsets.push_back(offset);
     }
+    _vertexOffsets.push_back(meshOffsets[meshIdx]);
+
+    const auto &material = object.material;
+    auto materialIt = std::find(materials.begin(), materials.end(), material);
+
+    GpuInstance instance;
+    instance.worldToObject = glm::inverse(object.transform.getModelMatrix());
+    instance.rootNode = meshRoots[meshIdx];
+    instance.materialIdx = std::distance(materials.begin(), materialIt);
+    instance.textureIndices = getTextureIndices(object);
+    _instances.push_back(instance);
+
+    const BVHNode &root = gpu.nodes[instance.rootNode];
+    _instanceBounds.push_back({root.aabbMin, root.aabbMax});
   }
 
-  // Add the faces into the gpuObjects vector
+  // The spheres stay in world space under one identity instance
+  if (!spheres.empty()) {
+    GpuInstance instance;
+    instance.rootNode = appendBottomLevel(getSphereObjects());
+    _instances.push_back(instance);
+
+    const BVHNode &root = gpu.nodes[instance.rootNode];
+    _instanceBounds.push_back({root.aabbMin, root.aabbMax});
+  }
+
+  std::cout << "Number of bottom level BVHs: " << meshes.size() +
+                                                      !spheres.empty()
+            << ", instances: " << _instances.size() << std::endl;
+}
+
+unsigned int
+Scene::appendBottomLevel(const std::vector<GpuObject> &gpuObjects) {
+  BVH bottomLevel;
+  buildBottomLevel(bottomLevel, gpuObjects);
+  bvhStats.push_back(bottomLevel.getStats(gpu.vertices));
+  std::cout << "Bottom level BVH " << bvhStats.size() - 1 << " stats:\n"
+            << bvhStats.back() << std::flush;
+
+  // Point the nodes at where they and their objects end up in the buffers
+  unsigned int nodeOffset = gpu.nodes.size();
+  unsigned int objectOffset = gpu.objects.size();
+  for (BVHNode node : bottomLevel.getNodes()) {
+    node.leftFirst += node.numObjects != 0 ? objectOffset : nodeOffset;
+    gpu.nodes.push_back(node);
+  }
+  BVH::linkParents(gpu.nodes, nodeOffset, gpu.nodes.size(), gpu.parents);
+  for (const auto &object : bottomLevel.getGpuObjects()) {
+    gpu.objects.push_back(object);
+  }
+  updateTriangles(objectOffset, gpu.objects.size());
+
+  _bottomLevelRoots.push_back(nodeOffset);
+  return nodeOffset;
+}
+
+void Scene::buildBottomLevel(BVH &bottomLevel,
+                             const std::vector<GpuObject> &gpuObjects) {
+  bottomLevel.setBuildSettings(bvhSettings);
+  uint64_t key = BVH::getCacheKey(gpuObjects, gpu.vertices, bvhBuildMode,
+                                  bottomLevel.getBuildSettings(),
+                                  restructureBvh |
+                                      uint64_t(bvhLayout) << 1);
+  char name[32];
+  std::snprintf(name, sizeof(name), "%016llx.bvh", (unsigned long long)key);
+  std::string path = bvhCacheDir + "/" + name;
+
+  if (cacheBvh && bottomLevel.load(path, key)) {
+    std::cout << "Loaded BVH from " << path << " in "
+              << bottomLevel.getBuildTime() << "ms" << std::endl;
+    return;
+  }
+
+  bottomLevel.buildBVH(gpuObjects, gpu.vertices, bvhBuildMode);
+  if (restructureBvh) {
+    restructureBottomLevel(bottomLevel);
+  }
+  bottomLevel.reorderNodes(bvhLayout);
+  if (cacheBvh && !bottomLevel.save(path, key)) {
+    std::cout << "Unable to save BVH to " << path << std::endl;
+  }
+}
+
+void Scene::restructureBottomLevel(BVH &bottomLevel) const {
+  float before = bottomLevel.getSAHCost();
+  auto start = std::chrono::high_resolution_clock::now();
+  bottomLevel.restructureTreelets();
+  auto end = std::chrono::high_resolution_clock::now();
+
+  std::cout << "Treelet restructuring: SAH cost " << before << " -> "
+            << bottomLevel.getSAHCost() << " in "
+            << std::chrono::duration<float, std::milli>(end - start).count()
+            << "ms" << std::endl;
+}
+
+void Scene::collapseBottomLevels() {
+  if (!gpu.usesWideBvh()) {
+    gpu.wideNodes.clear();
+    return;
+  }
+
+  _wideBvh.collapse(gpu.nodes, _bottomLevelRoots, gpu.bvhWidth,
+                    gpu.compressedBvh);
+  gpu.wideNodes = _wideBvh.getData();
+}
+
+void Scene::buildTopLevel() {
+  // World space bounds of every instance's object space box
+  std::vector<AABB> bounds;
+  for (size_t i = 0; i < _instances.size(); i++) {
+    glm::mat4 objectToWorld = glm::inverse(_instances[i].worldToObject);
+    const AABB &local = _instanceBounds[i];
+    AABB world;
+    for (int corner = 0; corner < 8; corner++) {
+      glm::vec3 point(corner & 1 ? local.max.x : local.min.x,
+                      corner & 2 ? local.max.y : local.min.y,
+                      corner & 4 ? local.max.z : local.min.z);
+      world.extend(glm::vec3(objectToWorld * glm::vec4(point, 1.0f)));
+    }
+    bounds.push_back(world);
+  }
+
+  topLevelBvh.buildBVH(bounds);
+  gpu.topLevelNodes = topLevelBvh.getNodes();
+  BVH::linkParents(gpu.topLevelNodes, 0, gpu.topLevelNodes.size(),
+                   gpu.topLevelParents);
+
+  // Store the instances in leaf order so leaves index them directly
+  gpu.instances.clear();
+  for (const auto &object : topLevelBvh.getGpuObjects()) {
+    GpuInstance instance = _instances[object.data.x];
+    if (gpu.usesWideBvh()) {
+      instance.rootNode = _wideBvh.getRoot(instance.rootNode);
+    }
+    gpu.instances.push_back(instance);
+  }
+}
+
+Scene::RefitChanges Scene::refit() {
+  RefitChanges changes;
+
+  // Only move the objects that actually moved
+  for (size_t i = 0; i < objects.size(); i++) {
+    auto &object = objects[i];
+    object.transform.computeModelMatrix();
+    const auto &modelMatrix = object.transform.getModelMatrix();
+    const auto &meshVertices = object.mesh.vertices;
+    size_t offset = _vertexOffsets[i];
+
+    if (modelMatrix != _modelMatrices[i]) {
+      _modelMatrices[i] = modelMatrix;
+      changes.lights |= object.material.type == MaterialType::LIGHT;
+      if (instancing) {
+        _instances[i].worldToObject = glm::inverse(modelMatrix);
+        changes.topLevel = true;
+      } else {
+        for (size_t j = 0; j < meshVertices.size(); j++) {
+          glm::vec4 position =
+              modelMatrix * glm::vec4(meshVertices[j].position, 1.0f);
+          gpu.vertices[offset + j] = {position, meshVertices[j].uv};
+        }
+        changes.vertices.extend(offset, offset + meshVertices.size());
+      }
+    }
+  }
+
+  if (!changes.vertices.empty()) {
+    changes.triangles = updateTriangles(0, gpu.objects.size());
+    changes.nodes = bvh.refit(gpu.vertices);
+    std::copy_n(bvh.getNodes().begin() + changes.nodes.first,
+                changes.nodes.count, gpu.nodes.begin() + changes.nodes.first);
+
+    // The single instance has to grow with the world BVH
+    const BVHNode &root = gpu.nodes[0];
+    _instanceBounds[0] = {root.aabbMin, root.aabbMax};
+    changes.topLevel = true;
+
+    // Collapsing is linear and keeps the same shape, so just redo it
+    if (gpu.usesWideBvh()) {
+      collapseBottomLevels();
+      changes.wideNodes = true;
+    }
+  }
+
+  if (changes.topLevel) {
+    buildTopLevel();
+  }
+  if (changes.lights) {
+    updateLights();
+  }
+  return changes;
+}
+
+Scene::EditChanges Scene::addObject(const Object &object) {
+  EditChanges changes;
+  Object &added = objects.emplace_back(object);
+  added.transform.computeModelMatrix();
+  const auto &modelMatrix = added.transform.getModelMatrix();
+  _modelMatrices.push_back(modelMatrix);
+  size_t textureCount = textures.size();
+  changes.materials = addMaterials(added);
+  if (textures.size() > textureCount) {
+    changes.textures.extend(textureCount, textures.size());
+  }
+  if (added.material.type == MaterialType::LIGHT) {
+    updateLights();
+    changes.lights = true;
+  }
+
+  if (instancing) {
+    // Another object's mesh BVH is reused as is
+    size_t other = 0;
+    while (other + 1 < objects.size() &&
+           !sameMesh(objects[other].mesh, added.mesh)) {
+      other++;
+    }
+
+    GpuInstance instance;
+    if (other + 1 < objects.size()) {
+      instance.rootNode = _instances[other].rootNode;
+      _vertexOffsets.push_back(_vertexOffsets[other]);
+    } else {
+      unsigned int offset = gpu.vertices.size();
+      for (const auto &vertex : added.mesh.vertices) {
+        gpu.vertices.push_back({vertex.position, vertex.uv});
+      }
+      changes.vertices.extend(offset, gpu.vertices.size());
+      _vertexOffsets.push_back(offset);
+
+      size_t numNodes = gpu.nodes.size();
+      size_t numObjects = gpu.objects.size();
+      instance.rootNode =
+          appendBottomLevel(getMeshObjects(added.mesh, offset));
+      changes.nodes = {{numNodes, gpu.nodes.size() - numNodes}};
+      // Only the new nodes have new parents
+      changes.parents = changes.nodes;
+      changes.objects = {{numObjects, gpu.objects.size() - numObjects}};
+      if (gpu.usesWideBvh()) {
+        collapseBottomLevels();
+        changes.wideNodes = true;
+      }
+    }
+
+    const auto &material = added.material;
+    auto materialIt = std::find(materials.begin(), materials.end(), material);
+    instance.worldToObject = glm::inverse(modelMatrix);
+    instance.materialIdx = std::distance(materials.begin(), materialIt);
+    instance.textureIndices = getTextureIndices(added);
+
+    // The spheres' instance stays last
+    const BVHNode &root = gpu.nodes[instance.rootNode];
+    size_t instanceIdx = objects.size() - 1;
+    _instances.insert(_instances.begin() + instanceIdx, instance);
+    _instanceBounds.insert(_instanceBounds.begin() + instanceIdx,
+                           {root.aabbMin, root.aabbMax});
+    buildTopLevel();
+    changes.topLevel = true;
+    return changes;
+  }
+
+  unsigned int offset = gpu.vertices.size();
+  for (const auto &vertex : added.mesh.vertices) {
+    glm::vec4 position = modelMatrix * glm::vec4(vertex.position, 1.0f);
+    gpu.vertices.push_back({position, vertex.uv});
+  }
+  changes.vertices.extend(offset, gpu.vertices.size());
+  _vertexOffsets.push_back(offset);
+
+  auto faces = getMeshObjects(added.mesh, offset);
+  const auto &material = added.material;
+  auto materialIt = std::find(materials.begin(), materials.end(), material);
+  for (auto &face : faces) {
+    face.materialIdx = std::distance(materials.begin(), materialIt);
+    face.textureIndices = getTextureIndices(added);
+  }
+  applyBVHChanges(bvh.insert(faces, gpu.vertices), changes);
+  return changes;
+}
+
+Scene::EditChanges Scene::removeObject(size_t index) {
+  EditChanges changes;
+  if (index >= objects.size()) {
+    return changes;
+  }
+
+  uint32_t first = _vertexOffsets[index];
+  uint32_t last = first + objects[index].mesh.vertices.size();
+  changes.lights = objects[index].material.type == MaterialType::LIGHT;
+  objects.erase(objects.begin() + index);
+  _modelMatrices.erase(_modelMatrices.begin() + index);
+  _vertexOffsets.erase(_vertexOffsets.begin() + index);
+  if (changes.lights) {
+    updateLights();
+  }
+
+  if (instancing) {
+    _instances.erase(_instances.begin() + index);
+    _instanceBounds.erase(_instanceBounds.begin() + index);
+    buildTopLevel();
+    changes.topLevel = true;
+    return changes;
+  }
+
+  // Its faces are the only ones using its vertices
+  auto usesVertices = [&](const GpuObject &object) {
+    return object.type == ObjectType::Face && object.data.x >= first &&
+           object.data.x < last;
+  };
+  applyBVHChanges(bvh.removeIf(usesVertices), changes);
+  return changes;
+}
+
+void Scene::applyBVHChanges(const BVH::Changes &bvhChanges,
+                            EditChanges &changes) {
+  const auto &nodes = bvh.getNodes();
+  const auto &bvhObjects = bvh.getGpuObjects();
+  gpu.nodes.resize(nodes.size());
+  gpu.objects.resize(bvhObjects.size());
+  for (const auto &range : bvhChanges.nodes) {
+    std::copy_n(nodes.begin() + range.first, range.count,
+                gpu.nodes.begin() + range.first);
+  }
+  // Only the children of changed nodes can have moved, so link them once
+  // every changed node is in place
+  for (const auto &range : bvhChanges.nodes) {
+    IndexRange parents = BVH::linkParents(
+        gpu.nodes, range.first, range.first + range.count, gpu.parents);
+    if (!parents.empty()) {
+      changes.parents.push_back(parents);
+    }
+  }
+  for (const auto &range : bvhChanges.objects) {
+    std::copy_n(bvhObjects.begin() + range.first, range.count,
+                gpu.objects.begin() + range.first);
+    updateTriangles(range.first, range.first + range.count);
+  }
+  changes.nodes = bvhChanges.nodes;
+  changes.objects = bvhChanges.objects;
+
+  // The single instance follows the world BVH's root
+  const BVHNode &root = gpu.nodes[0];
+  _instanceBounds[0] = {root.aabbMin, root.aabbMax};
+  buildTopLevel();
+  changes.topLevel = true;
+
+  if (gpu.usesWideBvh()) {
+    collapseBottomLevels();
+    changes.wideNodes = true;
+  }
+}
+
+IndexRange Scene::updateTriangles(size_t begin, size_t end) {
+  gpu.triangles.resize(gpu.objects.size());
+  IndexRange changed;
+  for (size_t i = begin; i < end; i++) {
+    const GpuObject &object = gpu.objects[i];
+    GpuTriangle triangle;
+    if (object.type == ObjectType::Face) {
+      glm::vec3 v0 = gpu.vertices[object.data.x].position;
+      glm::vec3 v1 = gpu.vertices[object.data.y].position;
+      glm::vec3 v2 = gpu.vertices[object.data.z].position;
+      triangle = {glm::vec4(v0, 0.0f), glm::vec4(v1 - v0, 0.0f),
+                  glm::vec4(v2 - v0, 0.0f)};
+    }
+
+    GpuTriangle &old = gpu.triangles[i];
+    if (old.v0 != triangle.v0 || old.edge1 != triangle.edge1 ||
+        old.edge2 != triangle.edge2) {
+      old = triangle;
+      changed.extend(i);
+    }
+  }
+  return changed;
+}
+
+void Scene::updateLights() {
+  gpu.lights.clear();
+  std::vector<float> areas;
+  for (const auto &object : objects) {
+    if (object.material.type != MaterialType::LIGHT) {
+      continue;
+    }
+
+    auto materialIt =
+        std::find(materials.begin(), materials.end(), object.material);
+    uint32_t materialIdx = std::distance(materials.begin(), materialIt);
+    const glm::mat4 &modelMatrix = object.transform.getModelMatrix();
+    const auto &vertices = object.mesh.vertices;
+    const auto &indices = object.mesh.indices;
+    for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+      glm::vec3 v0(modelMatrix *
+                   glm::vec4(vertices[indices[i]].position, 1.0f));
+      glm::vec3 v1(modelMatrix *
+                   glm::vec4(vertices[indices[i + 1]].position, 1.0f));
+      glm::vec3 v2(modelMatrix *
+                   glm::vec4(vertices[indices[i + 2]].position, 1.0f));
+
+      // Degenerate faces could never be hit
+      float area = 0.5f * glm::length(glm::cross(v1 - v0, v2 - v0));
+      if (area > 0.0f) {
+        GpuLight light;
+        light.v0 = v0;
+        light.edge1 = v1 - v0;
+        light.edge2 = v2 - v0;
+        light.materialIdx = materialIdx;
+        gpu.lights.push_back(light);
+        areas.push_back(area);
+      }
+    }
+  }
+
+  gpu.lightArea = 0.0f;
+  for (float area : areas) {
+    gpu.lightArea += area;
+  }
+
+  // Scaled so the average light has 1. Each light below 1 is topped up by
+  // one above, which becomes its alias
+  size_t count = gpu.lights.size();
+  std::vector<uint32_t> below;
+  std::vector<uint32_t> above;
+  for (size_t i = 0; i < count; i++) {
+    areas[i] *= count / gpu.lightArea;
+    (areas[i] < 1.0f ? below : above).push_back(i);
+  }
+  while (!below.empty() && !above.empty()) {
+    uint32_t lower = below.back();
+    uint32_t upper = above.back();
+    below.pop_back();
+    gpu.lights[lower].aliasProbability = areas[lower];
+    gpu.lights[lower].alias = upper;
+    areas[upper] -= 1.0f - areas[lower];
+    if (areas[upper] < 1.0f) {
+      above.pop_back();
+      below.push_back(upper);
+    }
+  }
+  // Whatever is left is 1 up to rounding, and keeps itself
+  for (auto *rest : {&below, &above}) {
+    for (uint32_t i : *rest) {
+      gpu.lights[i].aliasProbability = 1.0f;
+      gpu.lights[i].alias = i;
+    }
+  }
+}
+
+bool Scene::addMaterials(const Object &object) {
+  // Add the object's textures to the textures vector if they don't exist
+  for (const auto &texture : object.textures) {
+    auto textureIt = std::find(textures.begin(), textures.end(), texture);
+    if (textureIt == textures.end()) {
+      textures.push_back(texture);
+    }
+  }
+
+  // Add the object's material to the materials vector if it doesn't exist
+  const auto &material = object.material;
+  auto materialIt = std::find(materials.begin(), materials.end(), material);
+  if (materialIt == materials.end()) {
+    materials.push_back(material);
+    return true;
+  }
+  return false;
+}
+
+void Scene::compareBVHBuilds() const {
+  const auto gpuObjects = getGpuObjects();
+  const auto vertices = getVertices();
+
+  static const std::pair<BVH::BuildMode, const char *> modes[] = {
+      {BVH::BuildMode::Serial, "Serial SAH"},
+      {BVH::BuildMode::Parallel, "Parallel SAH"},
+      {BVH::BuildMode::LBVH, "LBVH"},
+      {BVH::BuildMode::SBVH, "SBVH"},
+  };
+
+  std::cout << "BVH builds on " << ThreadPool::global().size()
+            << " threads:\n";
+  float serialTime = 0.0f;
+  for (const auto &[mode, name] : modes) {
+    BVH candidate;
+    candidate.setBuildSettings(bvhSettings);
+    candidate.buildBVH(gpuObjects, vertices, mode);
+    if (mode == BVH::BuildMode::Serial) {
+      serialTime = candidate.getBuildTime();
+    }
+
+    float sahCost = candidate.getSAHCost();
+    auto start = std::chrono::high_resolution_clock::now();
+    candidate.restructureTreelets();
+    auto end = std::chrono::high_resolution_clock::now();
+
+    std::cout << "  " << name << ": " << candidate.getBuildTime() << "ms ("
+              << serialTime / candidate.getBuildTime()
+              << "x serial), SAH cost " << sahCost << " ("
+              << candidate.getSAHCost() << " restructured in "
+              << std::chrono::duration<float, std::milli>(end - start).count()
+              << "ms), " << candidate.getNodes().size() << " nodes, "
+              << candidate.getObjectCount() << " object references\n";
+  }
+
+  // Every binning kernel builds the same tree, only the time differs
+  SimdLevel simdLevel = getSimdLevel();
+  std::cout << "  Serial SAH binning kernels:";
+  for (SimdLevel level : {SimdLevel::Scalar, SimdLevel::SSE, SimdLevel::AVX2}) {
+    if (level > getSupportedSimdLevel()) {
+      break;
+    }
+    setSimdLevel(level);
+    BVH candidate;
+    candidate.setBuildSettings(bvhSettings);
+    candidate.buildBVH(gpuObjects, vertices, BVH::BuildMode::Serial);
+    std::cout << " " << getSimdLevelName(level) << " "
+              << candidate.getBuildTime() << "ms";
+  }
+  setSimdLevel(simdLevel);
+  std::cout << std::endl;
+}
+
+void Scene::compareBVHWidths() const {
+  const auto vertices = getVertices();
+  BVH binary;
+  binary.setBuildSettings(bvhSettings);
+  binary.buildBVH(getGpuObjects(), vertices, bvhBuildMode);
+  const auto objects = binary.getGpuObjects();
+  const auto &nodes = binary.getNodes();
+  if (nodes.empty()) {
+    return;
+  }
+
+  const auto rays =
+      getRandomRays({nodes[0].aabbMin, nodes[0].aabbMax}, 100000);
+
+  auto print = [&](const char *name, size_t numNodes, size_t bytes,
+                   const TraversalStats &stats) {
+    std::cout << "  " << name << ": " << numNodes << " nodes ("
+              << bytes / 1024 << "KB), "
+              << float(stats.nodeVisits) / rays.size() << " node visits, "
+              << float(stats.boxTests) / rays.size() << " box tests, "
+              << float(stats.objectTests) / rays.size()
+              << " object tests per ray\n";
+  };
+
+  std::cout << "BVH widths over " << rays.size() << " random rays:\n";
+  TraversalStats binaryStats;
+  for (const auto &ray : rays) {
+    binary.intersect(ray, objects, vertices, 5000.0f, binaryStats);
+  }
+  print("Binary", nodes.size(), nodes.size() * sizeof(BVHNode), binaryStats);
+
+  for (bool compressed : {false, true}) {
+    for (unsigned int width : {2u, 4u, 8u}) {
+      // Uncompressed width 2 is the binary BVH again
+      if (width == 2 && !compressed) {
+        continue;
+      }
+
+      WideBVH wide;
+      wide.collapse(nodes, {0}, width, compressed);
+      TraversalStats wideStats;
+      for (const auto &ray : rays) {
+        wide.intersect(ray, 0, objects, vertices, 5000.0f, wideStats);
+      }
+      std::string name = "BVH" + std::to_string(width) +
+                         (compressed ? " compressed" : "");
+      print(name.c_str(), wide.getNodeCount(),
+            wide.getData().size() * sizeof(uint32_t), wideStats);
+    }
+  }
+  std::cout << std::flush;
+}
+
+std::vector<GpuObject> Scene::getGpuObjects() const {
   std::vector<GpuObject> gpuObjects;
+
+  // Add the faces into the gpuObjects vector
   for (auto &face : getFaces()) {
-    gpuObjects.push_back({{face.v0, face.v1, face.v2, 0.0f},
+    gpuObjects.push_back({{face.v0, face.v1, face.v2, 0},
                           ObjectType::Face,
                           face.materialIdx,
                           face.textureIndices});
   }
 
   // Add the spheres into the gpuObjects vector
+  auto sphereObjects = getSphereObjects();
+  gpuObjects.insert(gpuObjects.end(), sphereObjects.begin(),
+                    sphereObjects.end());
+
+  return gpuObjects;
+}
+
+std::vector<GpuObject> Scene::getSphereObjects() const {
+  std::vector<GpuObject> gpuObjects;
+
   for (auto &sphere : spheres) {
-    // Find the sphere's material index, add to the materials vector if it
-    // doesn't exist
+    // Find the sphere's material index
     const auto &material = sphere.material;
-    unsigned int materialIdx = 0;
     auto materialIt = std::find(materials.begin(), materials.end(), material);
-    if (materialIt == materials.end()) {
-      materialIdx = materials.size();
-      materials.push_back(material);
-    } else {
-      materialIdx = std::distance(materials.begin(), materialIt);
+    unsigned int materialIdx = std::distance(materials.begin(), materialIt);
+
+    glm::vec4 centerRadius(sphere.center, sphere.radius);
+    gpuObjects.push_back({glm::floatBitsToUint(centerRadius),
+                          ObjectType::Sphere,
+                          materialIdx,
+                          {-1, -1}});
+  }
+
+  return gpuObjects;
+}
+
+void Scene::compareBVHLayouts() const {
+  const auto vertices = getVertices();
+  BVH built;
+  built.setBuildSettings(bvhSettings);
+  built.buildBVH(getGpuObjects(), vertices, bvhBuildMode);
+  if (restructureBvh) {
+    built.restructureTreelets();
+  }
+  const auto &objects = built.getGpuObjects();
+  const BVHNode &root = built.getNodes()[0];
+  const auto rays = getRandomRays({root.aabbMin, root.aabbMax}, 200000);
+
+  static const std::pair<BVH::NodeLayout, const char *> layouts[] = {
+      {BVH::NodeLayout::BuildOrder, "Build order"},
+      {BVH::NodeLayout::BreadthFirst, "Breadth first"},
+      {BVH::NodeLayout::DepthFirst, "Depth first"},
+      {BVH::NodeLayout::VanEmdeBoas, "van Emde Boas"},
+  };
+
+  ThreadPool &pool = ThreadPool::global();
+  std::cout << "BVH node layouts over " << rays.size()
+            << " random rays on " << pool.size() << " threads, "
+            << built.getNodes().size() * sizeof(BVHNode) / 1024
+            << "KB of nodes:\n";
+  for (const auto &[layout, name] : layouts) {
+    BVH candidate = built;
+    candidate.reorderNodes(layout);
+    const auto &nodes = candidate.getNodes();
+
+    // How far each parent is from its children, the traversal reads them
+    // right after each other
+    size_t sameLine = 0;
+    size_t samePage = 0;
+    size_t numInner = 0;
+    for (size_t i = 0; i < nodes.size(); i++) {
+      if (nodes[i].numObjects != 0) {
+        continue;
+      }
+      numInner++;
+      size_t parent = i * sizeof(BVHNode);
+      size_t children = nodes[i].leftFirst * sizeof(BVHNode);
+      sameLine += parent / 64 == children / 64;
+      samePage += parent / 4096 == children / 4096;
     }
 
-    gpuObjects.push_back(
-        {{sphere.center.x, sphere.center.y, sphere.center.z, sphere.radius},
-         ObjectType::Sphere,
-         materialIdx,
-         {-1, -1}});
+    // Best of a few runs, the first one also warms the caches
+    float bestTime = INFINITY;
+    for (int run = 0; run < 5; run++) {
+      auto start = std::chrono::high_resolution_clock::now();
+      pool.parallelFor(rays.size(), 256,
+                       [&](unsigned int begin, unsigned int end) {
+                         TraversalStats stats;
+                         for (unsigned int i = begin; i < end; i++) {
+                           candidate.intersect(rays[i], objects, vertices,
+                                               5000.0f, stats);
+                         }
+                       });
+      auto end = std::chrono::high_resolution_clock::now();
+      float time =
+          std::chrono::duration<float, std::milli>(end - start).count();
+      bestTime = std::min(bestTime, time);
+    }
+
+    std::cout << "  " << name << ": " << bestTime << "ms ("
+              << rays.size() / (bestTime * 1000.0f) << " Mrays/s), children "
+              << 100.0f * sameLine / numInner
+              << "% in the parent's cache line, "
+              << 100.0f * samePage / numInner << "% in its page\n";
   }
+  std::cout << std::flush;
+}
 
-  // Time how long it takes to build the BVH
-  auto start = SDL_GetTicks();
-  bvh.buildBVH(gpuObjects, getVertices());
-  auto end = SDL_GetTicks();
-  std::cout << "BVH build time: " << end - start << "ms" << std::endl;
+void Scene::compareRayQueries(const std::vector<std::string> &modelFiles) {
+  constexpr unsigned int IMAGE_SIZE = 1024;
+  const SimdLevel levels[] = {SimdLevel::Scalar, SimdLevel::SSE,
+                              SimdLevel::AVX2};
+  SimdLevel oldLevel = getSimdLevel();
+
+  std::cout << "Ray queries on " << ThreadPool::global().size()
+            << " threads, in Mrays/s:\n";
+  for (const auto &file : modelFiles) {
+    Mesh mesh;
+    std::vector<Texture> textures; // Never loaded, the BVH does not need them
+    try {
+      ObjLoader::loadMesh(file, mesh, textures);
+    } catch (const std::exception &e) {
+      std::cerr << file << ": " << e.what() << std::endl;
+      continue;
+    }
+
+    std::vector<Vertex> vertices;
+    for (const auto &vertex : mesh.vertices) {
+      vertices.push_back({vertex.position, vertex.uv});
+    }
+    BVH bvh;
+    bvh.buildBVH(getMeshObjects(mesh, 0), vertices);
+    const BVHNode &root = bvh.getNodes()[0];
+    AABB bounds{root.aabbMin, root.aabbMax};
+
+    const std::pair<const char *, std::vector<Ray>> rayKinds[] = {
+        {"camera", getCameraRays(bounds, IMAGE_SIZE)},
+        {"random", getRandomRays(bounds, IMAGE_SIZE * IMAGE_SIZE)},
+    };
+
+    std::cout << file << ", " << mesh.indices.size() / 3 << " triangles:\n";
+    for (const auto &[kind, rays] : rayKinds) {
+      std::vector<RayQuery> queries;
+      for (const auto &ray : rays) {
+        queries.push_back({ray});
+      }
+
+      for (bool anyHit : {false, true}) {
+        std::cout << "  " << kind << (anyHit ? " any hit:" : " closest hit:");
+        size_t numHits = 0;
+        for (SimdLevel level : levels) {
+          if (level > getSupportedSimdLevel()) {
+            continue;
+          }
+          setSimdLevel(level);
+
+          // Best of a few runs, the first one also warms the caches
+          float bestTime = INFINITY;
+          for (int run = 0; run < 3; run++) {
+            auto start = std::chrono::high_resolution_clock::now();
+            auto hits = anyHit ? bvh.intersectAny(queries, vertices)
+                               : bvh.intersect(queries, vertices);
+            auto end = std::chrono::high_resolution_clock::now();
+            bestTime = std::min(
+                bestTime,
+                std::chrono::duration<float, std::milli>(end - start).count());
+            numHits = std::count_if(hits.begin(), hits.end(),
+                                    [](const RayHit &hit) { return hit.hit(); });
+          }
+          std::cout << " " << getSimdLevelName(level) << " "
+                    << queries.size() / (bestTime * 1000.0f);
+        }
+        std::cout << " (" << 100.0f * numHits / queries.size() << "% hit)\n";
+      }
+    }
+  }
+  setSimdLevel(oldLevel);
+  std::cout << std::flush;
+}
+
+std::vector<Ray> Scene::getCameraRays(const AABB &bounds, unsigned int size) {
+  // Far enough away that the bounding sphere fills the view
+  glm::vec3 center = (bounds.min + bounds.max) * 0.5f;
+  float radius = glm::length(bounds.max - bounds.min) * 0.5f;
+  glm::vec3 w = glm::normalize(glm::vec3(-1.0f, -0.5f, -1.0f));
+  glm::vec3 origin = center - w * radius * 2.0f;
+  glm::vec3 u = glm::normalize(glm::cross(w, glm::vec3(0.0f, 1.0f, 0.0f)));
+  glm::vec3 v = glm::cross(u, w);
+  float halfWidth = std::tan(std::asin(0.5f));
+
+  std::vector<Ray> rays;
+  rays.reserve(size * size);
+  for (unsigned int blockY = 0; blockY < size; blockY += 2) {
+    for (unsigned int blockX = 0; blockX < size; blockX += 4) {
+      for (unsigned int y = blockY; y < blockY + 2; y++) {
+        for (unsigned int x = blockX; x < blockX + 4; x++) {
+          float s = ((x + 0.5f) / size * 2.0f - 1.0f) * halfWidth;
+          float t = ((y + 0.5f) / size * 2.0f - 1.0f) * halfWidth;
+          rays.push_back({origin, glm::normalize(w + s * u + t * v)});
+        }
+      }
+    }
+  }
+  return rays;
+}
+
+std::vector<Ray> Scene::getRandomRays(const AABB &bounds, size_t count) {
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+  std::vector<Ray> rays(count);
+  for (auto &ray : rays) {
+    glm::vec3 t(uniform(rng), uniform(rng), uniform(rng));
+    ray.origin = glm::mix(bounds.min, bounds.max, t);
+    ray.direction = glm::normalize(glm::vec3(
+        uniform(rng) - 0.5f, uniform(rng) - 0.5f, uniform(rng) - 0.5f));
+  }
+  return rays;
+}
+
+std::vector<GpuObject> Scene::getMeshObjects(const Mesh &mesh,
+                                             unsigned int vertexOffset) {
+  std::vector<GpuObject> faces;
+  const auto &indices = mesh.indices;
+  for (size_t i = 0; i < indices.size(); i += 3) {
+    faces.push_back({{indices[i] + vertexOffset, indices[i + 1] + vertexOffset,
+                      indices[i + 2] + vertexOffset, 0},
+                     ObjectType::Face,
+                     0,
+                     {-1, -1}});
+  }
+  return faces;
 }
 
 std::vector<Vertex> Scene::getVertices() const {
@@ -99,20 +952,7 @@ std::vector<Face> Scene::getFaces() const {
     uint32_t materialIdx = std::distance(materials.begin(), materialIt);
 
     // Find the objects texture index
-    glm::ivec2 textureIndices = {-1, -1};
-    for (auto &texture : object.textures) {
-      auto textureIt = std::find(textures.begin(), textures.end(), texture);
-      if (textureIt == textures.end()) {
-        std::cerr << "Texture not found in scene" << std::endl;
-        continue;
-      }
-      uint32_t textureIdx = std::distance(textures.begin(), textureIt);
-      if (texture.type == Texture::TextureType::DIFFUSE) {
-        textureIndices.x = textureIdx;
-      } else if (texture.type == Texture::TextureType::NORMAL) {
-        textureIndices.y = textureIdx;
-      }
-    }
+    glm::ivec2 textureIndices = getTextureIndices(object);
 
     const auto &indices = object.mesh.indices;
     for (size_t i = 0; i < indices.size(); i += 3) {
@@ -127,3 +967,128 @@ std::vector<Face> Scene::getFaces() const {
 
   return faces;
 }
+
+glm::ivec2 Scene::getTextureIndices(const Object &object) const {
+  glm::ivec2 textureIndices = {-1, -1};
+  for (auto &texture : object.textures) {
+    auto textureIt = std::find(textures.begin(), textures.end(), texture);
+    if (textureIt == textures.end()) {
+      std::cerr << "Texture not found in scene" << std::endl;
+      continue;
+    }
+    uint32_t textureIdx = std::distance(textures.begin(), textureIt);
+    if (texture.type == Texture::TextureType::DIFFUSE) {
+      textureIndices.x = textureIdx;
+    } else if (texture.type == Texture::TextureType::NORMAL) {
+      textureIndices.y = textureIdx;
+    }
+  }
+  return textureIndices;
+}
+
+void Scene::initCornellBox() {
+  Material white = Material::lambertian(glm::vec3(0.73f));
+  Material red = Material::lambertian(glm::vec3(0.65f, 0.05f, 0.05f));
+  Material green = Material::lambertian(glm::vec3(0.12f, 0.45f, 0.15f));
+
+  Mesh quadMesh;
+  quadMesh.vertices = {
+      {{-0.5f, -0.5f, 0.0f}},
+      {{0.5f, -0.5f, 0.0f}},
+      {{0.5f, 0.5f, 0.0f}},
+      {{-0.5f, 0.5f, 0.0f}},
+  };
+  quadMesh.indices = {0, 1, 2, 0, 2, 3};
+
+  Object quadObj(quadMesh, white);
+
+  // Floor
+  quadObj.transform.setPosition(277.5f, 0.0f, -277.5f);
+  quadObj.transform.setRotation(-90.0f, 0.0f, 0.0f);
+  quadObj.transform.setScale(555.0f, 555.0f, 1.0f);
+  objects.push_back(quadObj);
+
+  // Ceiling
+  quadObj.transform.setPosition(277.5f, 555.0f, -277.5f);
+  quadObj.transform.setRotation(90.0f, 0.0f, 0.0f);
+  objects.push_back(quadObj);
+
+  // Back wall
+  quadObj.transform.setPosition(277.5f, 277.5f, -555.0f);
+  quadObj.transform.setRotation(0.0f, 0.0f, 0.0f);
+  objects.push_back(quadObj);
+
+  // Left wall
+  quadObj.material = red;
+  quadObj.transform.setPosition(0.0f, 277.5f, -277.5f);
+  quadObj.transform.setRotation(0.0f, 90.0f, 0.0f);
+  objects.push_back(quadObj);
+
+  // Right wall
+  quadObj.material = green;
+  quadObj.transform.setPosition(555.0f, 277.5f, -277.5f);
+  quadObj.transform.setRotation(0.0f, -90.0f, 0.0f);
+  objects.push_back(quadObj);
+
+  // Light
+  quadObj.material = Material::light();
+  quadObj.transform.setPosition(277.5f, 554.0f, -277.5f);
+  quadObj.transform.setRotation(90.0f, 0.0f, 0.0f);
+  quadObj.transform.setScale(130.0f, 105.0f, 1.0f);
+  objects.push_back(quadObj);
+
+  Mesh cubeMesh;
+  cubeMesh.vertices = {
+      // front
+      {{-0.5f, -0.5f, 0.5f}},
+      {{0.5f, -0.5f, 0.5f}},
+      {{0.5f, 0.5f, 0.5f}},
+      {{-0.5f, 0.5f, 0.5f}},
+      // back
+      {{-0.5f, -0.5f, -0.5f}},
+      {{0.5f, -0.5f, -0.5f}},
+      {{0.5f, 0.5f, -0.5f}},
+      {{-0.5f, 0.5f, -0.5f}},
+  };
+  cubeMesh.indices = {
+      0, 1, 2, 0, 2, 3, // front
+      1, 5, 6, 1, 6, 2, // right
+      5, 4, 7, 5, 7, 6, // back
+      4, 0, 3, 4, 3, 7, // left
+      3, 2, 6, 3, 6, 7, // top
+      4, 5, 1, 4, 1, 0, // bottom
+  };
+
+  Object cubeObj(cubeMesh, white);
+
+  // Short block
+  cubeObj.transform.setPosition(369.5f, 82.5f, -169.0f);
+  cubeObj.transform.setRotation(0.0f, -18.0f, 0.0f);
+  cubeObj.transform.setScale(165.0f, 165.0f, 165.0f);
+  objects.push_back(cubeObj);
+
+  // Tall block
+  cubeObj.transform.setPosition(186.5f, 165.0f, -351.25f);
+  cubeObj.transform.setRotation(0.0f, 15.0f, 0.0f);
+  cubeObj.transform.setScale(165.0f, 330.0f, 165.0f);
+  objects.push_back(cubeObj);
+}
+
+void Scene::initObjects() {
+  // Add some spheres
+  // spheres.push_back(
+  //     {{369.5f, 250.0f, -169.0f}, 80.0f, Material::dielectric()});
+  spheres.push_back({{186.5f, 420.0f, -351.25f}, 90.0f, Material::metal()});
+
+  Object &bunny =
+      objects.emplace_back("res/models/bunny/bunny_centered_fixed.obj");
+  bunny.transform.setPosition(369.5f, 215.0f, -169.0f);
+  bunny.transform.setScale(100.0f, 100.0f, 100.0f);
+
+  // Textured cube
+  // Object &texturedCube =
+  //     objects.emplace_back("res/models/textured_cube/cube.obj");
+  // texturedCube.transform.setPosition(369.5f, 250.0f, -200.0f);
+  // texturedCube.transform.setScale(50.0f, 50.0f, 50.0f);
+  // texturedCube.transform.setRotation(45.0f, 45.0f, 0.0f);
+}
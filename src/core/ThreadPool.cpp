@@ -0,0 +1,117 @@
+#include "core/ThreadPool.hpp"
+
+#include <chrono>
+
+namespace {
+// Which pool the current thread works for and its queue in that pool
+thread_local const ThreadPool *t_pool = nullptr;
+thread_local unsigned int t_queueIndex = 0;
+} // namespace
+
+ThreadPool::ThreadPool(unsigned int numThreads) {
+  // The thread that waits also runs tasks, so it counts as one of them
+  unsigned int numWorkers = std::max(1u, numThreads) - 1;
+
+  for (unsigned int i = 0; i < numWorkers + 1; i++) {
+    _queues.push_back(std::make_unique<Queue>());
+  }
+  for (unsigned int i = 0; i < numWorkers; i++) {
+    _threads.emplace_back(&ThreadPool::workerLoop, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(_sleepMutex);
+    _stop = true;
+  }
+  _sleepCondition.notify_all();
+  for (auto &thread : _threads) {
+    thread.join();
+  }
+}
+
+ThreadPool &ThreadPool::global() {
+  static ThreadPool pool;
+  return pool;
+}
+
+unsigned int ThreadPool::queueIndex() const {
+  // Outside threads share the last queue
+  return t_pool == this ? t_queueIndex : _threads.size();
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+  Queue &queue = *_queues[queueIndex()];
+  _pending++;
+  {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.tasks.push_back(std::move(task));
+    _queued++;
+  }
+
+  // Take the lock so a worker about to sleep cannot miss the wake up
+  { std::lock_guard<std::mutex> lock(_sleepMutex); }
+  _sleepCondition.notify_one();
+}
+
+bool ThreadPool::popTask(unsigned int index, std::function<void()> &task) {
+  // Newest task from our own queue first, it is most likely still in cache
+  {
+    Queue &queue = *_queues[index];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.tasks.empty()) {
+      task = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+      _queued--;
+      return true;
+    }
+  }
+
+  // Otherwise steal the oldest (usually largest) task of another queue
+  for (unsigned int i = 1; i < _queues.size(); i++) {
+    Queue &queue = *_queues[(index + i) % _queues.size()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.tasks.empty()) {
+      task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+      _queued--;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool ThreadPool::runPendingTask() {
+  std::function<void()> task;
+  if (!popTask(queueIndex(), task)) {
+    return false;
+  }
+  task();
+  _pending--;
+  return true;
+}
+
+void ThreadPool::wait() {
+  while (_pending > 0) {
+    if (!runPendingTask()) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+void ThreadPool::workerLoop(unsigned int index) {
+  t_pool = this;
+  t_queueIndex = index;
+
+  while (!_stop) {
+    if (runPendingTask()) {
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(_sleepMutex);
+    _sleepCondition.wait_for(lock, std::chrono::milliseconds(10),
+                             [this] { return _stop || _queued > 0; });
+  }
+}
@@ -1,13 +1,76 @@
+#include <chrono>
 #include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 #include "core/Error.hpp"
 #include "core/SDLGraphicsProgram.hpp"
+#include "core/ThreadPool.hpp"
 
+#include "rendering/CpuRenderer.hpp"
 #include "rendering/Renderer.hpp"
 #include "rendering/Window.hpp"
 
+// Renders the scene on the CPU and saves it, without a window or GPU:
+//   project --headless [output.ppm] [samples per pixel]
+int renderHeadless(int argc, char *args[]) {
+  std::string output = argc > 2 ? args[2] : "render.ppm";
+  unsigned int samplesPerPixel = 64;
+  try {
+    if (argc > 3) {
+      samplesPerPixel = std::stoul(args[3]);
+    }
+  } catch (const std::exception &) {
+    std::cerr << "Invalid sample count: " << args[3] << std::endl;
+    return 1;
+  }
+
+  Scene scene;
+  scene.initCornellBox();
+  scene.initObjects();
+  scene.update();
+
+  CpuRenderer renderer(1600, 900);
+  renderer.getCamera().setPosition(Scene::CORNELL_BOX_CAMERA);
+
+  auto start = std::chrono::high_resolution_clock::now();
+  renderer.render(scene, samplesPerPixel);
+  auto end = std::chrono::high_resolution_clock::now();
+  std::cout << "Rendered " << samplesPerPixel << " samples per pixel on "
+            << ThreadPool::global().size() << " threads in "
+            << std::chrono::duration<float, std::milli>(end - start).count()
+            << "ms" << std::endl;
+
+  try {
+    renderer.savePPM(output);
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  std::cout << "Saved " << output << std::endl;
+  return 0;
+}
+
 int main(int argc, char *args[])
 {
+  if (argc > 1 && std::string(args[1]) == "--headless") {
+    return renderHeadless(argc, args);
+  }
+  // Measures the CPU ray queries:
+  //   project --benchmark-rays [model.obj ...]
+  if (argc > 1 && std::string(args[1]) == "--benchmark-rays") {
+    std::vector<std::string> modelFiles(args + 2, args + argc);
+    if (modelFiles.empty()) {
+      modelFiles = {"res/models/bunny/bunny_centered_fixed.obj",
+                    "res/models/lion/lion_centered_triangulated.obj",
+                    "res/models/capsule/capsule.obj",
+                    "res/models/Tree/HandpaintedTree.obj"};
+    }
+    Scene::compareRayQueries(modelFiles);
+    return 0;
+  }
+
   /*std::cout << "Player controls:\n"
             << "  WASD - Move\n"
             << "  Space - Move up\n"
@@ -1,75 +1,796 @@
 #include "rendering/BVH.hpp"
 
 #include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <glm/gtc/constants.hpp>
 #include <iostream>
+#include <queue>
+#include <random>
+
+#include "core/MappedFile.hpp"
 
 void BVH::buildBVH(const std::vector<GpuObject> &gpuObjects,
-                   const std::vector<Vertex> &vertices) {
-  // Convert GpuObjects to BVHObjects
-  _objects.resize(gpuObjects.size());
-  for (int i = 0; i < gpuObjects.size(); i++) {
-    const auto &gpuObject = gpuObjects[i];
-    _objects[i] = {gpuObject.data,
-                   gpuObject.type,
-                   gpuObject.materialIdx,
-                   gpuObject.textureIndices,
-                   getAABB(gpuObject, vertices),
-                   getCentroid(gpuObject, vertices)};
-  }
-
-  auto size = _objects.size();
-  _nodes.resize(size * 2 - 1);
+                   const std::vector<Vertex> &vertices, BuildMode mode) {
+  auto start = std::chrono::high_resolution_clock::now();
+
+  _arena.resize(gpuObjects.size());
+  auto convert = [&](unsigned int begin, unsigned int end) {
+    for (unsigned int i = begin; i < end; i++) {
+      _arena.set(i, getAABB(gpuObjects[i], vertices),
+                 getCentroid(gpuObjects[i], vertices));
+      _arena.types[i] = gpuObjects[i].type;
+      _arena.indices[i] = i;
+    }
+  };
+  if (mode != BuildMode::Serial) {
+    ThreadPool::global().parallelFor(gpuObjects.size(),
+                                     PARALLEL_TASK_THRESHOLD, convert);
+  } else {
+    convert(0, gpuObjects.size());
+  }
+
+  build(gpuObjects, vertices, mode);
+  _buildTime = std::chrono::duration<float, std::milli>(
+                   std::chrono::high_resolution_clock::now() - start)
+                   .count();
+}
+
+void BVH::buildBVH(const std::vector<AABB> &bounds, BuildMode mode) {
+  auto start = std::chrono::high_resolution_clock::now();
+
+  // Each object is just a box, data.x says which one
+  std::vector<GpuObject> boxes(bounds.size());
+  _arena.resize(bounds.size());
+  for (unsigned int i = 0; i < bounds.size(); i++) {
+    boxes[i] = {glm::uvec4(i, 0, 0, 0), ObjectType::Box, 0, {-1, -1}};
+    _arena.set(i, bounds[i], (bounds[i].min + bounds[i].max) * 0.5f);
+    _arena.types[i] = ObjectType::Box;
+    _arena.indices[i] = i;
+  }
+
+  build(boxes, {}, mode);
+  _buildTime = std::chrono::duration<float, std::milli>(
+                   std::chrono::high_resolution_clock::now() - start)
+                   .count();
+}
+
+void BVH::build(const std::vector<GpuObject> &gpuObjects,
+                const std::vector<Vertex> &vertices, BuildMode mode) {
+  ThreadPool &pool = ThreadPool::global();
+
+  // A tree over N objects has at most 2N - 1 nodes. Shrinking afterwards
+  // keeps the capacity, so rebuilds reuse the same memory
+  auto size = gpuObjects.size();
+  _nodes.assign(size * 2 - 1, BVHNode{});
 
   BVHNode &root = _nodes[0];
   root.leftFirst = 0;
   root.numObjects = size;
 
   updateNodeBounds(0, vertices);
-  subdivide(0, vertices);
+  if (mode == BuildMode::SBVH) {
+    buildSBVH(gpuObjects, vertices);
+  } else if (mode == BuildMode::LBVH) {
+    buildLBVH(vertices, pool);
+  } else if (mode == BuildMode::Parallel) {
+    std::atomic<unsigned int> nodesUsed{1};
+    subdivideParallel(0, vertices, nodesUsed, pool);
+    pool.wait();
+    _nodesUsed = nodesUsed;
+  } else {
+    _nodesUsed = 1;
+    subdivide(0, vertices);
+  }
   _nodes.resize(_nodesUsed);
+
+  // The builders only moved indices, the objects move once here. SBVH
+  // already wrote its references out in leaf order
+  if (mode != BuildMode::SBVH) {
+    _objects.resize(size);
+    pool.parallelFor(size, PARALLEL_TASK_THRESHOLD,
+                     [&](unsigned int begin, unsigned int end) {
+                       for (unsigned int i = begin; i < end; i++) {
+                         _objects[i] = gpuObjects[_arena.indices[i]];
+                       }
+                     });
+  }
+
+  _buildMode = mode;
+  _parents.clear();
+  _objectLeaves.clear();
+  _freeObjects.clear();
 }
 
-void BVH::updateNodeBounds(unsigned int nodeIndex,
-                           const std::vector<Vertex> &vertices) {
-  BVHNode &node = _nodes[nodeIndex];
-  for (int i = node.leftFirst; i < node.leftFirst + node.numObjects; i++) {
-    AABB aabb = _objects[i].aabb;
-    node.aabbMin = glm::min(node.aabbMin, aabb.min);
-    node.aabbMax = glm::max(node.aabbMax, aabb.max);
+IndexRange BVH::refit(const std::vector<Vertex> &vertices) {
+  // SBVH references lose their clipping here, their bounds grow back to the
+  // whole object which is looser but still correct. Boxes have no vertices
+  // to follow and keep the bounds they were built with
+  ThreadPool::global().parallelFor(
+      _objects.size(), PARALLEL_TASK_THRESHOLD,
+      [&](unsigned int begin, unsigned int end) {
+        for (unsigned int i = begin; i < end; i++) {
+          const auto &object = _objects[i];
+          if (object.type == ObjectType::Box) {
+            continue;
+          }
+          _arena.setBounds(_arena.indices[i], getAABB(object, vertices));
+        }
+      });
+
+  IndexRange changed;
+  auto refitChanged = [&](unsigned int nodeIndex) {
+    BVHNode oldNode = _nodes[nodeIndex];
+    refitNode(nodeIndex, vertices);
+    if (_nodes[nodeIndex].aabbMin != oldNode.aabbMin ||
+        _nodes[nodeIndex].aabbMax != oldNode.aabbMax) {
+      changed.extend(nodeIndex);
+    }
+  };
+
+  // Every builder places children after their parent, so walking backwards
+  // refits bottom up. Edits move nodes anywhere, then walk the tree instead
+  if (_parents.empty()) {
+    for (int i = _nodesUsed - 1; i >= 0; i--) {
+      refitChanged(i);
+    }
+    return changed;
   }
+
+  auto refitSubtree = [&](auto &self, unsigned int nodeIndex) -> void {
+    const BVHNode &node = _nodes[nodeIndex];
+    if (node.numObjects == 0) {
+      self(self, node.leftFirst);
+      self(self, node.leftFirst + 1);
+    }
+    refitChanged(nodeIndex);
+  };
+  refitSubtree(refitSubtree, 0);
+  return changed;
 }
 
-void BVH::subdivide(unsigned int nodeIndex,
-                    const std::vector<Vertex> &vertices) {
-  BVHNode &node = _nodes.at(nodeIndex);
+void BVH::restructureTreelets() {
+  if (_nodes.empty()) {
+    return;
+  }
 
-  if (node.numObjects <= MIN_OBJECTS) {
+  std::vector<float> costs(_nodes.size(), 0.0f);
+  restructureSubtree(0, 0, costs, ThreadPool::global());
+  // The pairs stay where they were, but children can now come before
+  // their parents
+  reorderNodes(NodeLayout::BreadthFirst);
+}
+
+void BVH::restructureSubtree(unsigned int nodeIndex, unsigned int depth,
+                             std::vector<float> &costs, ThreadPool &pool) {
+  const BVHNode &node = _nodes[nodeIndex];
+  float area = AABB{node.aabbMin, node.aabbMax}.surfaceArea();
+  if (node.numObjects != 0) {
+    costs[nodeIndex] = area * node.numObjects * _settings.intersectionCost;
     return;
   }
 
-  // Find best split axis and position
-  int splitAxis = 0;
-  float splitPos = 0.0f;
-  float bestCost = findBestSplit(node, splitAxis, splitPos, vertices);
+  // Treelets only reach down into their own subtree, so siblings never
+  // touch the same nodes
+  unsigned int left = node.leftFirst;
+  if (depth < PARALLEL_TREELET_DEPTH) {
+    pool.parallelFor(2, 1, [&](unsigned int begin, unsigned int end) {
+      for (unsigned int i = begin; i < end; i++) {
+        restructureSubtree(left + i, depth + 1, costs, pool);
+      }
+    });
+  } else {
+    restructureSubtree(left, depth + 1, costs, pool);
+    restructureSubtree(left + 1, depth + 1, costs, pool);
+  }
 
-  // Check if subdivision is worth it
-  AABB nodeAABB{node.aabbMin, node.aabbMax};
-  float nodeArea = nodeAABB.surfaceArea();
-  if (bestCost >= node.numObjects * nodeArea) {
+  costs[nodeIndex] =
+      area * _settings.traversalCost + costs[left] + costs[left + 1];
+  restructureTreelet(nodeIndex, costs);
+}
+
+void BVH::restructureTreelet(unsigned int rootIndex,
+                             std::vector<float> &costs) {
+  // Grow the treelet by opening its largest inner subtree, those matter the
+  // most to the cost
+  unsigned int leaves[TREELET_LEAVES];
+  unsigned int pairs[TREELET_LEAVES - 1]; // First of each sibling pair
+  unsigned int numLeaves = 2;
+  unsigned int numPairs = 1;
+  leaves[0] = _nodes[rootIndex].leftFirst;
+  leaves[1] = _nodes[rootIndex].leftFirst + 1;
+  pairs[0] = _nodes[rootIndex].leftFirst;
+  while (numLeaves < TREELET_LEAVES) {
+    int largest = -1;
+    float largestArea = -1.0f;
+    for (unsigned int i = 0; i < numLeaves; i++) {
+      const BVHNode &leaf = _nodes[leaves[i]];
+      float area = AABB{leaf.aabbMin, leaf.aabbMax}.surfaceArea();
+      if (leaf.numObjects == 0 && area > largestArea) {
+        largest = i;
+        largestArea = area;
+      }
+    }
+    if (largest == -1) {
+      break;
+    }
+
+    unsigned int first = _nodes[leaves[largest]].leftFirst;
+    leaves[largest] = first;
+    leaves[numLeaves++] = first + 1;
+    pairs[numPairs++] = first;
+  }
+  if (numLeaves < 3) {
     return;
   }
 
-  // Partition objects
-  int i = node.leftFirst;
-  int j = i + node.numObjects - 1;
-  while (i <= j) {
-    if (_objects[i].centroid[splitAxis] < splitPos) {
-      i++;
+  // Best cost of every subset of the leaves, each built from the best split
+  // of it into two. Subsets are bit masks, so all of a subset's parts come
+  // before it
+  constexpr unsigned int NUM_SUBSETS = 1 << TREELET_LEAVES;
+  AABB bounds[NUM_SUBSETS];
+  float subsetCosts[NUM_SUBSETS];
+  unsigned int splits[NUM_SUBSETS];
+  unsigned int fullSet = (1 << numLeaves) - 1;
+  for (unsigned int subset = 1; subset <= fullSet; subset++) {
+    unsigned int lowest = subset & (~subset + 1);
+    if (subset == lowest) {
+      unsigned int leaf = __builtin_ctz(subset);
+      const BVHNode &node = _nodes[leaves[leaf]];
+      bounds[subset] = {node.aabbMin, node.aabbMax};
+      subsetCosts[subset] = costs[leaves[leaf]];
+      continue;
+    }
+
+    bounds[subset] = bounds[lowest];
+    bounds[subset].extend(bounds[subset ^ lowest]);
+
+    // Only splits holding the lowest leaf on one side, the rest are mirrors
+    float bestCost = INFINITY;
+    unsigned int rest = subset ^ lowest;
+    for (unsigned int part = (rest - 1) & rest;; part = (part - 1) & rest) {
+      unsigned int side = part | lowest;
+      float cost = subsetCosts[side] + subsetCosts[subset ^ side];
+      if (cost < bestCost) {
+        bestCost = cost;
+        splits[subset] = side;
+      }
+      if (part == 0) {
+        break;
+      }
+    }
+    subsetCosts[subset] =
+        bounds[subset].surfaceArea() * _settings.traversalCost + bestCost;
+  }
+
+  // Keep the current shape unless the new one is clearly better
+  if (subsetCosts[fullSet] >= costs[rootIndex] * 0.999f) {
+    return;
+  }
+  costs[rootIndex] = subsetCosts[fullSet];
+
+  // The new shape has as many inner nodes as the old one, so it reuses the
+  // same sibling pairs. The subtrees under the treelet stay where they are
+  BVHNode leafNodes[TREELET_LEAVES];
+  float leafCosts[TREELET_LEAVES];
+  for (unsigned int i = 0; i < numLeaves; i++) {
+    leafNodes[i] = _nodes[leaves[i]];
+    leafCosts[i] = costs[leaves[i]];
+  }
+
+  unsigned int pairsUsed = 0;
+  auto place = [&](auto &self, unsigned int subset,
+                   unsigned int nodeIndex) -> void {
+    BVHNode &node = _nodes[nodeIndex];
+    if ((subset & (subset - 1)) == 0) {
+      unsigned int leaf = __builtin_ctz(subset);
+      node = leafNodes[leaf];
+      costs[nodeIndex] = leafCosts[leaf];
+      return;
+    }
+
+    unsigned int pair = pairs[pairsUsed++];
+    node.aabbMin = bounds[subset].min;
+    node.aabbMax = bounds[subset].max;
+    node.leftFirst = pair;
+    node.numObjects = 0;
+    costs[nodeIndex] = subsetCosts[subset];
+    self(self, splits[subset], pair);
+    self(self, subset ^ splits[subset], pair + 1);
+  };
+  place(place, fullSet, rootIndex);
+}
+
+void BVH::reorderNodes(NodeLayout layout) {
+  if (layout == NodeLayout::BuildOrder || _nodes.empty() ||
+      _nodes[0].numObjects != 0) {
+    return;
+  }
+
+  // Sibling pairs move as one, so lay out the tree of pairs, named by their
+  // first node. The root stays alone at 0, which puts every pair's second
+  // node in the same cache line as the first node of the pair after it. So
+  // the second node's children go first, where they can follow right away
+  auto forChildPairs = [&](uint32_t pair, auto &&function) {
+    for (uint32_t i = pair + 2; i-- > pair;) {
+      if (_nodes[i].numObjects == 0) {
+        function(_nodes[i].leftFirst);
+      }
+    }
+  };
+  std::vector<uint32_t> pairs; // In their new order
+  pairs.reserve(_nodesUsed / 2);
+  uint32_t rootPair = _nodes[0].leftFirst;
+
+  if (layout == NodeLayout::BreadthFirst) {
+    pairs.push_back(rootPair);
+    for (size_t i = 0; i < pairs.size(); i++) {
+      forChildPairs(pairs[i], [&](uint32_t child) { pairs.push_back(child); });
+    }
+  } else if (layout == NodeLayout::DepthFirst) {
+    std::vector<uint32_t> stack = {rootPair};
+    while (!stack.empty()) {
+      uint32_t pair = stack.back();
+      stack.pop_back();
+      pairs.push_back(pair);
+      // Pushed backwards so the second node's child pair comes right after
+      uint32_t children[2];
+      unsigned int numChildren = 0;
+      forChildPairs(pair, [&](uint32_t child) {
+        children[numChildren++] = child;
+      });
+      while (numChildren > 0) {
+        stack.push_back(children[--numChildren]);
+      }
+    }
+  } else {
+    // Levels of pairs, deepest path first
+    unsigned int height = 0;
+    std::vector<uint32_t> level = {rootPair};
+    std::vector<uint32_t> next;
+    while (!level.empty()) {
+      height++;
+      next.clear();
+      for (uint32_t pair : level) {
+        forChildPairs(pair, [&](uint32_t child) { next.push_back(child); });
+      }
+      std::swap(level, next);
+    }
+
+    auto place = [&](auto &self, uint32_t root, unsigned int height) -> void {
+      if (height == 1) {
+        pairs.push_back(root);
+        return;
+      }
+      unsigned int top = height / 2;
+      self(self, root, top);
+
+      // The bottom subtrees hang off the pairs just below the top
+      std::vector<uint32_t> level = {root};
+      std::vector<uint32_t> next;
+      for (unsigned int depth = 0; depth < top; depth++) {
+        next.clear();
+        for (uint32_t pair : level) {
+          forChildPairs(pair, [&](uint32_t child) { next.push_back(child); });
+        }
+        std::swap(level, next);
+      }
+      for (uint32_t bottom : level) {
+        self(self, bottom, height - top);
+      }
+    };
+    place(place, rootPair, height);
+  }
+
+  std::vector<uint32_t> newPair(_nodesUsed);
+  for (uint32_t i = 0; i < pairs.size(); i++) {
+    newPair[pairs[i]] = 1 + 2 * i;
+  }
+  std::vector<BVHNode> ordered(_nodesUsed);
+  ordered[0] = _nodes[0];
+  for (uint32_t i = 0; i < pairs.size(); i++) {
+    ordered[1 + 2 * i] = _nodes[pairs[i]];
+    ordered[2 + 2 * i] = _nodes[pairs[i] + 1];
+  }
+  for (auto &node : ordered) {
+    if (node.numObjects == 0) {
+      node.leftFirst = newPair[node.leftFirst];
+    }
+  }
+
+  _nodes = std::move(ordered);
+  _parents.clear();
+  _objectLeaves.clear();
+}
+
+IndexRange BVH::linkParents(const std::vector<BVHNode> &nodes, size_t begin,
+                            size_t end, std::vector<uint32_t> &parents) {
+  parents.resize(nodes.size(), 0);
+  IndexRange changed;
+  for (size_t i = begin; i < end; i++) {
+    const BVHNode &node = nodes[i];
+    if (node.numObjects != 0) {
+      continue;
+    }
+    for (uint32_t child = node.leftFirst; child <= node.leftFirst + 1;
+         child++) {
+      if (parents[child] != i) {
+        parents[child] = i;
+        changed.extend(child);
+      }
+    }
+  }
+  return changed;
+}
+
+BVH::Changes BVH::insert(const std::vector<GpuObject> &gpuObjects,
+                         const std::vector<Vertex> &vertices) {
+  if (gpuObjects.empty()) {
+    return {};
+  }
+  if (_nodes.empty()) {
+    buildBVH(gpuObjects, vertices, BuildMode::Serial);
+    return {{{0, _nodes.size()}}, {{0, _objects.size()}}};
+  }
+  prepareEdit();
+
+  BVH subtree;
+  subtree.setBuildSettings(_settings);
+  subtree.buildBVH(gpuObjects, vertices,
+                   gpuObjects.size() > PARALLEL_TASK_THRESHOLD
+                       ? BuildMode::Parallel
+                       : BuildMode::Serial);
+  const auto &subtreeNodes = subtree.getNodes();
+  const BVHNode &subtreeRoot = subtreeNodes[0];
+  unsigned int sibling =
+      findInsertSibling({subtreeRoot.aabbMin, subtreeRoot.aabbMax});
+
+  // The sibling moves into a new pair next to the subtree's root, and the
+  // rest of the subtree follows. Its pairs keep their odd first index
+  unsigned int pair = _nodesUsed;
+  unsigned int offset = pair + 1;
+  _nodesUsed += subtreeNodes.size() + 1;
+  _nodes.resize(_nodesUsed);
+  _parents.resize(_nodesUsed);
+  for (unsigned int i = pair; i < _nodesUsed; i++) {
+    _dirtyNodes.push_back(i);
+  }
+
+  _nodes[pair] = _nodes[sibling];
+  _parents[pair] = sibling;
+  _parents[offset] = sibling;
+  linkChildren(pair);
+
+  for (unsigned int i = 0; i < subtreeNodes.size(); i++) {
+    BVHNode node = subtreeNodes[i];
+    unsigned int nodeIndex = i + offset;
+    if (node.numObjects == 0) {
+      node.leftFirst += offset;
+      _parents[node.leftFirst] = nodeIndex;
+      _parents[node.leftFirst + 1] = nodeIndex;
+      _nodes[nodeIndex] = node;
+      continue;
+    }
+
+    // Single objects fill the slots removals freed, larger leaves need
+    // their objects next to each other at the end
+    unsigned int first;
+    if (node.numObjects == 1 && !_freeObjects.empty()) {
+      first = _freeObjects.back();
+      _freeObjects.pop_back();
     } else {
-      std::swap(_objects[i], _objects[j--]);
+      first = _objects.size();
+      _objects.resize(first + node.numObjects);
+      _objectLeaves.resize(_objects.size());
+      _arena.resize(_objects.size());
+      for (unsigned int j = first; j < _objects.size(); j++) {
+        _arena.indices[j] = j;
+      }
+    }
+    for (unsigned int j = 0; j < node.numObjects; j++) {
+      unsigned int from = node.leftFirst + j;
+      uint32_t slot = subtree._arena.indices[from];
+      _objects[first + j] = subtree._objects[from];
+      _arena.set(_arena.indices[first + j], subtree._arena.getBounds(slot),
+                 subtree._arena.getCentroid(slot));
+      _arena.types[_arena.indices[first + j]] = subtree._arena.types[slot];
+      _objectLeaves[first + j] = nodeIndex;
+      _dirtyObjects.push_back(first + j);
+    }
+    node.leftFirst = first;
+    _nodes[nodeIndex] = node;
+  }
+
+  // The sibling's place becomes the parent of the pair
+  BVHNode &parent = _nodes[sibling];
+  parent.leftFirst = pair;
+  parent.numObjects = 0;
+  refitUpwards(sibling);
+  return finishEdit();
+}
+
+BVH::Changes BVH::removeObjects(std::vector<uint32_t> positions) {
+  prepareEdit();
+  // Removing fills the slot from the end of its leaf, so going backwards
+  // only ever moves objects that stay
+  std::sort(positions.rbegin(), positions.rend());
+  for (uint32_t position : positions) {
+    // Free slots match predicates on their placeholder too
+    if (_objectLeaves[position] != NO_LEAF) {
+      removeObject(position);
+    }
+  }
+  return finishEdit();
+}
+
+void BVH::removeObject(uint32_t position) {
+  unsigned int leaf = _objectLeaves[position];
+  BVHNode &node = _nodes[leaf];
+  if (leaf == 0 && node.numObjects == 1) {
+    return;
+  }
+
+  // The leaf's last object takes the removed one's place, so the leaf's
+  // objects stay next to each other and the freed slot ends up outside of
+  // every leaf
+  unsigned int last = node.leftFirst + node.numObjects - 1;
+  std::swap(_objects[position], _objects[last]);
+  std::swap(_arena.indices[position], _arena.indices[last]);
+  _objects[last] = {glm::uvec4(0), ObjectType::Box, 0, {-1, -1}};
+  _objectLeaves[last] = NO_LEAF;
+  _freeObjects.push_back(last);
+  _dirtyObjects.push_back(position);
+  _dirtyObjects.push_back(last);
+
+  if (--node.numObjects != 0) {
+    node.aabbMin = glm::vec3(INFINITY);
+    node.aabbMax = glm::vec3(-INFINITY);
+    updateNodeBounds(leaf, {});
+    _dirtyNodes.push_back(leaf);
+    if (leaf != 0) {
+      refitUpwards(_parents[leaf]);
+    }
+    return;
+  }
+
+  // The sibling takes the parent's place and frees the pair
+  unsigned int first = leaf & 1 ? leaf : leaf - 1;
+  unsigned int sibling = leaf & 1 ? leaf + 1 : leaf - 1;
+  unsigned int parent = _parents[leaf];
+  _nodes[parent] = _nodes[sibling];
+  linkChildren(parent);
+  _dirtyNodes.push_back(parent);
+
+  parent = compactPair(first, parent);
+  if (parent != 0) {
+    refitUpwards(_parents[parent]);
+  }
+}
+
+void BVH::prepareEdit() {
+  _dirtyNodes.clear();
+  _dirtyObjects.clear();
+  if (!_parents.empty()) {
+    return;
+  }
+
+  _parents.assign(_nodesUsed, 0);
+  _objectLeaves.assign(_objects.size(), NO_LEAF);
+  for (unsigned int i = 0; i < _nodesUsed; i++) {
+    linkChildren(i);
+  }
+}
+
+BVH::Changes BVH::finishEdit() {
+  // Compaction can leave indices past the end behind
+  auto removeStale = [](std::vector<uint32_t> &indices, size_t size) {
+    indices.erase(std::remove_if(indices.begin(), indices.end(),
+                                 [&](uint32_t index) { return index >= size; }),
+                  indices.end());
+  };
+  removeStale(_dirtyNodes, _nodesUsed);
+  removeStale(_dirtyObjects, _objects.size());
+
+  Changes changes{toRanges(std::move(_dirtyNodes), UPLOAD_GAP),
+                  toRanges(std::move(_dirtyObjects), UPLOAD_GAP)};
+  _dirtyNodes.clear();
+  _dirtyObjects.clear();
+  return changes;
+}
+
+unsigned int BVH::findInsertSibling(const AABB &bounds) const {
+  // Branch and bound over the cost the insert adds: the new parent's area
+  // plus how much every node above it grows. A subtree can't beat the best
+  // so far once what it inherits plus the new bounds' own area is worse
+  struct Candidate {
+    float cost; // Of the nodes above growing to fit bounds
+    unsigned int nodeIndex;
+    bool operator<(const Candidate &other) const { return cost > other.cost; }
+  };
+  float area = bounds.surfaceArea();
+  unsigned int best = 0;
+  float bestCost = INFINITY;
+  std::priority_queue<Candidate> queue;
+  queue.push({0.0f, 0});
+  while (!queue.empty()) {
+    Candidate candidate = queue.top();
+    queue.pop();
+    if (candidate.cost + area >= bestCost) {
+      break;
+    }
+
+    const BVHNode &node = _nodes[candidate.nodeIndex];
+    AABB nodeBounds{node.aabbMin, node.aabbMax};
+    AABB merged = nodeBounds;
+    merged.extend(bounds);
+    float cost = candidate.cost + merged.surfaceArea();
+    if (cost < bestCost) {
+      best = candidate.nodeIndex;
+      bestCost = cost;
+    }
+
+    float inherited = cost - nodeBounds.surfaceArea();
+    if (node.numObjects == 0 && inherited + area < bestCost) {
+      queue.push({inherited, node.leftFirst});
+      queue.push({inherited, node.leftFirst + 1});
+    }
+  }
+  return best;
+}
+
+void BVH::linkChildren(unsigned int nodeIndex) {
+  const BVHNode &node = _nodes[nodeIndex];
+  if (node.numObjects == 0) {
+    _parents[node.leftFirst] = nodeIndex;
+    _parents[node.leftFirst + 1] = nodeIndex;
+    return;
+  }
+  for (unsigned int i = node.leftFirst; i < node.leftFirst + node.numObjects;
+       i++) {
+    _objectLeaves[i] = nodeIndex;
+  }
+}
+
+unsigned int BVH::compactPair(unsigned int first, unsigned int nodeIndex) {
+  unsigned int last = _nodesUsed - 2;
+  if (first != last) {
+    unsigned int parent = _parents[last];
+    _nodes[first] = _nodes[last];
+    _nodes[first + 1] = _nodes[last + 1];
+    _parents[first] = parent;
+    _parents[first + 1] = parent;
+    _nodes[parent].leftFirst = first;
+    linkChildren(first);
+    linkChildren(first + 1);
+    _dirtyNodes.push_back(parent);
+    _dirtyNodes.push_back(first);
+    _dirtyNodes.push_back(first + 1);
+    if (nodeIndex >= last) {
+      nodeIndex = nodeIndex - last + first;
+    }
+  }
+
+  _nodesUsed -= 2;
+  _nodes.resize(_nodesUsed);
+  _parents.resize(_nodesUsed);
+  return nodeIndex;
+}
+
+void BVH::refitUpwards(unsigned int nodeIndex) {
+  while (true) {
+    setBoundsFromChildren(nodeIndex);
+    rotate(nodeIndex);
+    _dirtyNodes.push_back(nodeIndex);
+    if (nodeIndex == 0) {
+      return;
+    }
+    nodeIndex = _parents[nodeIndex];
+  }
+}
+
+void BVH::rotate(unsigned int nodeIndex) {
+  unsigned int left = _nodes[nodeIndex].leftFirst;
+  auto area = [&](unsigned int a, unsigned int b) {
+    AABB bounds{_nodes[a].aabbMin, _nodes[a].aabbMax};
+    bounds.extend({_nodes[b].aabbMin, _nodes[b].aabbMax});
+    return bounds.surfaceArea();
+  };
+
+  // Swapping a child with one of its sibling's children only changes the
+  // sibling's area, every node's subtree stays the same size
+  float bestSaving = 0.0f;
+  unsigned int swapA = 0;
+  unsigned int swapB = 0;
+  unsigned int changed = 0;
+  for (unsigned int side = 0; side < 2; side++) {
+    unsigned int child = left + side;
+    unsigned int other = left + 1 - side;
+    const BVHNode &otherNode = _nodes[other];
+    if (otherNode.numObjects != 0) {
+      continue;
+    }
+
+    float otherArea =
+        AABB{otherNode.aabbMin, otherNode.aabbMax}.surfaceArea();
+    for (unsigned int grandchild = 0; grandchild < 2; grandchild++) {
+      unsigned int swapped = otherNode.leftFirst + grandchild;
+      unsigned int kept = otherNode.leftFirst + 1 - grandchild;
+      float saving = otherArea - area(child, kept);
+      if (saving > bestSaving) {
+        bestSaving = saving;
+        swapA = child;
+        swapB = swapped;
+        changed = other;
+      }
+    }
+  }
+  // Ignore float noise, it would keep swapping back and forth
+  float nodeArea = AABB{_nodes[nodeIndex].aabbMin, _nodes[nodeIndex].aabbMax}
+                       .surfaceArea();
+  if (bestSaving <= nodeArea * 1e-4f) {
+    return;
+  }
+
+  std::swap(_nodes[swapA], _nodes[swapB]);
+  linkChildren(swapA);
+  linkChildren(swapB);
+  setBoundsFromChildren(changed);
+  _dirtyNodes.push_back(swapA);
+  _dirtyNodes.push_back(swapB);
+  _dirtyNodes.push_back(changed);
+}
+
+void BVH::setBoundsFromChildren(unsigned int nodeIndex) {
+  BVHNode &node = _nodes[nodeIndex];
+  const BVHNode &left = _nodes[node.leftFirst];
+  const BVHNode &right = _nodes[node.leftFirst + 1];
+  node.aabbMin = glm::min(left.aabbMin, right.aabbMin);
+  node.aabbMax = glm::max(left.aabbMax, right.aabbMax);
+}
+
+void BVH::refitNode(unsigned int nodeIndex,
+                    const std::vector<Vertex> &vertices) {
+  BVHNode &node = _nodes[nodeIndex];
+  node.aabbMin = glm::vec3(INFINITY);
+  node.aabbMax = glm::vec3(-INFINITY);
+  if (node.numObjects != 0) {
+    updateNodeBounds(nodeIndex, vertices);
+    return;
+  }
+
+  for (unsigned int child = 0; child < 2; child++) {
+    node.aabbMin =
+        glm::min(node.aabbMin, _nodes[node.leftFirst + child].aabbMin);
+    node.aabbMax =
+        glm::max(node.aabbMax, _nodes[node.leftFirst + child].aabbMax);
+  }
+}
+
+void BVH::updateNodeBounds(unsigned int nodeIndex,
+                           const std::vector<Vertex> &vertices) {
+  BVHNode &node = _nodes[nodeIndex];
+  for (int axis = 0; axis < 3; axis++) {
+    const float *boundsMin = _arena.boundsMin[axis].data();
+    const float *boundsMax = _arena.boundsMax[axis].data();
+    for (unsigned int i = node.leftFirst; i < node.leftFirst + node.numObjects;
+         i++) {
+      uint32_t slot = _arena.indices[i];
+      node.aabbMin[axis] = std::min(node.aabbMin[axis], boundsMin[slot]);
+      node.aabbMax[axis] = std::max(node.aabbMax[axis], boundsMax[slot]);
     }
   }
+}
+
+void BVH::subdivide(unsigned int nodeIndex,
+                    const std::vector<Vertex> &vertices) {
+  BVHNode &node = _nodes.at(nodeIndex);
 
+  unsigned int i;
+  if (!splitObjects(node, vertices, nullptr, i)) {
+    return;
+  }
   int leftCount = i - node.leftFirst;
 
   // Create left and right child nodes
@@ -91,12 +812,185 @@ void BVH::subdivide(unsigned int nodeIndex,
   subdivide(rightIndex, vertices);
 }
 
+void BVH::subdivideParallel(unsigned int nodeIndex,
+                            const std::vector<Vertex> &vertices,
+                            std::atomic<unsigned int> &nodesUsed,
+                            ThreadPool &pool) {
+  // _nodes is sized up front, so references stay valid across threads
+  BVHNode &node = _nodes[nodeIndex];
+
+  unsigned int i;
+  if (!splitObjects(node, vertices, &pool, i)) {
+    return;
+  }
+  unsigned int leftCount = i - node.leftFirst;
+
+  // Children stay adjacent, the shader reads them as leftFirst and +1
+  unsigned int leftIndex = nodesUsed.fetch_add(2);
+  unsigned int rightIndex = leftIndex + 1;
+
+  _nodes[leftIndex].leftFirst = node.leftFirst;
+  _nodes[leftIndex].numObjects = leftCount;
+
+  _nodes[rightIndex].leftFirst = i;
+  _nodes[rightIndex].numObjects = node.numObjects - leftCount;
+
+  node.leftFirst = leftIndex;
+  node.numObjects = 0;
+
+  updateNodeBounds(leftIndex, vertices);
+  updateNodeBounds(rightIndex, vertices);
+
+  // Hand the right subtree to another thread if it is worth a task
+  if (_nodes[rightIndex].numObjects > PARALLEL_TASK_THRESHOLD) {
+    pool.submit([this, rightIndex, &vertices, &nodesUsed, &pool] {
+      subdivideParallel(rightIndex, vertices, nodesUsed, pool);
+    });
+  } else {
+    subdivideParallel(rightIndex, vertices, nodesUsed, pool);
+  }
+  subdivideParallel(leftIndex, vertices, nodesUsed, pool);
+}
+
+bool BVH::splitObjects(const BVHNode &node,
+                       const std::vector<Vertex> &vertices, ThreadPool *pool,
+                       unsigned int &splitIndex) {
+  if (node.numObjects <= _settings.leafSize) {
+    return splitTypes(node, splitIndex);
+  }
+
+  // Binning is cheap but only tries a few planes, small nodes near the
+  // leaves can afford to try them all
+  int splitAxis = 0;
+  float splitPos = 0.0f;
+  unsigned int sweepIndex = 0;
+  bool sweep = node.numObjects < _settings.sweepThreshold;
+  float bestCost;
+  if (sweep) {
+    bestCost = findSweepSplit(node, splitAxis, sweepIndex);
+  } else if (pool && node.numObjects > PARALLEL_BINNING_THRESHOLD) {
+    bestCost = findBestSplitParallel(node, splitAxis, splitPos, *pool);
+  } else {
+    bestCost = findBestSplit(node, splitAxis, splitPos, vertices);
+  }
+
+  // Split only if visiting one more node costs less than the intersections
+  // it saves
+  float nodeArea = AABB{node.aabbMin, node.aabbMax}.surfaceArea();
+  if (_settings.traversalCost * nodeArea +
+          _settings.intersectionCost * bestCost >=
+      _settings.intersectionCost * node.numObjects * nodeArea) {
+    return splitTypes(node, splitIndex);
+  }
+
+  splitIndex = sweep ? node.leftFirst + sweepIndex
+                     : partition(node, splitAxis, splitPos);
+  return true;
+}
+
+bool BVH::splitTypes(const BVHNode &node, unsigned int &splitIndex) {
+  uint32_t *indices = &_arena.indices[node.leftFirst];
+  const ObjectType *types = _arena.types.data();
+  ObjectType type = types[indices[0]];
+  uint32_t *split =
+      std::partition(indices, indices + node.numObjects,
+                     [&](uint32_t slot) { return types[slot] == type; });
+  if (split == indices + node.numObjects) {
+    return false;
+  }
+  splitIndex = node.leftFirst + (split - indices);
+  return true;
+}
+
+float BVH::findSweepSplit(const BVHNode &node, int &splitAxis,
+                          unsigned int &splitIndex) {
+  uint32_t *indices = &_arena.indices[node.leftFirst];
+  unsigned int count = node.numObjects;
+  auto sortAlong = [&](int axis) {
+    // Ties go by slot so every build sorts the same way
+    const float *centroids = _arena.centroids[axis].data();
+    std::sort(indices, indices + count, [centroids](uint32_t a, uint32_t b) {
+      return centroids[a] < centroids[b] ||
+             (centroids[a] == centroids[b] && a < b);
+    });
+  };
+
+  // Same cost as the binned sweep, the areas weighted by the counts
+  float rightArea[MAX_SWEEP_OBJECTS];
+  float bestCost = INFINITY;
+  for (int axis = 0; axis < 3; axis++) {
+    sortAlong(axis);
+
+    AABB right;
+    for (unsigned int i = count - 1; i > 0; i--) {
+      right.extend(_arena.getBounds(indices[i]));
+      rightArea[i] = right.surfaceArea();
+    }
+
+    AABB left;
+    for (unsigned int i = 1; i < count; i++) {
+      left.extend(_arena.getBounds(indices[i - 1]));
+      float cost = left.surfaceArea() * i + rightArea[i] * (count - i);
+      if (cost < bestCost) {
+        bestCost = cost;
+        splitAxis = axis;
+        splitIndex = i;
+      }
+    }
+  }
+
+  if (bestCost < INFINITY && splitAxis != 2) {
+    sortAlong(splitAxis);
+  }
+  return bestCost;
+}
+
+unsigned int BVH::partition(const BVHNode &node, int splitAxis,
+                            float splitPos) {
+  // Only the 4 byte indices move, the centroids are read where they are
+  const float *centroids = _arena.centroids[splitAxis].data();
+  uint32_t *indices = _arena.indices.data();
+  int i = node.leftFirst;
+  int j = i + node.numObjects - 1;
+  while (i <= j) {
+    if (centroids[indices[i]] < splitPos) {
+      i++;
+    } else {
+      std::swap(indices[i], indices[j--]);
+    }
+  }
+  return i;
+}
+
 float BVH::findBestSplit(const BVHNode &node, int &splitAxis, float &splitPos,
                          const std::vector<Vertex> &vertices) const {
+  const uint32_t *indices = &_arena.indices[node.leftFirst];
+  AABB bounds = getCentroidBounds(_arena, indices, node.numObjects);
+
+  const unsigned int binCount = _settings.binCount;
+  Bin bins[3 * MAX_BIN_COUNT];
+  binObjects(_arena, indices, node.numObjects, bounds, binCount, bins);
+
+  float bestCost = INFINITY;
+  for (int axis = 0; axis < 3; axis++) {
+    float min = bounds.min[axis];
+    float max = bounds.max[axis];
+    if (fabs(min - max) < 0.0001f)
+      continue;
+
+    evaluateBins(&bins[axis * binCount], min, max, axis, bestCost, splitAxis,
+                 splitPos);
+  }
+
+  return bestCost;
+}
+
+float BVH::findObjectSplit(const BVHObject *objects, unsigned int count,
+                           int &splitAxis, float &splitPos) const {
   // Find centroid bounds
   AABB bounds;
-  for (int i = node.leftFirst; i < node.leftFirst + node.numObjects; i++) {
-    bounds.extend(_objects[i].centroid);
+  for (unsigned int i = 0; i < count; i++) {
+    bounds.extend(objects[i].centroid);
   }
 
   float bestCost = INFINITY;
@@ -107,41 +1001,504 @@ float BVH::findBestSplit(const BVHNode &node, int &splitAxis, float &splitPos,
       continue;
 
     // Calculate the bins
-    Bin bins[BIN_COUNT];
-    float scale = BIN_COUNT / (max - min);
-    for (int i = node.leftFirst; i < node.leftFirst + node.numObjects; i++) {
-      const auto &object = _objects[i];
-      int binIdx = std::min(BIN_COUNT - 1,
+    const unsigned int binCount = _settings.binCount;
+    Bin bins[MAX_BIN_COUNT];
+    float scale = binCount / (max - min);
+    for (unsigned int i = 0; i < count; i++) {
+      const auto &object = objects[i];
+      int binIdx = std::min(binCount - 1,
                             (uint)((object.centroid[axis] - min) * scale));
       bins[binIdx].aabb.extend(object.aabb);
       bins[binIdx].numObjects++;
     }
 
-    // Calculate number of objects and area for each bin
-    float leftArea[BIN_COUNT - 1], rightArea[BIN_COUNT - 1];
-    int leftCount[BIN_COUNT - 1], rightCount[BIN_COUNT - 1];
+    evaluateBins(bins, min, max, axis, bestCost, splitAxis, splitPos);
+  }
+
+  return bestCost;
+}
+
+float BVH::findBestSplitParallel(const BVHNode &node, int &splitAxis,
+                                 float &splitPos, ThreadPool &pool) const {
+  // Each chunk of objects gets its own bounds and bins, merged afterwards
+  unsigned int numChunks = pool.size() * 4;
+  unsigned int chunkSize = (node.numObjects + numChunks - 1) / numChunks;
+  auto chunkRange = [&](unsigned int chunk, unsigned int &first,
+                        unsigned int &count) {
+    first = std::min(chunk * chunkSize, node.numObjects);
+    count = std::min(chunkSize, node.numObjects - first);
+  };
+  const uint32_t *indices = &_arena.indices[node.leftFirst];
+
+  std::vector<AABB> chunkBounds(numChunks);
+  pool.parallelFor(numChunks, 1, [&](unsigned int begin, unsigned int end) {
+    for (unsigned int chunk = begin; chunk < end; chunk++) {
+      unsigned int first, count;
+      chunkRange(chunk, first, count);
+      chunkBounds[chunk] = getCentroidBounds(_arena, indices + first, count);
+    }
+  });
+
+  AABB bounds;
+  for (const auto &chunk : chunkBounds) {
+    bounds.extend(chunk);
+  }
+
+  const unsigned int binCount = _settings.binCount;
+  std::vector<Bin> chunkBins(numChunks * 3 * binCount);
+  pool.parallelFor(numChunks, 1, [&](unsigned int begin, unsigned int end) {
+    for (unsigned int chunk = begin; chunk < end; chunk++) {
+      unsigned int first, count;
+      chunkRange(chunk, first, count);
+      binObjects(_arena, indices + first, count, bounds, binCount,
+                 &chunkBins[chunk * 3 * binCount]);
+    }
+  });
+
+  float bestCost = INFINITY;
+  for (int axis = 0; axis < 3; axis++) {
+    float min = bounds.min[axis];
+    float max = bounds.max[axis];
+    if (fabs(min - max) < 0.0001f)
+      continue;
+
+    Bin bins[MAX_BIN_COUNT];
+    for (unsigned int chunk = 0; chunk < numChunks; chunk++) {
+      const Bin *chunkBin = &chunkBins[(chunk * 3 + axis) * binCount];
+      for (unsigned int i = 0; i < binCount; i++) {
+        bins[i].aabb.extend(chunkBin[i].aabb);
+        bins[i].numObjects += chunkBin[i].numObjects;
+      }
+    }
+
+    evaluateBins(bins, min, max, axis, bestCost, splitAxis, splitPos);
+  }
+
+  return bestCost;
+}
+
+void BVH::evaluateBins(const Bin *bins, float min, float max, int axis,
+                       float &bestCost, int &splitAxis,
+                       float &splitPos) const {
+  // Evaluate SAH for each split
+  const unsigned int binCount = _settings.binCount;
+  float costs[MAX_BIN_COUNT - 1];
+  sweepBins(bins, binCount, costs);
+
+  float scale = (max - min) / binCount;
+  for (unsigned int i = 0; i < binCount - 1; i++) {
+    if (costs[i] < bestCost) {
+      bestCost = costs[i];
+      splitAxis = axis;
+      splitPos = min + (i + 1) * scale;
+    }
+  }
+}
+
+namespace {
+// Spreads the lower 10 bits of v out so there are two zero bits between each
+uint32_t expandBits(uint32_t v) {
+  v = (v * 0x00010001u) & 0xFF0000FFu;
+  v = (v * 0x00000101u) & 0x0F00F00Fu;
+  v = (v * 0x00000011u) & 0xC30C30C3u;
+  v = (v * 0x00000005u) & 0x49249249u;
+  return v;
+}
+
+// 30-bit Morton code of a point inside the unit cube
+uint32_t mortonCode(const glm::vec3 &point) {
+  glm::vec3 scaled = glm::clamp(point * 1024.0f, 0.0f, 1023.0f);
+  return expandBits(scaled.x) << 2 | expandBits(scaled.y) << 1 |
+         expandBits(scaled.z);
+}
+
+// Length of the common prefix of two sorted keys, ties broken by index
+int commonPrefix(const std::vector<uint32_t> &codes, int i, int j) {
+  if (j < 0 || j >= (int)codes.size()) {
+    return -1;
+  }
+  if (codes[i] == codes[j]) {
+    return 32 + __builtin_clz(i ^ j);
+  }
+  return __builtin_clz(codes[i] ^ codes[j]);
+}
+} // namespace
+
+void BVH::buildLBVH(const std::vector<Vertex> &vertices, ThreadPool &pool) {
+  const int size = _arena.size();
+
+  // Morton codes of the centroids, normalized to the centroid bounds
+  AABB bounds;
+  for (int i = 0; i < size; i++) {
+    bounds.extend(_arena.getCentroid(i));
+  }
+  glm::vec3 extent = bounds.max - bounds.min;
+  glm::vec3 scale = glm::vec3(extent.x > 0.0f ? 1.0f / extent.x : 0.0f,
+                              extent.y > 0.0f ? 1.0f / extent.y : 0.0f,
+                              extent.z > 0.0f ? 1.0f / extent.z : 0.0f);
+
+  std::vector<uint32_t> &codes = _arena.codes;
+  std::vector<uint32_t> &indices = _arena.indices;
+  codes.resize(size);
+  pool.parallelFor(size, PARALLEL_TASK_THRESHOLD,
+                   [&](unsigned int begin, unsigned int end) {
+                     for (unsigned int i = begin; i < end; i++) {
+                       codes[i] = mortonCode((_arena.getCentroid(i) -
+                                              bounds.min) * scale);
+                       indices[i] = i;
+                     }
+                   });
+
+  // LSD radix sort, three passes of 10 bits. Sorting the indices is all the
+  // reordering the objects need
+  std::vector<uint32_t> &tempCodes = _arena.tempCodes;
+  std::vector<uint32_t> &tempIndices = _arena.tempIndices;
+  tempCodes.resize(size);
+  tempIndices.resize(size);
+  for (int shift = 0; shift < 30; shift += 10) {
+    unsigned int offsets[1024] = {};
+    for (int i = 0; i < size; i++) {
+      offsets[(codes[i] >> shift) & 1023]++;
+    }
+    unsigned int sum = 0;
+    for (auto &offset : offsets) {
+      unsigned int count = offset;
+      offset = sum;
+      sum += count;
+    }
+    for (int i = 0; i < size; i++) {
+      unsigned int dst = offsets[(codes[i] >> shift) & 1023]++;
+      tempCodes[dst] = codes[i];
+      tempIndices[dst] = indices[i];
+    }
+    codes.swap(tempCodes);
+    indices.swap(tempIndices);
+  }
+
+  // Find the range and split of every internal node independently (Karras
+  // 2012). Internal node i covers [first, last] and splits after split[i]
+  std::vector<int> first(std::max(1, size - 1)), last(first.size()),
+      split(first.size());
+  first[0] = 0;
+  last[0] = size - 1;
+  split[0] = size / 2 - 1;
+  pool.parallelFor(size - 1, PARALLEL_TASK_THRESHOLD,
+                   [&](unsigned int begin, unsigned int end) {
+    for (int i = begin; i < (int)end; i++) {
+      // Direction of the range and the prefix it has to beat
+      int direction = commonPrefix(codes, i, i + 1) >
+                              commonPrefix(codes, i, i - 1)
+                          ? 1
+                          : -1;
+      int minPrefix = commonPrefix(codes, i, i - direction);
+
+      // Find the other end of the range
+      int maxLength = 2;
+      while (commonPrefix(codes, i, i + maxLength * direction) > minPrefix) {
+        maxLength *= 2;
+      }
+      int length = 0;
+      for (int step = maxLength / 2; step > 0; step /= 2) {
+        if (commonPrefix(codes, i, i + (length + step) * direction) >
+            minPrefix) {
+          length += step;
+        }
+      }
+      int j = i + length * direction;
+
+      // Find where the highest differing bit flips
+      int nodePrefix = commonPrefix(codes, i, j);
+      int offset = 0;
+      int step = length;
+      do {
+        step = (step + 1) / 2;
+        if (offset + step < length &&
+            commonPrefix(codes, i, i + (offset + step) * direction) >
+                nodePrefix) {
+          offset += step;
+        }
+      } while (step > 1);
+
+      first[i] = std::min(i, j);
+      last[i] = std::max(i, j);
+      split[i] = i + offset * direction + std::min(direction, 0);
+    }
+  });
+
+  // Emit the tree top down so siblings end up next to each other. A range
+  // with more than one object always starts (left child) or ends (right
+  // child) at the internal node of the same index
+  _nodesUsed = 1;
+  std::vector<std::pair<unsigned int, int>> stack{{0, 0}};
+  while (!stack.empty()) {
+    auto [nodeIndex, internal] = stack.back();
+    stack.pop_back();
+
+    BVHNode &node = _nodes[nodeIndex];
+    node.leftFirst = first[internal];
+    node.numObjects = last[internal] - first[internal] + 1;
+    // A leaf mixing faces and spheres is split into one leaf of each
+    unsigned int splitIndex;
+    bool leaf = node.numObjects <= _settings.leafSize;
+    if (leaf && !splitTypes(node, splitIndex)) {
+      continue;
+    }
+
+    unsigned int leftIndex = _nodesUsed++;
+    unsigned int rightIndex = _nodesUsed++;
+    unsigned int rightFirst = leaf ? splitIndex : split[internal] + 1;
+    int leftCount = rightFirst - node.leftFirst;
+
+    _nodes[leftIndex].leftFirst = node.leftFirst;
+    _nodes[leftIndex].numObjects = leftCount;
+    _nodes[rightIndex].leftFirst = rightFirst;
+    _nodes[rightIndex].numObjects = node.numObjects - leftCount;
+
+    node.leftFirst = leftIndex;
+    node.numObjects = 0;
+
+    if (leaf) {
+      continue;
+    }
+    if (leftCount > 1) {
+      stack.push_back({leftIndex, split[internal]});
+    }
+    if (_nodes[rightIndex].numObjects > 1) {
+      stack.push_back({rightIndex, split[internal] + 1});
+    }
+  }
+
+  // Children always come after their parent, so one backwards pass fits the
+  // bounds bottom up
+  for (int i = _nodesUsed - 1; i >= 0; i--) {
+    refitNode(i, vertices);
+  }
+}
+
+void BVH::buildSBVH(const std::vector<GpuObject> &gpuObjects,
+                    const std::vector<Vertex> &vertices) {
+  // Clipping needs a box per reference rather than per object, so this
+  // builder works on whole references instead of the arena's indices
+  std::vector<BVHObject> references(gpuObjects.size());
+  for (size_t i = 0; i < gpuObjects.size(); i++) {
+    const GpuObject &object = gpuObjects[i];
+    references[i] = {object.data,
+                     object.type,
+                     object.materialIdx,
+                     object.textureIndices,
+                     _arena.getBounds(i),
+                     _arena.getCentroid(i)};
+  }
+
+  // Duplicated references make the final sizes unknown, so leaves append
+  // their objects and bounds and nodes grow as needed
+  AABB rootAABB{_nodes[0].aabbMin, _nodes[0].aabbMax};
+  _nodes.resize(1);
+  _objects.clear();
+  _objects.reserve(references.size() * 2);
+  _arena.resize(0);
+
+  subdivideSpatial(0, references, vertices, rootAABB.surfaceArea(), 0);
+  _nodesUsed = _nodes.size();
+}
+
+void BVH::subdivideSpatial(unsigned int nodeIndex,
+                           std::vector<BVHObject> &references,
+                           const std::vector<Vertex> &vertices,
+                           float rootArea, unsigned int depth) {
+  AABB nodeAABB{_nodes[nodeIndex].aabbMin, _nodes[nodeIndex].aabbMax};
+  float nodeArea = nodeAABB.surfaceArea();
+
+  int splitAxis = 0;
+  float splitPos = 0.0f;
+  float bestCost = INFINITY;
+  bool spatial = false;
+  if (references.size() > _settings.leafSize && depth < SBVH_MAX_DEPTH) {
+    bestCost = findObjectSplit(references.data(), references.size(),
+                               splitAxis, splitPos);
+
+    // Only look for a spatial split if the object split children overlap
+    AABB leftAABB, rightAABB;
+    for (const auto &reference : references) {
+      if (reference.centroid[splitAxis] < splitPos) {
+        leftAABB.extend(reference.aabb);
+      } else {
+        rightAABB.extend(reference.aabb);
+      }
+    }
+    glm::vec3 overlap = glm::min(leftAABB.max, rightAABB.max) -
+                        glm::max(leftAABB.min, rightAABB.min);
+    AABB overlapAABB{glm::vec3(0.0f), glm::max(overlap, glm::vec3(0.0f))};
+    if (bestCost == INFINITY ||
+        overlapAABB.surfaceArea() > SPATIAL_SPLIT_ALPHA * rootArea) {
+      int spatialAxis = 0;
+      float spatialPos = 0.0f;
+      float spatialCost = findSpatialSplit(references, nodeAABB, spatialAxis,
+                                           spatialPos, vertices);
+      if (spatialCost < bestCost) {
+        bestCost = spatialCost;
+        splitAxis = spatialAxis;
+        splitPos = spatialPos;
+        spatial = true;
+      }
+    }
+  }
+
+  // Partition the references, clipping the ones the spatial split cuts
+  std::vector<BVHObject> left, right;
+  if (_settings.traversalCost * nodeArea +
+          _settings.intersectionCost * bestCost <
+      _settings.intersectionCost * references.size() * nodeArea) {
+    for (const auto &reference : references) {
+      if (!spatial) {
+        (reference.centroid[splitAxis] < splitPos ? left : right)
+            .push_back(reference);
+      } else if (reference.aabb.max[splitAxis] <= splitPos) {
+        left.push_back(reference);
+      } else if (reference.aabb.min[splitAxis] >= splitPos) {
+        right.push_back(reference);
+      } else {
+        BVHObject leftPart = reference;
+        leftPart.aabb =
+            clipObject(reference, splitAxis, -INFINITY, splitPos, vertices);
+        leftPart.centroid = (leftPart.aabb.min + leftPart.aabb.max) * 0.5f;
+        BVHObject rightPart = reference;
+        rightPart.aabb =
+            clipObject(reference, splitAxis, splitPos, INFINITY, vertices);
+        rightPart.centroid = (rightPart.aabb.min + rightPart.aabb.max) * 0.5f;
+
+        // Clipping can leave nothing on one side for grazing objects
+        if (!leftPart.aabb.empty()) {
+          left.push_back(leftPart);
+        }
+        if (!rightPart.aabb.empty()) {
+          right.push_back(rightPart);
+        }
+      }
+    }
+  }
+
+  // Leaves only hold one type, a mixed one splits into one per type
+  if (left.empty() || right.empty()) {
+    left.clear();
+    right.clear();
+    for (const auto &reference : references) {
+      (reference.type == references[0].type ? left : right)
+          .push_back(reference);
+    }
+    if (right.empty()) {
+      left.clear();
+    }
+  }
+
+  if (left.empty() || right.empty()) {
+    BVHNode &node = _nodes[nodeIndex];
+    node.leftFirst = _objects.size();
+    node.numObjects = references.size();
+
+    // Every reference gets its own slot so refit can find its bounds
+    uint32_t slot = _arena.size();
+    _arena.resize(slot + references.size());
+    for (const auto &reference : references) {
+      _objects.push_back(reference);
+      _arena.set(slot, reference.aabb, reference.centroid);
+      _arena.types[slot] = reference.type;
+      _arena.indices[slot] = slot;
+      slot++;
+    }
+    return;
+  }
+
+  // The references are not needed once split, free them before recursing
+  std::vector<BVHObject>().swap(references);
+
+  unsigned int leftIndex = _nodes.size();
+  unsigned int rightIndex = leftIndex + 1;
+  _nodes.resize(_nodes.size() + 2);
+  _nodes[nodeIndex].leftFirst = leftIndex;
+  _nodes[nodeIndex].numObjects = 0;
+
+  for (const auto &reference : left) {
+    _nodes[leftIndex].aabbMin =
+        glm::min(_nodes[leftIndex].aabbMin, reference.aabb.min);
+    _nodes[leftIndex].aabbMax =
+        glm::max(_nodes[leftIndex].aabbMax, reference.aabb.max);
+  }
+  for (const auto &reference : right) {
+    _nodes[rightIndex].aabbMin =
+        glm::min(_nodes[rightIndex].aabbMin, reference.aabb.min);
+    _nodes[rightIndex].aabbMax =
+        glm::max(_nodes[rightIndex].aabbMax, reference.aabb.max);
+  }
+
+  subdivideSpatial(leftIndex, left, vertices, rootArea, depth + 1);
+  subdivideSpatial(rightIndex, right, vertices, rootArea, depth + 1);
+}
+
+float BVH::findSpatialSplit(const std::vector<BVHObject> &references,
+                            const AABB &bounds, int &splitAxis,
+                            float &splitPos,
+                            const std::vector<Vertex> &vertices) const {
+  const unsigned int binCount = _settings.binCount;
+  struct SpatialBin {
+    AABB aabb;
+    unsigned int entries = 0; // References starting in this bin
+    unsigned int exits = 0;   // References ending in this bin
+  };
+
+  float bestCost = INFINITY;
+  for (int axis = 0; axis < 3; axis++) {
+    float min = bounds.min[axis];
+    float max = bounds.max[axis];
+    if (fabs(min - max) < 0.0001f)
+      continue;
+
+    // Clip every reference to each bin it overlaps
+    SpatialBin bins[MAX_BIN_COUNT];
+    float binSize = (max - min) / binCount;
+    for (const auto &reference : references) {
+      // Like the partition, a reference ending on a plane is left of it and
+      // one starting on a plane right of it. One lying in a plane is left
+      int lastBin = std::clamp(
+          (int)std::ceil((reference.aabb.max[axis] - min) / binSize) - 1, 0,
+          (int)binCount - 1);
+      int firstBin = std::clamp(
+          (int)((reference.aabb.min[axis] - min) / binSize), 0, lastBin);
+      for (int i = firstBin; i <= lastBin; i++) {
+        float lo = min + i * binSize;
+        float hi = i == (int)binCount - 1 ? max : lo + binSize;
+        bins[i].aabb.extend(clipObject(reference, axis, lo, hi, vertices));
+      }
+      bins[firstBin].entries++;
+      bins[lastBin].exits++;
+    }
+
+    // Sweep like the object bins, counting entries left and exits right
+    float leftArea[MAX_BIN_COUNT - 1], rightArea[MAX_BIN_COUNT - 1];
+    int leftCount[MAX_BIN_COUNT - 1], rightCount[MAX_BIN_COUNT - 1];
     AABB leftAABB, rightAABB;
     int leftSum = 0, rightSum = 0;
-    for (int i = 0; i < BIN_COUNT - 1; i++) {
-      leftSum += bins[i].numObjects;
+    for (int i = 0; i < (int)binCount - 1; i++) {
+      leftSum += bins[i].entries;
       leftCount[i] = leftSum;
       leftAABB.extend(bins[i].aabb);
       leftArea[i] = leftAABB.surfaceArea();
 
-      rightSum += bins[BIN_COUNT - 1 - i].numObjects;
-      rightCount[BIN_COUNT - 2 - i] = rightSum;
-      rightAABB.extend(bins[BIN_COUNT - 1 - i].aabb);
-      rightArea[BIN_COUNT - 2 - i] = rightAABB.surfaceArea();
+      rightSum += bins[binCount - 1 - i].exits;
+      rightCount[binCount - 2 - i] = rightSum;
+      rightAABB.extend(bins[binCount - 1 - i].aabb);
+      rightArea[binCount - 2 - i] = rightAABB.surfaceArea();
     }
 
-    // Evaluate SAH for each split
-    scale = (max - min) / BIN_COUNT;
-    for (int i = 0; i < BIN_COUNT - 1; i++) {
+    for (int i = 0; i < (int)binCount - 1; i++) {
+      if (leftCount[i] == 0 || rightCount[i] == 0) {
+        continue;
+      }
       float cost = leftArea[i] * leftCount[i] + rightArea[i] * rightCount[i];
       if (cost < bestCost) {
         bestCost = cost;
         splitAxis = axis;
-        splitPos = min + (i + 1) * scale;
+        splitPos = min + (i + 1) * binSize;
       }
     }
   }
@@ -149,6 +1506,256 @@ float BVH::findBestSplit(const BVHNode &node, int &splitAxis, float &splitPos,
   return bestCost;
 }
 
+AABB BVH::clipObject(const BVHObject &object, int axis, float lo, float hi,
+                     const std::vector<Vertex> &vertices) const {
+  AABB aabb;
+  if (object.type == ObjectType::Face) {
+    // The clipped polygon's corners are the triangle's corners inside the
+    // slab plus the points where its edges cross the slab planes
+    glm::vec3 v[3] = {vertices[object.data.x].position,
+                      vertices[object.data.y].position,
+                      vertices[object.data.z].position};
+    for (int i = 0; i < 3; i++) {
+      const glm::vec3 &a = v[i];
+      const glm::vec3 &b = v[(i + 1) % 3];
+      if (a[axis] >= lo && a[axis] <= hi) {
+        aabb.extend(a);
+      }
+      for (float plane : {lo, hi}) {
+        if ((a[axis] < plane) != (b[axis] < plane)) {
+          float t = (plane - a[axis]) / (b[axis] - a[axis]);
+          glm::vec3 point = glm::mix(a, b, t);
+          point[axis] = plane;
+          aabb.extend(point);
+        }
+      }
+    }
+  } else {
+    aabb = object.aabb;
+  }
+
+  // Stay inside the slab and the reference's current (possibly clipped) box
+  aabb.min[axis] = std::max(aabb.min[axis], lo);
+  aabb.max[axis] = std::min(aabb.max[axis], hi);
+  aabb.min = glm::max(aabb.min, object.aabb.min);
+  aabb.max = glm::min(aabb.max, object.aabb.max);
+  return aabb.empty() ? AABB{} : aabb;
+}
+
+float BVH::getSAHCost() const {
+  if (_nodes.empty()) {
+    return 0.0f;
+  }
+
+  AABB rootAABB{_nodes[0].aabbMin, _nodes[0].aabbMax};
+  float rootArea = rootAABB.surfaceArea();
+
+  float cost = 0.0f;
+  for (unsigned int i = 0; i < _nodesUsed; i++) {
+    const BVHNode &node = _nodes[i];
+    AABB aabb{node.aabbMin, node.aabbMax};
+    float probability = aabb.surfaceArea() / rootArea;
+    if (node.numObjects != 0) {
+      cost += probability * node.numObjects * _settings.intersectionCost;
+    } else {
+      cost += probability * _settings.traversalCost;
+    }
+  }
+  return cost;
+}
+
+float BVH::intersect(const Ray &ray, const std::vector<GpuObject> &objects,
+                     const std::vector<Vertex> &vertices, float closest,
+                     TraversalStats &stats) const {
+  const float tMin = 0.001f;
+  unsigned int stack[64];
+  unsigned int stackSize = 0;
+  stack[stackSize++] = 0;
+
+  while (stackSize > 0) {
+    const BVHNode &node = _nodes[stack[--stackSize]];
+    stats.nodeVisits++;
+
+    if (node.numObjects != 0) {
+      for (unsigned int i = node.leftFirst;
+           i < node.leftFirst + node.numObjects; i++) {
+        stats.objectTests++;
+        float t;
+        if (intersectObject(ray, objects[i], vertices, tMin, closest, t)) {
+          closest = t;
+        }
+      }
+      continue;
+    }
+
+    // Push the closer child last so that it is visited first
+    const BVHNode &left = _nodes[node.leftFirst];
+    const BVHNode &right = _nodes[node.leftFirst + 1];
+    glm::vec2 leftIntersect = intersectAABB(ray, left.aabbMin, left.aabbMax);
+    glm::vec2 rightIntersect =
+        intersectAABB(ray, right.aabbMin, right.aabbMax);
+    stats.boxTests += 2;
+    bool hitLeft = leftIntersect.x <= leftIntersect.y &&
+                   leftIntersect.x < closest && leftIntersect.y > 0.0f;
+    bool hitRight = rightIntersect.x <= rightIntersect.y &&
+                    rightIntersect.x < closest && rightIntersect.y > 0.0f;
+
+    bool leftFirst = leftIntersect.x < rightIntersect.x;
+    if (hitLeft && hitRight && stackSize + 2 <= 64) {
+      stack[stackSize++] = leftFirst ? node.leftFirst + 1 : node.leftFirst;
+      stack[stackSize++] = leftFirst ? node.leftFirst : node.leftFirst + 1;
+    } else if (hitLeft && stackSize < 64) {
+      stack[stackSize++] = node.leftFirst;
+    } else if (hitRight && stackSize < 64) {
+      stack[stackSize++] = node.leftFirst + 1;
+    }
+  }
+
+  return closest;
+}
+
+BVHStats BVH::getStats(const std::vector<Vertex> &vertices) const {
+  BVHStats stats;
+  if (_nodes.empty()) {
+    return stats;
+  }
+
+  stats.sahCost = getSAHCost();
+  stats.numNodes = _nodesUsed;
+  stats.numObjects = _objects.size();
+  stats.memoryBytes =
+      _nodesUsed * sizeof(BVHNode) + _objects.size() * sizeof(GpuObject);
+
+  AABB root{_nodes[0].aabbMin, _nodes[0].aabbMax};
+  float rootArea = root.surfaceArea();
+
+  stats.minDepth = UINT32_MAX;
+  size_t depthSum = 0;
+  std::vector<std::pair<unsigned int, unsigned int>> stack = {{0, 0}};
+  while (!stack.empty()) {
+    auto [nodeIndex, depth] = stack.back();
+    stack.pop_back();
+    const BVHNode &node = _nodes[nodeIndex];
+
+    if (node.numObjects != 0) {
+      stats.numLeaves++;
+      stats.minDepth = std::min(stats.minDepth, depth);
+      stats.maxDepth = std::max(stats.maxDepth, depth);
+      depthSum += depth;
+      size_t bucket = std::min<size_t>(node.numObjects,
+                                       BVHStats::LEAF_HISTOGRAM_SIZE) - 1;
+      stats.leafSizes[bucket]++;
+      continue;
+    }
+
+    const BVHNode &left = _nodes[node.leftFirst];
+    const BVHNode &right = _nodes[node.leftFirst + 1];
+    AABB overlap{glm::max(left.aabbMin, right.aabbMin),
+                 glm::min(left.aabbMax, right.aabbMax)};
+    if (!overlap.empty() && rootArea > 0.0f) {
+      stats.overlap += overlap.surfaceArea() / rootArea;
+    }
+
+    stack.push_back({node.leftFirst, depth + 1});
+    stack.push_back({node.leftFirst + 1, depth + 1});
+  }
+  stats.avgDepth = float(depthSum) / stats.numLeaves;
+
+  // Pick surface points in proportion to area, seeded so the estimate only
+  // changes with the tree
+  std::vector<float> areas;
+  float totalArea = 0.0f;
+  for (const auto &object : _objects) {
+    float area = 0.0f;
+    if (object.type == ObjectType::Face) {
+      glm::vec3 v0 = vertices[object.data.x].position;
+      glm::vec3 v1 = vertices[object.data.y].position;
+      glm::vec3 v2 = vertices[object.data.z].position;
+      area = 0.5f * glm::length(glm::cross(v1 - v0, v2 - v0));
+    } else if (object.type == ObjectType::Sphere) {
+      float radius = object.getSphere().w;
+      area = 4.0f * glm::pi<float>() * radius * radius;
+    }
+    totalArea += area;
+    areas.push_back(totalArea);
+  }
+  if (totalArea <= 0.0f) {
+    return stats;
+  }
+
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+  float epsilon = 1e-5f * glm::length(root.max - root.min);
+  float cost = 0.0f;
+  for (unsigned int sample = 0; sample < EPO_SAMPLES; sample++) {
+    size_t index =
+        std::lower_bound(areas.begin(), areas.end(), uniform(rng) * totalArea) -
+        areas.begin();
+    const GpuObject &object = _objects[std::min(index, areas.size() - 1)];
+
+    glm::vec3 point;
+    float u = uniform(rng);
+    float v = uniform(rng);
+    if (object.type == ObjectType::Face) {
+      // Folding the unit square keeps the points uniform over the triangle
+      if (u + v > 1.0f) {
+        u = 1.0f - u;
+        v = 1.0f - v;
+      }
+      glm::vec3 v0 = vertices[object.data.x].position;
+      glm::vec3 v1 = vertices[object.data.y].position;
+      glm::vec3 v2 = vertices[object.data.z].position;
+      point = v0 + u * (v1 - v0) + v * (v2 - v0);
+    } else {
+      float z = 1.0f - 2.0f * u;
+      float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+      float phi = 2.0f * glm::pi<float>() * v;
+      glm::vec4 sphere = object.getSphere();
+      point = glm::vec3(sphere) +
+              sphere.w * glm::vec3(r * std::cos(phi), r * std::sin(phi), z);
+    }
+
+    addOverlapCost(0, point, object, epsilon, cost);
+  }
+  stats.epo = cost / EPO_SAMPLES;
+
+  return stats;
+}
+
+bool BVH::addOverlapCost(unsigned int nodeIndex, const glm::vec3 &point,
+                         const GpuObject &object, float epsilon,
+                         float &cost) const {
+  const BVHNode &node = _nodes[nodeIndex];
+  if (glm::any(glm::lessThan(point, node.aabbMin - epsilon)) ||
+      glm::any(glm::greaterThan(point, node.aabbMax + epsilon))) {
+    return false;
+  }
+
+  // Objects are compared by value since SBVH leaves hold copies
+  bool holdsObject = false;
+  if (node.numObjects != 0) {
+    for (unsigned int i = node.leftFirst; i < node.leftFirst + node.numObjects;
+         i++) {
+      holdsObject |= _objects[i].type == object.type &&
+                     _objects[i].data == object.data;
+    }
+    if (!holdsObject) {
+      cost += node.numObjects * _settings.intersectionCost;
+    }
+    return holdsObject;
+  }
+
+  // Both sides count, even after the object is found
+  holdsObject |=
+      addOverlapCost(node.leftFirst, point, object, epsilon, cost);
+  holdsObject |=
+      addOverlapCost(node.leftFirst + 1, point, object, epsilon, cost);
+  if (!holdsObject) {
+    cost += _settings.traversalCost;
+  }
+  return holdsObject;
+}
+
 AABB BVH::getAABB(const GpuObject &object,
                   const std::vector<Vertex> &vertices) const {
   if (object.type == ObjectType::Face) {
@@ -159,8 +1766,9 @@ AABB BVH::getAABB(const GpuObject &object,
     glm::vec3 max = glm::max(v0, glm::max(v1, v2));
     return {min, max};
   } else /*  if (object.type == GpuObjectType::Sphere) */ {
-    glm::vec3 radius = glm::vec3(object.data.w);
-    glm::vec3 center = glm::vec3(object.data.x, object.data.y, object.data.z);
+    glm::vec4 sphere = object.getSphere();
+    glm::vec3 radius = glm::vec3(sphere.w);
+    glm::vec3 center = glm::vec3(sphere);
     return {center - radius, center + radius};
   }
 }
@@ -173,42 +1781,216 @@ glm::vec3 BVH::getCentroid(const GpuObject &object,
     glm::vec3 v2 = vertices[object.data.z].position;
     return (v0 + v1 + v2) / 3.0f;
   } else /*  if (object.type == GpuObjectType::Sphere) */ {
-    return glm::vec3(object.data.x, object.data.y, object.data.z);
-  }
-}
-
-std::vector<GpuObject> BVH::getGpuObjects() const {
-  // Convert from bvh to gpu
-  std::vector<GpuObject> gpuObjects(_objects.size());
-  for (int i = 0; i < _objects.size(); i++) {
-    const auto &bvhObject = _objects[i];
-    gpuObjects[i] = bvhObject;
-  }
-  return gpuObjects;
-}
-
-std::ostream &operator<<(std::ostream &os, const BVH &bvh) {
-  std::cout << "sizeof(BVHNode): " << sizeof(BVHNode) << "\n";
-  for (int i = 0; i < bvh._nodes.size(); i++) {
-    os << "Node " << i << ":\n";
-    os << "  aabbMin: " << bvh._nodes[i].aabbMin.x << " "
-       << bvh._nodes[i].aabbMin.y << " " << bvh._nodes[i].aabbMin.z << "\n";
-    os << "  aabbMax: " << bvh._nodes[i].aabbMax.x << " "
-       << bvh._nodes[i].aabbMax.y << " " << bvh._nodes[i].aabbMax.z << "\n";
-    os << "  leftFirst: " << bvh._nodes[i].leftFirst << "\n";
-    os << "  numObjects: " << bvh._nodes[i].numObjects << "\n";
-    for (int j = bvh._nodes[i].leftFirst;
-         j < bvh._nodes[i].leftFirst + bvh._nodes[i].numObjects; j++) {
-      os << "    Object " << j << ":\n";
-      if (bvh._objects[j].type == ObjectType::Face) {
-        os << "      Face: " << bvh._objects[j].data.x << " "
-           << bvh._objects[j].data.y << " " << bvh._objects[j].data.z << "\n";
-      } else {
-        os << "      Sphere: " << bvh._objects[j].data.x << " "
-           << bvh._objects[j].data.y << " " << bvh._objects[j].data.z << " "
-           << bvh._objects[j].data.w << "\n";
-      }
+    return glm::vec3(object.getSphere());
+  }
+}
+
+namespace {
+// Start of a saved tree, followed by the nodes and then the objects
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t nodeSize;
+  uint32_t objectSize;
+  uint32_t buildMode;
+  uint64_t key;
+  uint64_t numNodes;
+  uint64_t numObjects;
+  uint8_t padding[16]; // Keeps the nodes 32 byte aligned in the file
+};
+static_assert(sizeof(FileHeader) % alignof(BVHNode) == 0);
+
+// What the arena held for each object, in object order after the objects,
+// so refit and edits work on a loaded tree like on a built one
+struct FileObjectBounds {
+  glm::vec3 min;
+  glm::vec3 max;
+  glm::vec3 centroid;
+};
+
+constexpr char FILE_MAGIC[8] = {'R', 'T', 'B', 'V', 'H', '\0', '\0', '\0'};
+
+// FNV-1a over 32 bit words
+struct Hasher {
+  uint64_t hash = 14695981039346656037ull;
+
+  void add(uint32_t word) { hash = (hash ^ word) * 1099511628211ull; }
+  void add(float value) {
+    uint32_t word;
+    std::memcpy(&word, &value, sizeof(word));
+    add(word);
+  }
+  void add(int value) { add(static_cast<uint32_t>(value)); }
+  void add(uint64_t value) {
+    add(static_cast<uint32_t>(value));
+    add(static_cast<uint32_t>(value >> 32));
+  }
+  void add(const glm::uvec4 &value) {
+    for (int i = 0; i < 4; i++) {
+      add(value[i]);
+    }
+  }
+};
+} // namespace
+
+uint64_t BVH::getCacheKey(const std::vector<GpuObject> &gpuObjects,
+                          const std::vector<Vertex> &vertices, BuildMode mode,
+                          const BuildSettings &settings, uint64_t extra) {
+  Hasher hasher;
+  hasher.add(FILE_VERSION);
+  hasher.add(static_cast<uint32_t>(mode));
+  hasher.add(settings.binCount);
+  hasher.add(settings.leafSize);
+  hasher.add(settings.sweepThreshold);
+  hasher.add(settings.traversalCost);
+  hasher.add(settings.intersectionCost);
+  hasher.add(extra);
+
+  // Everything of an object ends up in the saved copy, but only the
+  // positions of the vertices shape the tree
+  hasher.add(static_cast<uint64_t>(gpuObjects.size()));
+  for (const auto &object : gpuObjects) {
+    hasher.add(object.data);
+    hasher.add(static_cast<uint32_t>(object.type));
+    hasher.add(object.materialIdx);
+    hasher.add(object.textureIndices.x);
+    hasher.add(object.textureIndices.y);
+  }
+  hasher.add(static_cast<uint64_t>(vertices.size()));
+  for (const auto &vertex : vertices) {
+    hasher.add(vertex.position.x);
+    hasher.add(vertex.position.y);
+    hasher.add(vertex.position.z);
+  }
+  return hasher.hash;
+}
+
+bool BVH::save(const std::string &path, uint64_t key) const {
+  FileHeader header{};
+  std::memcpy(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC));
+  header.version = FILE_VERSION;
+  header.nodeSize = sizeof(BVHNode);
+  header.objectSize = sizeof(GpuObject);
+  header.buildMode = static_cast<uint32_t>(_buildMode);
+  header.key = key;
+  header.numNodes = _nodesUsed;
+  header.numObjects = _objects.size();
+
+  // Written next to the target and renamed over it, so a reader never sees
+  // half a file
+  std::error_code error;
+  std::filesystem::path target(path);
+  if (target.has_parent_path()) {
+    std::filesystem::create_directories(target.parent_path(), error);
+  }
+  std::string tempPath = path + ".tmp";
+  {
+    std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+      return false;
+    }
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(_nodes.data()),
+               _nodesUsed * sizeof(BVHNode));
+    file.write(reinterpret_cast<const char *>(_objects.data()),
+               _objects.size() * sizeof(GpuObject));
+    std::vector<FileObjectBounds> bounds(_objects.size());
+    for (size_t i = 0; i < bounds.size(); i++) {
+      uint32_t slot = _arena.indices[i];
+      AABB aabb = _arena.getBounds(slot);
+      bounds[i] = {aabb.min, aabb.max, _arena.getCentroid(slot)};
+    }
+    file.write(reinterpret_cast<const char *>(bounds.data()),
+               bounds.size() * sizeof(FileObjectBounds));
+    if (!file) {
+      file.close();
+      std::filesystem::remove(tempPath, error);
+      return false;
     }
   }
-  return os;
+  std::filesystem::rename(tempPath, target, error);
+  if (error) {
+    std::filesystem::remove(tempPath, error);
+    return false;
+  }
+  return true;
+}
+
+bool BVH::load(const std::string &path, uint64_t key) {
+  auto start = std::chrono::high_resolution_clock::now();
+
+  MappedFile file(path);
+  if (!file.isOpen() || file.size() < sizeof(FileHeader)) {
+    return false;
+  }
+  FileHeader header;
+  std::memcpy(&header, file.data(), sizeof(header));
+  if (std::memcmp(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC)) != 0 ||
+      header.version != FILE_VERSION || header.nodeSize != sizeof(BVHNode) ||
+      header.objectSize != sizeof(GpuObject) || header.key != key ||
+      header.numNodes == 0 || header.numNodes > file.size() ||
+      header.numObjects > file.size() ||
+      file.size() != sizeof(FileHeader) +
+                         header.numNodes * sizeof(BVHNode) +
+                         header.numObjects *
+                             (sizeof(GpuObject) + sizeof(FileObjectBounds))) {
+    return false;
+  }
+
+  const unsigned char *nodes = file.data() + sizeof(FileHeader);
+  const unsigned char *objects = nodes + header.numNodes * sizeof(BVHNode);
+  const unsigned char *bounds =
+      objects + header.numObjects * sizeof(GpuObject);
+  _nodes.resize(header.numNodes);
+  std::memcpy(_nodes.data(), nodes, header.numNodes * sizeof(BVHNode));
+  _objects.resize(header.numObjects);
+  std::memcpy(_objects.data(), objects,
+              header.numObjects * sizeof(GpuObject));
+  _nodesUsed = header.numNodes;
+  _buildMode = static_cast<BuildMode>(header.buildMode);
+  _parents.clear();
+  _objectLeaves.clear();
+  _freeObjects.clear();
+
+  // Like after SBVH, each object keeps the slot of its leaf position
+  _arena.resize(_objects.size());
+  for (uint32_t i = 0; i < _objects.size(); i++) {
+    FileObjectBounds objectBounds;
+    std::memcpy(&objectBounds, bounds + i * sizeof(FileObjectBounds),
+                sizeof(objectBounds));
+    _arena.set(i, {objectBounds.min, objectBounds.max}, objectBounds.centroid);
+    _arena.types[i] = _objects[i].type;
+    _arena.indices[i] = i;
+  }
+
+  _buildTime = std::chrono::duration<float, std::milli>(
+                   std::chrono::high_resolution_clock::now() - start)
+                   .count();
+  return true;
+}
+
+void BVH::setBuildSettings(const BuildSettings &settings) {
+  _settings = settings;
+  _settings.binCount = std::clamp(settings.binCount, 2u, MAX_BIN_COUNT);
+  _settings.leafSize = std::max(settings.leafSize, 1u);
+  _settings.sweepThreshold =
+      std::min(settings.sweepThreshold, (unsigned int)MAX_SWEEP_OBJECTS);
+  _settings.traversalCost = std::max(settings.traversalCost, 0.0f);
+  _settings.intersectionCost = std::max(settings.intersectionCost, 1e-3f);
+}
+
+std::ostream &operator<<(std::ostream &os, const BVHStats &stats) {
+  os << "  SAH cost: " << stats.sahCost << ", EPO: " << stats.epo
+     << ", sibling overlap: " << stats.overlap << "\n";
+  os << "  Nodes: " << stats.numNodes << ", leaves: " << stats.numLeaves
+     << ", object references: " << stats.numObjects << ", "
+     << stats.memoryBytes / 1024 << "KB\n";
+  os << "  Leaf depth min/avg/max: " << stats.minDepth << "/"
+     << stats.avgDepth << "/" << stats.maxDepth << "\n";
+  os << "  Leaf sizes:";
+  for (size_t i = 0; i < stats.leafSizes.size(); i++) {
+    os << " " << i + 1 << (i + 1 == stats.leafSizes.size() ? "+" : "")
+       << ":" << stats.leafSizes[i];
+  }
+  return os << "\n";
 }
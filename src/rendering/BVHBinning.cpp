@@ -0,0 +1,490 @@
+#include "rendering/BVHBinning.hpp"
+
+#include <algorithm>
+#include <atomic>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define BVH_BINNING_X86
+#include <immintrin.h>
+// Shared by the SSE and AVX2 kernels. Inlining compiles them with the
+// caller's encoding, calling legacy SSE code from AVX code stalls
+#define SIMD_INLINE inline __attribute__((always_inline))
+#endif
+
+namespace {
+std::atomic<SimdLevel> g_simdLevel{getSupportedSimdLevel()};
+
+glm::vec3 getBinScale(const AABB &centroidBounds, unsigned int binCount) {
+  glm::vec3 scale;
+  for (int axis = 0; axis < 3; axis++) {
+    float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+    scale[axis] = extent > 0.0f ? binCount / extent : 0.0f;
+  }
+  return scale;
+}
+
+AABB getCentroidBoundsScalar(const BVHBuildArena &arena,
+                             const uint32_t *indices, unsigned int count) {
+  AABB bounds;
+  for (unsigned int i = 0; i < count; i++) {
+    bounds.extend(arena.getCentroid(indices[i]));
+  }
+  return bounds;
+}
+
+void binObjectsScalar(const BVHBuildArena &arena, const uint32_t *indices,
+                      unsigned int count, const AABB &centroidBounds,
+                      unsigned int binCount, Bin *bins) {
+  std::fill(bins, bins + 3 * binCount, Bin{});
+  glm::vec3 scale = getBinScale(centroidBounds, binCount);
+  for (unsigned int i = 0; i < count; i++) {
+    uint32_t slot = indices[i];
+    AABB aabb = arena.getBounds(slot);
+    for (int axis = 0; axis < 3; axis++) {
+      unsigned int bin = std::min(
+          binCount - 1,
+          (unsigned int)((arena.centroids[axis][slot] -
+                          centroidBounds.min[axis]) *
+                         scale[axis]));
+      bins[axis * binCount + bin].aabb.extend(aabb);
+      bins[axis * binCount + bin].numObjects++;
+    }
+  }
+}
+
+void sweepBinsScalar(const Bin *bins, unsigned int binCount, float *costs) {
+  float leftArea[MAX_BIN_COUNT - 1], rightArea[MAX_BIN_COUNT - 1];
+  int leftCount[MAX_BIN_COUNT - 1], rightCount[MAX_BIN_COUNT - 1];
+  AABB leftAABB, rightAABB;
+  int leftSum = 0, rightSum = 0;
+  for (unsigned int i = 0; i < binCount - 1; i++) {
+    leftSum += bins[i].numObjects;
+    leftCount[i] = leftSum;
+    leftAABB.extend(bins[i].aabb);
+    leftArea[i] = leftAABB.surfaceArea();
+
+    rightSum += bins[binCount - 1 - i].numObjects;
+    rightCount[binCount - 2 - i] = rightSum;
+    rightAABB.extend(bins[binCount - 1 - i].aabb);
+    rightArea[binCount - 2 - i] = rightAABB.surfaceArea();
+  }
+
+  for (unsigned int i = 0; i < binCount - 1; i++) {
+    costs[i] = leftArea[i] * leftCount[i] + rightArea[i] * rightCount[i];
+  }
+}
+
+#ifdef BVH_BINNING_X86
+// Bins kept as whole registers, the fourth lane is unused
+struct SimdBins {
+  __m128 min[3 * MAX_BIN_COUNT];
+  __m128 max[3 * MAX_BIN_COUNT];
+  unsigned int numObjects[3 * MAX_BIN_COUNT];
+
+  SIMD_INLINE void clear(unsigned int binCount) {
+    for (unsigned int i = 0; i < 3 * binCount; i++) {
+      min[i] = _mm_set1_ps(INFINITY);
+      max[i] = _mm_set1_ps(-INFINITY);
+      numObjects[i] = 0;
+    }
+  }
+
+  SIMD_INLINE void store(Bin *bins, unsigned int binCount) const {
+    for (unsigned int i = 0; i < 3 * binCount; i++) {
+      alignas(16) float lo[4], hi[4];
+      _mm_store_ps(lo, min[i]);
+      _mm_store_ps(hi, max[i]);
+      bins[i].aabb = {{lo[0], lo[1], lo[2]}, {hi[0], hi[1], hi[2]}};
+      bins[i].numObjects = numObjects[i];
+    }
+  }
+
+  // The three bins an object falls into, one per axis
+  SIMD_INLINE void add(const int *bin, unsigned int binCount, __m128 aabbMin,
+           __m128 aabbMax) {
+    for (int axis = 0; axis < 3; axis++) {
+      unsigned int k = axis * binCount + bin[axis];
+      min[k] = _mm_min_ps(min[k], aabbMin);
+      max[k] = _mm_max_ps(max[k], aabbMax);
+      numObjects[k]++;
+    }
+  }
+};
+
+SIMD_INLINE __m128 loadCentroid(const BVHBuildArena &arena, uint32_t slot) {
+  return _mm_setr_ps(arena.centroids[0][slot], arena.centroids[1][slot],
+                     arena.centroids[2][slot], 0.0f);
+}
+
+SIMD_INLINE __m128 loadBoundsMin(const BVHBuildArena &arena, uint32_t slot) {
+  return _mm_setr_ps(arena.boundsMin[0][slot], arena.boundsMin[1][slot],
+                     arena.boundsMin[2][slot], 0.0f);
+}
+
+SIMD_INLINE __m128 loadBoundsMax(const BVHBuildArena &arena, uint32_t slot) {
+  return _mm_setr_ps(arena.boundsMax[0][slot], arena.boundsMax[1][slot],
+                     arena.boundsMax[2][slot], 0.0f);
+}
+
+SIMD_INLINE AABB toAABB(__m128 min, __m128 max) {
+  alignas(16) float lo[4], hi[4];
+  _mm_store_ps(lo, min);
+  _mm_store_ps(hi, max);
+  return {{lo[0], lo[1], lo[2]}, {hi[0], hi[1], hi[2]}};
+}
+
+AABB getCentroidBoundsSSE(const BVHBuildArena &arena, const uint32_t *indices,
+                          unsigned int count) {
+  __m128 min = _mm_set1_ps(INFINITY);
+  __m128 max = _mm_set1_ps(-INFINITY);
+  for (unsigned int i = 0; i < count; i++) {
+    __m128 centroid = loadCentroid(arena, indices[i]);
+    min = _mm_min_ps(min, centroid);
+    max = _mm_max_ps(max, centroid);
+  }
+  return toAABB(min, max);
+}
+
+// Bins the objects in [begin, count) one at a time, all axes at once.
+// Clamping before truncating gives the same bin as the scalar code, the
+// offsets are never negative
+SIMD_INLINE void
+binObjectsSSE(const BVHBuildArena &arena, const uint32_t *indices,
+                   unsigned int begin, unsigned int count, __m128 origin,
+                   __m128 scale, unsigned int binCount, SimdBins &bins) {
+  __m128 lastBin = _mm_set1_ps(float(binCount - 1));
+  for (unsigned int i = begin; i < count; i++) {
+    uint32_t slot = indices[i];
+    __m128 offset = _mm_mul_ps(_mm_sub_ps(loadCentroid(arena, slot), origin),
+                               scale);
+    alignas(16) int bin[4];
+    _mm_store_si128(reinterpret_cast<__m128i *>(bin),
+                    _mm_cvttps_epi32(_mm_min_ps(offset, lastBin)));
+
+    bins.add(bin, binCount, loadBoundsMin(arena, slot),
+             loadBoundsMax(arena, slot));
+  }
+}
+
+void binObjectsSSE(const BVHBuildArena &arena, const uint32_t *indices,
+                   unsigned int count, const AABB &centroidBounds,
+                   unsigned int binCount, Bin *bins) {
+  glm::vec3 scale = getBinScale(centroidBounds, binCount);
+  SimdBins simdBins;
+  simdBins.clear(binCount);
+  binObjectsSSE(arena, indices, 0, count,
+                _mm_setr_ps(centroidBounds.min.x, centroidBounds.min.y,
+                            centroidBounds.min.z, 0.0f),
+                _mm_setr_ps(scale.x, scale.y, scale.z, 0.0f), binCount,
+                simdBins);
+  simdBins.store(bins, binCount);
+}
+
+// Running bounds from one end, written out one array per axis so the areas
+// can be computed several splits at a time
+SIMD_INLINE void sweepExtents(const Bin *bins, unsigned int binCount, bool fromLeft,
+                  float *extentX, float *extentY, float *extentZ,
+                  float *counts) {
+  __m128 min = _mm_set1_ps(INFINITY);
+  __m128 max = _mm_set1_ps(-INFINITY);
+  int sum = 0;
+  for (unsigned int i = 0; i < binCount - 1; i++) {
+    const Bin &bin = bins[fromLeft ? i : binCount - 1 - i];
+    min = _mm_min_ps(min, _mm_setr_ps(bin.aabb.min.x, bin.aabb.min.y,
+                                      bin.aabb.min.z, 0.0f));
+    max = _mm_max_ps(max, _mm_setr_ps(bin.aabb.max.x, bin.aabb.max.y,
+                                      bin.aabb.max.z, 0.0f));
+    sum += bin.numObjects;
+
+    alignas(16) float extent[4];
+    _mm_store_ps(extent, _mm_sub_ps(max, min));
+    unsigned int split = fromLeft ? i : binCount - 2 - i;
+    extentX[split] = extent[0];
+    extentY[split] = extent[1];
+    extentZ[split] = extent[2];
+    counts[split] = float(sum);
+  }
+}
+
+// Area weighted by count of the splits [begin, end) with the same operation
+// order as AABB::surfaceArea
+SIMD_INLINE void sweepCostsScalar(const float *const *left, const float *const *right,
+                      unsigned int begin, unsigned int end, float *costs) {
+  for (unsigned int i = begin; i < end; i++) {
+    float leftArea = left[0][i] * left[1][i] + left[1][i] * left[2][i] +
+                     left[2][i] * left[0][i];
+    float rightArea = right[0][i] * right[1][i] + right[1][i] * right[2][i] +
+                      right[2][i] * right[0][i];
+    costs[i] = leftArea * left[3][i] + rightArea * right[3][i];
+  }
+}
+
+void sweepBinsSSE(const Bin *bins, unsigned int binCount, float *costs) {
+  alignas(16) float left[4][MAX_BIN_COUNT], right[4][MAX_BIN_COUNT];
+  sweepExtents(bins, binCount, true, left[0], left[1], left[2], left[3]);
+  sweepExtents(bins, binCount, false, right[0], right[1], right[2],
+               right[3]);
+
+  unsigned int numSplits = binCount - 1;
+  unsigned int i = 0;
+  for (; i + 4 <= numSplits; i += 4) {
+    __m128 lx = _mm_load_ps(&left[0][i]), ly = _mm_load_ps(&left[1][i]),
+           lz = _mm_load_ps(&left[2][i]);
+    __m128 rx = _mm_load_ps(&right[0][i]), ry = _mm_load_ps(&right[1][i]),
+           rz = _mm_load_ps(&right[2][i]);
+    __m128 leftArea = _mm_add_ps(
+        _mm_add_ps(_mm_mul_ps(lx, ly), _mm_mul_ps(ly, lz)), _mm_mul_ps(lz, lx));
+    __m128 rightArea = _mm_add_ps(
+        _mm_add_ps(_mm_mul_ps(rx, ry), _mm_mul_ps(ry, rz)), _mm_mul_ps(rz, rx));
+    _mm_storeu_ps(&costs[i],
+                  _mm_add_ps(_mm_mul_ps(leftArea, _mm_load_ps(&left[3][i])),
+                             _mm_mul_ps(rightArea, _mm_load_ps(&right[3][i]))));
+  }
+
+  const float *leftAxes[] = {left[0], left[1], left[2], left[3]};
+  const float *rightAxes[] = {right[0], right[1], right[2], right[3]};
+  sweepCostsScalar(leftAxes, rightAxes, i, numSplits, costs);
+}
+
+// Smallest and largest of the eight lanes
+__attribute__((target("avx2"))) SIMD_INLINE float
+reduceMin(__m256 value) {
+  __m128 half = _mm_min_ps(_mm256_castps256_ps128(value),
+                           _mm256_extractf128_ps(value, 1));
+  half = _mm_min_ps(half, _mm_movehl_ps(half, half));
+  return _mm_cvtss_f32(_mm_min_ss(half, _mm_shuffle_ps(half, half, 1)));
+}
+
+__attribute__((target("avx2"))) SIMD_INLINE float
+reduceMax(__m256 value) {
+  __m128 half = _mm_max_ps(_mm256_castps256_ps128(value),
+                           _mm256_extractf128_ps(value, 1));
+  half = _mm_max_ps(half, _mm_movehl_ps(half, half));
+  return _mm_cvtss_f32(_mm_max_ss(half, _mm_shuffle_ps(half, half, 1)));
+}
+
+__attribute__((target("avx2"))) AABB
+getCentroidBoundsAVX2(const BVHBuildArena &arena, const uint32_t *indices,
+                      unsigned int count) {
+  __m256 min[3], max[3];
+  for (int axis = 0; axis < 3; axis++) {
+    min[axis] = _mm256_set1_ps(INFINITY);
+    max[axis] = _mm256_set1_ps(-INFINITY);
+  }
+
+  unsigned int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i slots =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&indices[i]));
+    for (int axis = 0; axis < 3; axis++) {
+      __m256 centroid =
+          _mm256_i32gather_ps(arena.centroids[axis].data(), slots, 4);
+      min[axis] = _mm256_min_ps(min[axis], centroid);
+      max[axis] = _mm256_max_ps(max[axis], centroid);
+    }
+  }
+
+  __m128 tailMin = _mm_setr_ps(reduceMin(min[0]), reduceMin(min[1]),
+                               reduceMin(min[2]), 0.0f);
+  __m128 tailMax = _mm_setr_ps(reduceMax(max[0]), reduceMax(max[1]),
+                               reduceMax(max[2]), 0.0f);
+  for (; i < count; i++) {
+    __m128 centroid = loadCentroid(arena, indices[i]);
+    tailMin = _mm_min_ps(tailMin, centroid);
+    tailMax = _mm_max_ps(tailMax, centroid);
+  }
+  return toAABB(tailMin, tailMax);
+}
+
+// Bins kept as min and negated max in one register, so one min updates both
+__attribute__((target("avx2"))) SIMD_INLINE void
+addToWideBins(const BVHBuildArena &arena, uint32_t slot, const int *bin,
+              unsigned int binCount, __m256 *binBounds,
+              unsigned int *binObjects) {
+  __m256 bounds = _mm256_setr_ps(
+      arena.boundsMin[0][slot], arena.boundsMin[1][slot],
+      arena.boundsMin[2][slot], 0.0f, -arena.boundsMax[0][slot],
+      -arena.boundsMax[1][slot], -arena.boundsMax[2][slot], 0.0f);
+  for (int axis = 0; axis < 3; axis++) {
+    unsigned int k = axis * binCount + bin[axis];
+    binBounds[k] = _mm256_min_ps(binBounds[k], bounds);
+    binObjects[k]++;
+  }
+}
+
+// Gathers eight centroids at a time and finds their bins on all three axes
+// with a few vector instructions. The bins are updated one object at a time,
+// objects landing in the same bin would collide otherwise
+__attribute__((target("avx2"))) void
+binObjectsAVX2(const BVHBuildArena &arena, const uint32_t *indices,
+               unsigned int count, const AABB &centroidBounds,
+               unsigned int binCount, Bin *bins) {
+  glm::vec3 scale = getBinScale(centroidBounds, binCount);
+  __m256 binBounds[3 * MAX_BIN_COUNT];
+  unsigned int binObjects[3 * MAX_BIN_COUNT];
+  for (unsigned int k = 0; k < 3 * binCount; k++) {
+    binBounds[k] = _mm256_set1_ps(INFINITY);
+    binObjects[k] = 0;
+  }
+
+  __m256 lastBin = _mm256_set1_ps(float(binCount - 1));
+  unsigned int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i slots =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&indices[i]));
+
+    alignas(32) int bin[3][8];
+    for (int axis = 0; axis < 3; axis++) {
+      __m256 centroid =
+          _mm256_i32gather_ps(arena.centroids[axis].data(), slots, 4);
+      __m256 offset = _mm256_mul_ps(
+          _mm256_sub_ps(centroid, _mm256_set1_ps(centroidBounds.min[axis])),
+          _mm256_set1_ps(scale[axis]));
+      _mm256_store_si256(reinterpret_cast<__m256i *>(bin[axis]),
+                         _mm256_cvttps_epi32(_mm256_min_ps(offset, lastBin)));
+    }
+
+    for (int lane = 0; lane < 8; lane++) {
+      int objectBin[3] = {bin[0][lane], bin[1][lane], bin[2][lane]};
+      addToWideBins(arena, indices[i + lane], objectBin, binCount, binBounds,
+                    binObjects);
+    }
+  }
+
+  __m128 origin = _mm_setr_ps(centroidBounds.min.x, centroidBounds.min.y,
+                              centroidBounds.min.z, 0.0f);
+  __m128 scale4 = _mm_setr_ps(scale.x, scale.y, scale.z, 0.0f);
+  __m128 lastBin4 = _mm_set1_ps(float(binCount - 1));
+  for (; i < count; i++) {
+    __m128 offset = _mm_mul_ps(
+        _mm_sub_ps(loadCentroid(arena, indices[i]), origin), scale4);
+    alignas(16) int bin[4];
+    _mm_store_si128(reinterpret_cast<__m128i *>(bin),
+                    _mm_cvttps_epi32(_mm_min_ps(offset, lastBin4)));
+    addToWideBins(arena, indices[i], bin, binCount, binBounds, binObjects);
+  }
+
+  for (unsigned int k = 0; k < 3 * binCount; k++) {
+    alignas(32) float value[8];
+    _mm256_store_ps(value, binBounds[k]);
+    bins[k].aabb = {{value[0], value[1], value[2]},
+                    {-value[4], -value[5], -value[6]}};
+    bins[k].numObjects = binObjects[k];
+  }
+}
+
+__attribute__((target("avx2"))) void
+sweepBinsAVX2(const Bin *bins, unsigned int binCount, float *costs) {
+  alignas(32) float left[4][MAX_BIN_COUNT], right[4][MAX_BIN_COUNT];
+  sweepExtents(bins, binCount, true, left[0], left[1], left[2], left[3]);
+  sweepExtents(bins, binCount, false, right[0], right[1], right[2],
+               right[3]);
+
+  unsigned int numSplits = binCount - 1;
+  unsigned int i = 0;
+  for (; i + 8 <= numSplits; i += 8) {
+    __m256 lx = _mm256_load_ps(&left[0][i]), ly = _mm256_load_ps(&left[1][i]),
+           lz = _mm256_load_ps(&left[2][i]);
+    __m256 rx = _mm256_load_ps(&right[0][i]),
+           ry = _mm256_load_ps(&right[1][i]),
+           rz = _mm256_load_ps(&right[2][i]);
+    __m256 leftArea = _mm256_add_ps(
+        _mm256_add_ps(_mm256_mul_ps(lx, ly), _mm256_mul_ps(ly, lz)),
+        _mm256_mul_ps(lz, lx));
+    __m256 rightArea = _mm256_add_ps(
+        _mm256_add_ps(_mm256_mul_ps(rx, ry), _mm256_mul_ps(ry, rz)),
+        _mm256_mul_ps(rz, rx));
+    _mm256_storeu_ps(
+        &costs[i],
+        _mm256_add_ps(_mm256_mul_ps(leftArea, _mm256_load_ps(&left[3][i])),
+                      _mm256_mul_ps(rightArea, _mm256_load_ps(&right[3][i]))));
+  }
+
+  const float *leftAxes[] = {left[0], left[1], left[2], left[3]};
+  const float *rightAxes[] = {right[0], right[1], right[2], right[3]};
+  sweepCostsScalar(leftAxes, rightAxes, i, numSplits, costs);
+}
+#endif
+} // namespace
+
+SimdLevel getSupportedSimdLevel() {
+#ifdef BVH_BINNING_X86
+  static const SimdLevel level = [] {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      return SimdLevel::AVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+      return SimdLevel::SSE;
+    }
+    return SimdLevel::Scalar;
+  }();
+  return level;
+#else
+  return SimdLevel::Scalar;
+#endif
+}
+
+SimdLevel getSimdLevel() { return g_simdLevel; }
+
+void setSimdLevel(SimdLevel level) {
+  g_simdLevel = std::min(level, getSupportedSimdLevel());
+}
+
+const char *getSimdLevelName(SimdLevel level) {
+  switch (level) {
+  case SimdLevel::AVX2:
+    return "AVX2";
+  case SimdLevel::SSE:
+    return "SSE";
+  default:
+    return "Scalar";
+  }
+}
+
+AABB getCentroidBounds(const BVHBuildArena &arena, const uint32_t *indices,
+                       unsigned int count) {
+#ifdef BVH_BINNING_X86
+  switch (getSimdLevel()) {
+  case SimdLevel::AVX2:
+    return getCentroidBoundsAVX2(arena, indices, count);
+  case SimdLevel::SSE:
+    return getCentroidBoundsSSE(arena, indices, count);
+  default:
+    break;
+  }
+#endif
+  return getCentroidBoundsScalar(arena, indices, count);
+}
+
+void binObjects(const BVHBuildArena &arena, const uint32_t *indices,
+                unsigned int count, const AABB &centroidBounds,
+                unsigned int binCount, Bin *bins) {
+#ifdef BVH_BINNING_X86
+  switch (getSimdLevel()) {
+  case SimdLevel::AVX2:
+    return binObjectsAVX2(arena, indices, count, centroidBounds, binCount,
+                          bins);
+  case SimdLevel::SSE:
+    return binObjectsSSE(arena, indices, count, centroidBounds, binCount,
+                         bins);
+  default:
+    break;
+  }
+#endif
+  binObjectsScalar(arena, indices, count, centroidBounds, binCount, bins);
+}
+
+void sweepBins(const Bin *bins, unsigned int binCount, float *costs) {
+#ifdef BVH_BINNING_X86
+  switch (getSimdLevel()) {
+  case SimdLevel::AVX2:
+    return sweepBinsAVX2(bins, binCount, costs);
+  case SimdLevel::SSE:
+    return sweepBinsSSE(bins, binCount, costs);
+  default:
+    break;
+  }
+#endif
+  sweepBinsScalar(bins, binCount, costs);
+}
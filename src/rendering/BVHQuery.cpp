@@ -0,0 +1,618 @@
+#include "rendering/BVH.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define BVH_QUERY_X86
+#include <immintrin.h>
+#endif
+
+namespace {
+constexpr unsigned int MAX_PACKET_SIZE = 8;
+// Fewer rays are not worth a task of their own
+constexpr unsigned int MIN_RAYS_PER_TASK = 256;
+
+// Pick the same side as _mm_min_ps and _mm_max_ps when one is NaN, so a ray
+// takes the same path through the tree alone as in a packet
+inline float minf(float a, float b) { return a < b ? a : b; }
+inline float maxf(float a, float b) { return a > b ? a : b; }
+
+// Whether the ray enters the box within [tMin, tMax], and at what distance
+bool intersectBox(const glm::vec3 &origin, const glm::vec3 &invDirection,
+                  float tMin, float tMax, const BVHNode &node, float &tNear) {
+  float tFar = 0.0f;
+  for (int axis = 0; axis < 3; axis++) {
+    float t1 = (node.aabbMin[axis] - origin[axis]) * invDirection[axis];
+    float t2 = (node.aabbMax[axis] - origin[axis]) * invDirection[axis];
+    tNear = axis == 0 ? minf(t1, t2) : maxf(tNear, minf(t1, t2));
+    tFar = axis == 0 ? maxf(t1, t2) : minf(tFar, maxf(t1, t2));
+  }
+  return tNear <= tFar && tNear <= tMax && tFar >= tMin;
+}
+
+// Narrows hit to the object if the ray meets it within [tMin, hit.t]
+bool hitObject(const Ray &ray, float tMin, const GpuObject &object,
+               uint32_t objectIdx, const std::vector<Vertex> &vertices,
+               RayHit &hit) {
+  float t;
+  glm::vec2 uv{0.0f};
+  bool found = false;
+  if (object.type == ObjectType::Face) {
+    found = intersectTriangle(ray, vertices[object.data.x].position,
+                              vertices[object.data.y].position,
+                              vertices[object.data.z].position, t,
+                              uv) &&
+            t >= tMin && t <= hit.t;
+  } else if (object.type == ObjectType::Sphere) {
+    found = intersectSphere(ray, object.getSphere(), tMin, hit.t, t);
+  }
+
+  if (found) {
+    hit = {t, uv, objectIdx};
+  }
+  return found;
+}
+
+// Edges from the root to the deepest leaf. Visiting a node pops it and
+// pushes at most its two children, so the traversal stacks never hold more
+// than one node per level and the deepest leaf's sibling, depth + 1 in all
+unsigned int getDepth(const std::vector<BVHNode> &nodes) {
+  if (nodes.empty()) {
+    return 0;
+  }
+  unsigned int depth = 0;
+  std::vector<std::pair<uint32_t, unsigned int>> stack = {{0, 0}};
+  while (!stack.empty()) {
+    auto [nodeIndex, nodeDepth] = stack.back();
+    stack.pop_back();
+    depth = std::max(depth, nodeDepth);
+    const BVHNode &node = nodes[nodeIndex];
+    if (node.numObjects == 0) {
+      stack.push_back({node.leftFirst, nodeDepth + 1});
+      stack.push_back({node.leftFirst + 1, nodeDepth + 1});
+    }
+  }
+  return depth;
+}
+
+// stack and stackNear hold getDepth + 1 entries
+template <bool AnyHit>
+RayHit traceRay(const BVH &bvh, const RayQuery &query,
+                const std::vector<Vertex> &vertices, uint32_t *stack,
+                float *stackNear) {
+  const std::vector<BVHNode> &nodes = bvh.getNodes();
+  const std::vector<GpuObject> &objects = bvh.getGpuObjects();
+  const Ray &ray = query.ray;
+  glm::vec3 invDirection = 1.0f / ray.direction;
+
+  RayHit hit;
+  hit.t = query.tMax;
+  float tNear;
+  if (nodes.empty() || !intersectBox(ray.origin, invDirection, query.tMin,
+                                     hit.t, nodes[0], tNear)) {
+    return hit;
+  }
+
+  // Nodes wait on the stack with their entry distance, the ones a closer
+  // hit found since are skipped
+  unsigned int stackSize = 0;
+  stack[stackSize] = 0;
+  stackNear[stackSize++] = tNear;
+
+  while (stackSize > 0) {
+    stackSize--;
+    if (stackNear[stackSize] > hit.t) {
+      continue;
+    }
+    const BVHNode &node = nodes[stack[stackSize]];
+
+    if (node.numObjects != 0) {
+      for (uint32_t i = node.leftFirst; i < node.leftFirst + node.numObjects;
+           i++) {
+        if (hitObject(ray, query.tMin, objects[i], i, vertices, hit) &&
+            AnyHit) {
+          return hit;
+        }
+      }
+      continue;
+    }
+
+    float leftNear, rightNear;
+    bool hitLeft = intersectBox(ray.origin, invDirection, query.tMin, hit.t,
+                                nodes[node.leftFirst], leftNear);
+    bool hitRight = intersectBox(ray.origin, invDirection, query.tMin, hit.t,
+                                 nodes[node.leftFirst + 1], rightNear);
+
+    // Push the closer child last so that it is visited first
+    bool leftFirst = leftNear < rightNear;
+    if (hitLeft && hitRight) {
+      stack[stackSize] = leftFirst ? node.leftFirst + 1 : node.leftFirst;
+      stackNear[stackSize++] = leftFirst ? rightNear : leftNear;
+      stack[stackSize] = leftFirst ? node.leftFirst : node.leftFirst + 1;
+      stackNear[stackSize++] = leftFirst ? leftNear : rightNear;
+    } else if (hitLeft) {
+      stack[stackSize] = node.leftFirst;
+      stackNear[stackSize++] = leftNear;
+    } else if (hitRight) {
+      stack[stackSize] = node.leftFirst + 1;
+      stackNear[stackSize++] = rightNear;
+    }
+  }
+
+  return hit;
+}
+
+#ifdef BVH_QUERY_X86
+// The rays of a packet, one array per component so the kernels load one
+// component of every ray at once. Lanes past the packet's size are unused
+struct alignas(32) RayPacket {
+  float origin[3][MAX_PACKET_SIZE];
+  float direction[3][MAX_PACKET_SIZE];
+  float invDirection[3][MAX_PACKET_SIZE];
+  float tMin[MAX_PACKET_SIZE];
+  float t[MAX_PACKET_SIZE]; // Closest hit so far, tMax before one is found
+  float u[MAX_PACKET_SIZE];
+  float v[MAX_PACKET_SIZE];
+  uint32_t objectIdx[MAX_PACKET_SIZE];
+
+  Ray getRay(unsigned int lane) const {
+    return {{origin[0][lane], origin[1][lane], origin[2][lane]},
+            {direction[0][lane], direction[1][lane], direction[2][lane]}};
+  }
+};
+
+// A face as Moller-Trumbore takes it, set up once for every lane
+struct Triangle {
+  glm::vec3 v0;
+  glm::vec3 a; // v1 - v0
+  glm::vec3 b; // v2 - v0
+  // Rays more parallel than this to the plane miss, relative to their
+  // length like intersectTriangle does
+  float minDet;
+};
+
+Triangle getTriangle(const GpuObject &object,
+                     const std::vector<Vertex> &vertices) {
+  Triangle triangle;
+  triangle.v0 = vertices[object.data.x].position;
+  triangle.a = vertices[object.data.y].position - triangle.v0;
+  triangle.b = vertices[object.data.z].position - triangle.v0;
+  glm::vec3 n = glm::cross(triangle.b, triangle.a);
+  triangle.minDet = 1e-8f * glm::dot(n, n);
+  return triangle;
+}
+
+// The kernels below do the same operations in the same order as
+// intersectBox and intersectTriangle, so every lane gets bit for bit the
+// result the ray would get alone. They return a bit mask of the lanes
+
+// Lanes that enter the box within [tMin, t], with their entry distances
+unsigned int intersectBoxSSE(const RayPacket &packet, const BVHNode &node,
+                             float *tNear) {
+  __m128 lo, hi;
+  for (int axis = 0; axis < 3; axis++) {
+    __m128 origin = _mm_load_ps(packet.origin[axis]);
+    __m128 invDirection = _mm_load_ps(packet.invDirection[axis]);
+    __m128 t1 = _mm_mul_ps(
+        _mm_sub_ps(_mm_set1_ps(node.aabbMin[axis]), origin), invDirection);
+    __m128 t2 = _mm_mul_ps(
+        _mm_sub_ps(_mm_set1_ps(node.aabbMax[axis]), origin), invDirection);
+    lo = axis == 0 ? _mm_min_ps(t1, t2) : _mm_max_ps(lo, _mm_min_ps(t1, t2));
+    hi = axis == 0 ? _mm_max_ps(t1, t2) : _mm_min_ps(hi, _mm_max_ps(t1, t2));
+  }
+
+  __m128 hit = _mm_and_ps(
+      _mm_and_ps(_mm_cmple_ps(lo, hi),
+                 _mm_cmple_ps(lo, _mm_load_ps(packet.t))),
+      _mm_cmpge_ps(hi, _mm_load_ps(packet.tMin)));
+  _mm_store_ps(tNear, lo);
+  return _mm_movemask_ps(hit);
+}
+
+// Lanes that hit the triangle within [tMin, t], narrowing their hits to it
+unsigned int intersectTriangleSSE(RayPacket &packet, const Triangle &triangle,
+                                  unsigned int active) {
+  __m128 dx = _mm_load_ps(packet.direction[0]);
+  __m128 dy = _mm_load_ps(packet.direction[1]);
+  __m128 dz = _mm_load_ps(packet.direction[2]);
+  __m128 ax = _mm_set1_ps(triangle.a.x);
+  __m128 ay = _mm_set1_ps(triangle.a.y);
+  __m128 az = _mm_set1_ps(triangle.a.z);
+  __m128 bx = _mm_set1_ps(triangle.b.x);
+  __m128 by = _mm_set1_ps(triangle.b.y);
+  __m128 bz = _mm_set1_ps(triangle.b.z);
+
+  // pvec = cross(direction, b)
+  __m128 px = _mm_sub_ps(_mm_mul_ps(dy, bz), _mm_mul_ps(by, dz));
+  __m128 py = _mm_sub_ps(_mm_mul_ps(dz, bx), _mm_mul_ps(bz, dx));
+  __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, by), _mm_mul_ps(bx, dy));
+  __m128 det = _mm_add_ps(
+      _mm_add_ps(_mm_mul_ps(ax, px), _mm_mul_ps(ay, py)), _mm_mul_ps(az, pz));
+  __m128 lengthSq = _mm_add_ps(
+      _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+  __m128 miss = _mm_cmplt_ps(_mm_mul_ps(det, det),
+                             _mm_mul_ps(_mm_set1_ps(triangle.minDet), lengthSq));
+
+  __m128 idet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+  __m128 tx = _mm_sub_ps(_mm_load_ps(packet.origin[0]),
+                         _mm_set1_ps(triangle.v0.x));
+  __m128 ty = _mm_sub_ps(_mm_load_ps(packet.origin[1]),
+                         _mm_set1_ps(triangle.v0.y));
+  __m128 tz = _mm_sub_ps(_mm_load_ps(packet.origin[2]),
+                         _mm_set1_ps(triangle.v0.z));
+  __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px),
+                                              _mm_mul_ps(ty, py)),
+                                   _mm_mul_ps(tz, pz)),
+                        idet);
+
+  // qvec = cross(tvec, a)
+  __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, az), _mm_mul_ps(ay, tz));
+  __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, ax), _mm_mul_ps(az, tx));
+  __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, ay), _mm_mul_ps(ax, ty));
+  __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx),
+                                              _mm_mul_ps(dy, qy)),
+                                   _mm_mul_ps(dz, qz)),
+                        idet);
+  __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(bx, qx),
+                                              _mm_mul_ps(by, qy)),
+                                   _mm_mul_ps(bz, qz)),
+                        idet);
+
+  __m128 zero = _mm_setzero_ps();
+  __m128 one = _mm_set1_ps(1.0f);
+  miss = _mm_or_ps(miss, _mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmpgt_ps(u, one)));
+  miss = _mm_or_ps(miss, _mm_or_ps(_mm_cmplt_ps(v, zero),
+                                   _mm_cmpgt_ps(_mm_add_ps(u, v), one)));
+  __m128 closest = _mm_load_ps(packet.t);
+  __m128 inRange = _mm_and_ps(_mm_cmpge_ps(t, _mm_load_ps(packet.tMin)),
+                              _mm_cmple_ps(t, closest));
+  __m128 hit = _mm_andnot_ps(miss, inRange);
+  unsigned int mask = _mm_movemask_ps(hit) & active;
+  if (mask == 0) {
+    return 0;
+  }
+
+  // Lanes outside active keep what they had
+  alignas(16) const int lanes[4] = {-(int)(mask & 1), -(int)(mask >> 1 & 1),
+                                    -(int)(mask >> 2 & 1),
+                                    -(int)(mask >> 3 & 1)};
+  hit = _mm_castsi128_ps(_mm_load_si128((const __m128i *)lanes));
+  auto select = [&](__m128 a, __m128 b) {
+    return _mm_or_ps(_mm_and_ps(hit, a), _mm_andnot_ps(hit, b));
+  };
+  _mm_store_ps(packet.t, select(t, closest));
+  _mm_store_ps(packet.u, select(u, _mm_load_ps(packet.u)));
+  _mm_store_ps(packet.v, select(v, _mm_load_ps(packet.v)));
+  return mask;
+}
+
+__attribute__((target("avx2"))) unsigned int
+intersectBoxAVX2(const RayPacket &packet, const BVHNode &node, float *tNear) {
+  __m256 lo, hi;
+  for (int axis = 0; axis < 3; axis++) {
+    __m256 origin = _mm256_load_ps(packet.origin[axis]);
+    __m256 invDirection = _mm256_load_ps(packet.invDirection[axis]);
+    __m256 t1 = _mm256_mul_ps(
+        _mm256_sub_ps(_mm256_set1_ps(node.aabbMin[axis]), origin),
+        invDirection);
+    __m256 t2 = _mm256_mul_ps(
+        _mm256_sub_ps(_mm256_set1_ps(node.aabbMax[axis]), origin),
+        invDirection);
+    lo = axis == 0 ? _mm256_min_ps(t1, t2)
+                   : _mm256_max_ps(lo, _mm256_min_ps(t1, t2));
+    hi = axis == 0 ? _mm256_max_ps(t1, t2)
+                   : _mm256_min_ps(hi, _mm256_max_ps(t1, t2));
+  }
+
+  __m256 hit = _mm256_and_ps(
+      _mm256_and_ps(_mm256_cmp_ps(lo, hi, _CMP_LE_OQ),
+                    _mm256_cmp_ps(lo, _mm256_load_ps(packet.t), _CMP_LE_OQ)),
+      _mm256_cmp_ps(hi, _mm256_load_ps(packet.tMin), _CMP_GE_OQ));
+  _mm256_store_ps(tNear, lo);
+  return _mm256_movemask_ps(hit);
+}
+
+__attribute__((target("avx2"))) unsigned int
+intersectTriangleAVX2(RayPacket &packet, const Triangle &triangle,
+                      unsigned int active) {
+  __m256 dx = _mm256_load_ps(packet.direction[0]);
+  __m256 dy = _mm256_load_ps(packet.direction[1]);
+  __m256 dz = _mm256_load_ps(packet.direction[2]);
+  __m256 ax = _mm256_set1_ps(triangle.a.x);
+  __m256 ay = _mm256_set1_ps(triangle.a.y);
+  __m256 az = _mm256_set1_ps(triangle.a.z);
+  __m256 bx = _mm256_set1_ps(triangle.b.x);
+  __m256 by = _mm256_set1_ps(triangle.b.y);
+  __m256 bz = _mm256_set1_ps(triangle.b.z);
+
+  // pvec = cross(direction, b)
+  __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, bz), _mm256_mul_ps(by, dz));
+  __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, bx), _mm256_mul_ps(bz, dx));
+  __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, by), _mm256_mul_ps(bx, dy));
+  __m256 det = _mm256_add_ps(
+      _mm256_add_ps(_mm256_mul_ps(ax, px), _mm256_mul_ps(ay, py)),
+      _mm256_mul_ps(az, pz));
+  __m256 lengthSq = _mm256_add_ps(
+      _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)),
+      _mm256_mul_ps(dz, dz));
+  __m256 miss = _mm256_cmp_ps(
+      _mm256_mul_ps(det, det),
+      _mm256_mul_ps(_mm256_set1_ps(triangle.minDet), lengthSq), _CMP_LT_OQ);
+
+  __m256 idet = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+  __m256 tx = _mm256_sub_ps(_mm256_load_ps(packet.origin[0]),
+                            _mm256_set1_ps(triangle.v0.x));
+  __m256 ty = _mm256_sub_ps(_mm256_load_ps(packet.origin[1]),
+                            _mm256_set1_ps(triangle.v0.y));
+  __m256 tz = _mm256_sub_ps(_mm256_load_ps(packet.origin[2]),
+                            _mm256_set1_ps(triangle.v0.z));
+  __m256 u = _mm256_mul_ps(
+      _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)),
+                    _mm256_mul_ps(tz, pz)),
+      idet);
+
+  // qvec = cross(tvec, a)
+  __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, az), _mm256_mul_ps(ay, tz));
+  __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, ax), _mm256_mul_ps(az, tx));
+  __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, ay), _mm256_mul_ps(ax, ty));
+  __m256 v = _mm256_mul_ps(
+      _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)),
+                    _mm256_mul_ps(dz, qz)),
+      idet);
+  __m256 t = _mm256_mul_ps(
+      _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(bx, qx), _mm256_mul_ps(by, qy)),
+                    _mm256_mul_ps(bz, qz)),
+      idet);
+
+  __m256 zero = _mm256_setzero_ps();
+  __m256 one = _mm256_set1_ps(1.0f);
+  miss = _mm256_or_ps(miss, _mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_LT_OQ),
+                                         _mm256_cmp_ps(u, one, _CMP_GT_OQ)));
+  miss = _mm256_or_ps(
+      miss, _mm256_or_ps(_mm256_cmp_ps(v, zero, _CMP_LT_OQ),
+                         _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_GT_OQ)));
+  __m256 closest = _mm256_load_ps(packet.t);
+  __m256 inRange = _mm256_and_ps(
+      _mm256_cmp_ps(t, _mm256_load_ps(packet.tMin), _CMP_GE_OQ),
+      _mm256_cmp_ps(t, closest, _CMP_LE_OQ));
+  __m256 hit = _mm256_andnot_ps(miss, inRange);
+  unsigned int mask = _mm256_movemask_ps(hit) & active;
+  if (mask == 0) {
+    return 0;
+  }
+
+  // Lanes outside active keep what they had
+  __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  hit = _mm256_castsi256_ps(_mm256_cmpeq_epi32(
+      _mm256_and_si256(_mm256_set1_epi32(mask), bits), bits));
+  _mm256_store_ps(packet.t, _mm256_blendv_ps(closest, t, hit));
+  _mm256_store_ps(packet.u,
+                  _mm256_blendv_ps(_mm256_load_ps(packet.u), u, hit));
+  _mm256_store_ps(packet.v,
+                  _mm256_blendv_ps(_mm256_load_ps(packet.v), v, hit));
+  return mask;
+}
+
+struct KernelsSSE {
+  static constexpr unsigned int WIDTH = 4;
+  static constexpr auto intersectBox = intersectBoxSSE;
+  static constexpr auto intersectTriangle = intersectTriangleSSE;
+};
+
+struct KernelsAVX2 {
+  static constexpr unsigned int WIDTH = 8;
+  static constexpr auto intersectBox = intersectBoxAVX2;
+  static constexpr auto intersectTriangle = intersectTriangleAVX2;
+};
+
+// Lanes that still need the node and where each of them enters it
+struct PacketEntry {
+  uint32_t node;
+  unsigned int lanes;
+  alignas(32) float tNear[MAX_PACKET_SIZE];
+};
+
+// Traces the lanes in active through the tree together. A node is visited
+// if any lane's ray enters it, the lanes that do not just ride along. stack
+// holds getDepth + 1 entries
+template <typename Kernels, bool AnyHit>
+void tracePacket(const BVH &bvh, const std::vector<Vertex> &vertices,
+                 RayPacket &packet, unsigned int active, PacketEntry *stack) {
+  const std::vector<BVHNode> &nodes = bvh.getNodes();
+  const std::vector<GpuObject> &objects = bvh.getGpuObjects();
+  unsigned int stackSize = 0;
+
+  stack[0].node = 0;
+  stack[0].lanes = Kernels::intersectBox(packet, nodes[0], stack[0].tNear) &
+                   active;
+  if (stack[0].lanes != 0) {
+    stackSize++;
+  }
+
+  while (stackSize > 0) {
+    const PacketEntry &entry = stack[--stackSize];
+    // Lanes that found something closer since the node was pushed skip it
+    unsigned int lanes = entry.lanes & active;
+    for (unsigned int i = 0; i < Kernels::WIDTH; i++) {
+      if ((lanes >> i & 1) && entry.tNear[i] > packet.t[i]) {
+        lanes &= ~(1u << i);
+      }
+    }
+    if (lanes == 0) {
+      continue;
+    }
+    const BVHNode &node = nodes[entry.node];
+
+    if (node.numObjects != 0) {
+      for (uint32_t i = node.leftFirst;
+           i < node.leftFirst + node.numObjects && lanes != 0; i++) {
+        unsigned int hits = 0;
+        if (objects[i].type == ObjectType::Face) {
+          hits = Kernels::intersectTriangle(
+              packet, getTriangle(objects[i], vertices), lanes);
+        } else if (objects[i].type == ObjectType::Sphere) {
+          for (unsigned int lane = 0; lane < Kernels::WIDTH; lane++) {
+            float t;
+            if ((lanes >> lane & 1) &&
+                intersectSphere(packet.getRay(lane), objects[i].getSphere(),
+                                packet.tMin[lane], packet.t[lane], t)) {
+              packet.t[lane] = t;
+              packet.u[lane] = packet.v[lane] = 0.0f;
+              hits |= 1u << lane;
+            }
+          }
+        }
+
+        for (unsigned int lane = 0; lane < Kernels::WIDTH; lane++) {
+          if (hits >> lane & 1) {
+            packet.objectIdx[lane] = i;
+          }
+        }
+        if (AnyHit) {
+          active &= ~hits;
+          lanes &= ~hits;
+        }
+      }
+      if (active == 0) {
+        return;
+      }
+      continue;
+    }
+
+    // Both children go on the stack on top of entry, which is done with
+    uint32_t left = node.leftFirst;
+    PacketEntry leftEntry, rightEntry;
+    leftEntry.node = left;
+    leftEntry.lanes =
+        Kernels::intersectBox(packet, nodes[left], leftEntry.tNear) & lanes;
+    rightEntry.node = left + 1;
+    rightEntry.lanes =
+        Kernels::intersectBox(packet, nodes[left + 1], rightEntry.tNear) &
+        lanes;
+
+    // The child more of the lanes reach first is visited first
+    unsigned int both = leftEntry.lanes & rightEntry.lanes;
+    int leftVotes = 0;
+    for (unsigned int i = 0; i < Kernels::WIDTH; i++) {
+      if (both >> i & 1) {
+        leftVotes += leftEntry.tNear[i] < rightEntry.tNear[i] ? 1 : -1;
+      }
+    }
+    const PacketEntry &first = leftVotes >= 0 ? leftEntry : rightEntry;
+    const PacketEntry &second = leftVotes >= 0 ? rightEntry : leftEntry;
+    if (second.lanes != 0) {
+      stack[stackSize++] = second;
+    }
+    if (first.lanes != 0) {
+      stack[stackSize++] = first;
+    }
+  }
+}
+
+template <bool AnyHit>
+void tracePacket(SimdLevel level, const BVH &bvh, const RayQuery *queries,
+                 unsigned int count, const std::vector<Vertex> &vertices,
+                 RayHit *hits, PacketEntry *stack) {
+  RayPacket packet;
+  for (unsigned int lane = 0; lane < MAX_PACKET_SIZE; lane++) {
+    // Unused lanes repeat the first ray, keeping the kernels' math finite
+    const RayQuery &query = queries[lane < count ? lane : 0];
+    for (int axis = 0; axis < 3; axis++) {
+      packet.origin[axis][lane] = query.ray.origin[axis];
+      packet.direction[axis][lane] = query.ray.direction[axis];
+      packet.invDirection[axis][lane] = 1.0f / query.ray.direction[axis];
+    }
+    packet.tMin[lane] = query.tMin;
+    packet.t[lane] = query.tMax;
+    packet.u[lane] = packet.v[lane] = 0.0f;
+    packet.objectIdx[lane] = RayHit::NO_HIT;
+  }
+
+  unsigned int active = (1u << count) - 1;
+  if (level == SimdLevel::AVX2) {
+    tracePacket<KernelsAVX2, AnyHit>(bvh, vertices, packet, active, stack);
+  } else {
+    tracePacket<KernelsSSE, AnyHit>(bvh, vertices, packet, active, stack);
+  }
+
+  for (unsigned int lane = 0; lane < count; lane++) {
+    hits[lane] = {packet.t[lane],
+                  {packet.u[lane], packet.v[lane]},
+                  packet.objectIdx[lane]};
+  }
+}
+#endif
+
+// Which way the ray points along each axis, packets only form from rays
+// that agree on all three
+unsigned int getOctant(const Ray &ray) {
+  return (ray.direction.x < 0.0f) | (ray.direction.y < 0.0f) << 1 |
+         (ray.direction.z < 0.0f) << 2;
+}
+
+template <bool AnyHit>
+std::vector<RayHit> traceQueries(const BVH &bvh,
+                                 const std::vector<RayQuery> &queries,
+                                 const std::vector<Vertex> &vertices) {
+  std::vector<RayHit> hits(queries.size());
+  SimdLevel level = getSimdLevel();
+  unsigned int width = 1;
+#ifdef BVH_QUERY_X86
+  if (level == SimdLevel::AVX2) {
+    width = KernelsAVX2::WIDTH;
+  } else if (level == SimdLevel::SSE) {
+    width = KernelsSSE::WIDTH;
+  }
+#endif
+
+  // Sized for this tree rather than a fixed limit, so no ray is cut short
+  // however deep edits or the builder made it
+  size_t stackSize = getDepth(bvh.getNodes()) + 1;
+  unsigned int numGroups = (queries.size() + width - 1) / width;
+  ThreadPool::global().parallelFor(
+      numGroups, std::max(1u, MIN_RAYS_PER_TASK / width),
+      [&](unsigned int begin, unsigned int end) {
+        std::vector<uint32_t> stack(stackSize);
+        std::vector<float> stackNear(stackSize);
+#ifdef BVH_QUERY_X86
+        std::vector<PacketEntry> packetStack(width > 1 ? stackSize : 0);
+#endif
+        for (unsigned int group = begin; group < end; group++) {
+          size_t first = (size_t)group * width;
+          unsigned int count =
+              std::min<size_t>(width, queries.size() - first);
+
+          bool coherent = count > 1;
+          unsigned int octant = getOctant(queries[first].ray);
+          for (unsigned int i = 1; i < count && coherent; i++) {
+            coherent = getOctant(queries[first + i].ray) == octant;
+          }
+#ifdef BVH_QUERY_X86
+          if (coherent) {
+            tracePacket<AnyHit>(level, bvh, &queries[first], count, vertices,
+                                &hits[first], packetStack.data());
+            continue;
+          }
+#endif
+          for (unsigned int i = 0; i < count; i++) {
+            hits[first + i] = traceRay<AnyHit>(bvh, queries[first + i],
+                                               vertices, stack.data(),
+                                               stackNear.data());
+          }
+        }
+      });
+  return hits;
+}
+} // namespace
+
+std::vector<RayHit> BVH::intersect(const std::vector<RayQuery> &queries,
+                                   const std::vector<Vertex> &vertices) const {
+  return traceQueries<false>(*this, queries, vertices);
+}
+
+std::vector<RayHit>
+BVH::intersectAny(const std::vector<RayQuery> &queries,
+                  const std::vector<Vertex> &vertices) const {
+  return traceQueries<true>(*this, queries, vertices);
+}
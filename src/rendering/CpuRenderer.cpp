@@ -0,0 +1,406 @@
+#include "rendering/CpuRenderer.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+#include "core/ThreadPool.hpp"
+#include "rendering/PPM.hpp"
+#include "rendering/Ray.hpp"
+#include "rendering/Sampler.hpp"
+
+namespace {
+constexpr float PI = 3.14159265358979323846f;
+// The rest match their namesakes in compute.glsl
+constexpr float VFOV = 40.0f;
+constexpr unsigned int MIN_BOUNCES = 3;
+constexpr unsigned int MAX_BOUNCES = 32;
+constexpr float MAX_DISTANCE = 5000.0f;
+constexpr unsigned int MAX_STACK_SIZE = 64;
+constexpr unsigned int MAX_TOP_LEVEL_STACK_SIZE = 32;
+
+// randomUnitVector in compute.glsl, uniform over the sphere
+glm::vec3 randomUnitVector(Sampler &sampler) {
+  glm::vec2 u = sampler.next2D();
+  float z = 1.0f - 2.0f * u.x;
+  float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+  float phi = 2.0f * PI * u.y;
+  return glm::vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+glm::vec2 randomInUnitCircle(Sampler &sampler) {
+  glm::vec2 u = sampler.next2D();
+  float theta = 2.0f * PI * u.x;
+  float rho = std::sqrt(u.y);
+  return glm::vec2(std::cos(theta), std::sin(theta)) * rho;
+}
+
+struct Hit {
+  float t = MAX_DISTANCE;
+  uint32_t objectIdx = 0;
+  uint32_t instanceIdx = 0;
+};
+
+// What scattering needs of the closest hit, in world space
+struct Surface {
+  glm::vec3 position;
+  glm::vec3 normal; // Facing the ray
+  bool frontFace;
+  uint32_t materialIdx;
+};
+
+// hitBinaryBlas in compute.glsl, narrowing hit to the closest object in the
+// bottom level BVH starting at rootNode
+bool hitBlas(const Scene::GpuData &gpu, const Ray &ray, uint32_t rootNode,
+             Hit &hit) {
+  const float tMin = 0.001f;
+  bool hitAnything = false;
+
+  uint32_t stack[MAX_STACK_SIZE];
+  unsigned int stackSize = 0;
+  stack[stackSize++] = rootNode;
+
+  while (stackSize > 0) {
+    const BVHNode &node = gpu.nodes[stack[--stackSize]];
+
+    if (node.numObjects != 0) {
+      for (uint32_t i = node.leftFirst; i < node.leftFirst + node.numObjects;
+           i++) {
+        float t;
+        if (intersectObject(ray, gpu.objects[i], gpu.triangles[i], tMin,
+                            hit.t, t)) {
+          hit.t = t;
+          hit.objectIdx = i;
+          hitAnything = true;
+        }
+      }
+      continue;
+    }
+
+    // Push the closer child last so that it is visited first
+    const BVHNode &left = gpu.nodes[node.leftFirst];
+    const BVHNode &right = gpu.nodes[node.leftFirst + 1];
+    glm::vec2 leftIntersect = intersectAABB(ray, left.aabbMin, left.aabbMax);
+    glm::vec2 rightIntersect =
+        intersectAABB(ray, right.aabbMin, right.aabbMax);
+    bool hitLeft = leftIntersect.x <= leftIntersect.y &&
+                   leftIntersect.x < hit.t && leftIntersect.y > 0.0f;
+    bool hitRight = rightIntersect.x <= rightIntersect.y &&
+                    rightIntersect.x < hit.t && rightIntersect.y > 0.0f;
+
+    bool leftFirst = leftIntersect.x < rightIntersect.x;
+    if (hitLeft && hitRight && stackSize + 2 <= MAX_STACK_SIZE) {
+      stack[stackSize++] = leftFirst ? node.leftFirst + 1 : node.leftFirst;
+      stack[stackSize++] = leftFirst ? node.leftFirst : node.leftFirst + 1;
+    } else if (hitLeft && stackSize < MAX_STACK_SIZE) {
+      stack[stackSize++] = node.leftFirst;
+    } else if (hitRight && stackSize < MAX_STACK_SIZE) {
+      stack[stackSize++] = node.leftFirst + 1;
+    }
+  }
+
+  return hitAnything;
+}
+
+// hitBvh in compute.glsl, through the top level into every instance's
+// bottom level BVH
+bool hitScene(const Scene::GpuData &gpu, const Ray &ray, Hit &hit) {
+  bool hitAnything = false;
+
+  uint32_t stack[MAX_TOP_LEVEL_STACK_SIZE];
+  unsigned int stackSize = 0;
+  stack[stackSize++] = 0;
+
+  while (stackSize > 0) {
+    const BVHNode &node = gpu.topLevelNodes[stack[--stackSize]];
+    glm::vec2 nodeIntersect = intersectAABB(ray, node.aabbMin, node.aabbMax);
+    if (nodeIntersect.x > nodeIntersect.y || nodeIntersect.x >= hit.t ||
+        nodeIntersect.y <= 0.0f) {
+      continue;
+    }
+
+    if (node.numObjects == 0) {
+      if (stackSize + 2 <= MAX_TOP_LEVEL_STACK_SIZE) {
+        stack[stackSize++] = node.leftFirst + 1;
+        stack[stackSize++] = node.leftFirst;
+      }
+      continue;
+    }
+
+    for (uint32_t i = node.leftFirst; i < node.leftFirst + node.numObjects;
+         i++) {
+      const GpuInstance &instance = gpu.instances[i];
+
+      // The direction is not renormalized so t is the same in both spaces
+      Ray localRay;
+      localRay.origin =
+          glm::vec3(instance.worldToObject * glm::vec4(ray.origin, 1.0f));
+      localRay.direction = glm::mat3(instance.worldToObject) * ray.direction;
+      if (hitBlas(gpu, localRay, instance.rootNode, hit)) {
+        hit.instanceIdx = i;
+        hitAnything = true;
+      }
+    }
+  }
+
+  return hitAnything;
+}
+
+// occluded in compute.glsl
+bool occluded(const Scene::GpuData &gpu, const Ray &ray, float maxT) {
+  Hit hit;
+  hit.t = maxT;
+  return hitScene(gpu, ray, hit);
+}
+
+Surface getSurface(const Scene::GpuData &gpu, const Ray &ray,
+                   const Hit &hit) {
+  const GpuInstance &instance = gpu.instances[hit.instanceIdx];
+  const GpuObject &object = gpu.objects[hit.objectIdx];
+
+  Surface surface;
+  surface.position = ray.origin + ray.direction * hit.t;
+
+  glm::vec3 normal;
+  if (object.type == ObjectType::Sphere) {
+    glm::vec3 localPosition = glm::vec3(
+        instance.worldToObject * glm::vec4(surface.position, 1.0f));
+    glm::vec4 sphere = object.getSphere();
+    normal = (localPosition - glm::vec3(sphere)) / sphere.w;
+  } else {
+    const GpuTriangle &triangle = gpu.triangles[hit.objectIdx];
+    normal = glm::cross(glm::vec3(triangle.edge2), glm::vec3(triangle.edge1));
+  }
+  // The inverse transpose keeps it perpendicular to the surface
+  normal = glm::normalize(glm::transpose(glm::mat3(instance.worldToObject)) *
+                          normal);
+  surface.frontFace = glm::dot(ray.direction, normal) < 0.0f;
+  surface.normal = surface.frontFace ? normal : -normal;
+
+  surface.materialIdx = instance.materialIdx != GpuInstance::USE_OBJECT_MATERIAL
+                            ? instance.materialIdx
+                            : object.materialIdx;
+  return surface;
+}
+
+float reflectance(float cosine, float refIdx) {
+  float r0 = (1.0f - refIdx) / (1.0f + refIdx);
+  r0 = r0 * r0;
+  return r0 + (1.0f - r0) * std::pow(1.0f - cosine, 5.0f);
+}
+
+// scatter in compute.glsl, returns false if the ray ends here
+bool scatter(const Material &material, const Surface &surface,
+             Sampler &sampler, Ray &ray) {
+  if (material.type == MaterialType::LIGHT) {
+    return false;
+  }
+
+  glm::vec3 direction;
+  if (material.type == MaterialType::LAMBERTIAN) {
+    // lerp between scatter and reflect based on smoothness
+    glm::vec3 scatterComp = surface.normal + randomUnitVector(sampler);
+    if (glm::length(scatterComp) < 0.0001f) {
+      scatterComp = surface.normal;
+    } else {
+      scatterComp = glm::normalize(scatterComp);
+    }
+    glm::vec3 reflectComp = glm::reflect(ray.direction, surface.normal);
+    direction = glm::mix(scatterComp, reflectComp, material.typeData);
+  } else {
+    // Dielectric
+    float ri =
+        surface.frontFace ? 1.0f / material.typeData : material.typeData;
+    float cosTheta = std::min(glm::dot(-ray.direction, surface.normal), 1.0f);
+    float sinTheta = std::sqrt(1.0f - cosTheta * cosTheta);
+
+    bool cannotRefract = ri * sinTheta > 1.0f;
+    if (cannotRefract || reflectance(cosTheta, ri) > sampler.next1D()) {
+      direction = glm::reflect(ray.direction, surface.normal);
+    } else {
+      direction = glm::refract(ray.direction, surface.normal, ri);
+    }
+  }
+
+  ray.origin = surface.position;
+  ray.direction = glm::normalize(direction);
+  return true;
+}
+
+// The rest of the path's shading matches its namesakes in compute.glsl
+float lightPdf(const Scene::GpuData &gpu, float dist, float cosLight) {
+  return dist * dist / (std::max(cosLight, 1e-6f) * gpu.lightArea);
+}
+
+float misWeight(float pdf, float otherPdf) {
+  return pdf * pdf / (pdf * pdf + otherPdf * otherPdf);
+}
+
+glm::vec3 sampleLight(const Scene &scene, const Surface &surface,
+                      const glm::vec3 &albedo, Sampler &sampler) {
+  const auto &lights = scene.gpu.lights;
+  float pick = sampler.next1D() * lights.size();
+  size_t lightIdx = std::min<size_t>(pick, lights.size() - 1);
+  if (pick - std::floor(pick) >= lights[lightIdx].aliasProbability) {
+    lightIdx = lights[lightIdx].alias;
+  }
+  const GpuLight &light = lights[lightIdx];
+
+  glm::vec2 u = sampler.next2D();
+  float s = std::sqrt(u.x);
+  float t = u.y;
+  glm::vec3 point = light.v0 + light.edge1 * (s * (1.0f - t)) +
+                    light.edge2 * (s * t);
+
+  glm::vec3 toLight = point - surface.position;
+  float dist = glm::length(toLight);
+  Ray shadow;
+  shadow.origin = surface.position;
+  shadow.direction = toLight / dist;
+  float cosSurface = glm::dot(surface.normal, shadow.direction);
+  float cosLight = std::abs(glm::dot(
+      glm::normalize(glm::cross(light.edge1, light.edge2)), shadow.direction));
+  if (cosSurface <= 0.0f || cosLight <= 0.0f ||
+      occluded(scene.gpu, shadow, dist * 0.999f)) {
+    return glm::vec3(0.0f);
+  }
+
+  float pdf = lightPdf(scene.gpu, dist, cosLight);
+  float bsdfPdf = cosSurface / PI;
+  glm::vec3 brdf = albedo / PI;
+  return brdf * scene.materials[light.materialIdx].color * cosSurface *
+         misWeight(pdf, bsdfPdf) / pdf;
+}
+
+// lightCount is 0 without light sampling, like u_LightCount
+glm::vec3 rayColor(const Scene &scene, Ray ray, Sampler &sampler,
+                   size_t lightCount) {
+  glm::vec3 throughput(1.0f);
+  glm::vec3 radiance(0.0f);
+  float bsdfPdf = 0.0f;
+  for (unsigned int bounce = 0; bounce < MAX_BOUNCES; bounce++) {
+    Hit hit;
+    if (!hitScene(scene.gpu, ray, hit)) {
+      break;
+    }
+
+    Surface surface = getSurface(scene.gpu, ray, hit);
+    const Material &material = scene.materials[surface.materialIdx];
+    if (material.type == MaterialType::LIGHT) {
+      float weight = 1.0f;
+      bool onFace = scene.gpu.objects[hit.objectIdx].type == ObjectType::Face;
+      if (bsdfPdf > 0.0f && onFace && lightCount > 0) {
+        float cosLight = std::abs(glm::dot(surface.normal, ray.direction));
+        weight =
+            misWeight(bsdfPdf, lightPdf(scene.gpu, hit.t, cosLight));
+      }
+      radiance += throughput * material.color * weight;
+      break;
+    }
+
+    scatter(material, surface, sampler, ray);
+    bool diffuse = material.type == MaterialType::LAMBERTIAN &&
+                   material.typeData == 0.0f;
+    if (diffuse && lightCount > 0) {
+      radiance +=
+          throughput * sampleLight(scene, surface, material.color, sampler);
+    }
+    bsdfPdf = diffuse
+                  ? std::max(glm::dot(surface.normal, ray.direction), 0.0f) / PI
+                  : 0.0f;
+    throughput *= material.color;
+
+    if (bounce >= MIN_BOUNCES) {
+      float survival = std::min(
+          std::max(throughput.r, std::max(throughput.g, throughput.b)), 0.95f);
+      if (sampler.next1D() >= survival) {
+        break;
+      }
+      throughput /= survival;
+    }
+  }
+  return radiance;
+}
+} // namespace
+
+CpuRenderer::CpuRenderer(unsigned int width, unsigned int height)
+    : _camera(width, height), _width(width), _height(height),
+      _pixels(width * height, glm::vec3(0.0f)) {}
+
+void CpuRenderer::render(const Scene &scene, unsigned int samplesPerPixel) {
+  if (samplesPerPixel == 0) {
+    return;
+  }
+
+  // The same viewport as main() in compute.glsl
+  float viewportHeight = 2.0f * std::tan(glm::radians(VFOV) / 2.0f);
+  float viewportWidth = (float)_width / _height * viewportHeight;
+  glm::vec3 w = glm::normalize(_camera.getViewDirection());
+  glm::vec3 u = glm::normalize(glm::cross(w, _camera.getUpVector()));
+  glm::vec3 v = glm::cross(u, w);
+  glm::vec3 horizontal = u * viewportWidth;
+  glm::vec3 vertical = v * viewportHeight;
+  glm::vec3 origin = _camera.getPosition();
+  glm::vec3 lowerLeftCorner = origin - horizontal / 2.0f - vertical / 2.0f + w;
+
+  unsigned int tilesX = (_width + TILE_SIZE - 1) / TILE_SIZE;
+  unsigned int tilesY = (_height + TILE_SIZE - 1) / TILE_SIZE;
+  unsigned int numTiles = tilesX * tilesY;
+  float oldWeight = (float)_sampleCount / (_sampleCount + samplesPerPixel);
+  float newWeight = 1.0f / (_sampleCount + samplesPerPixel);
+  size_t lightCount = _lightSampling ? scene.gpu.lights.size() : 0;
+
+  // One task per thread, each taking the next tile when it finishes one.
+  // Tiles cost very different amounts, so fixed chunks of them would leave
+  // threads idle
+  std::atomic<unsigned int> nextTile{0};
+  ThreadPool &pool = ThreadPool::global();
+  pool.parallelFor(pool.size(), 1, [&](unsigned int, unsigned int) {
+    for (unsigned int tile = nextTile++; tile < numTiles; tile = nextTile++) {
+      unsigned int x0 = tile % tilesX * TILE_SIZE;
+      unsigned int y0 = tile / tilesX * TILE_SIZE;
+      unsigned int x1 = std::min(x0 + TILE_SIZE, _width);
+      unsigned int y1 = std::min(y0 + TILE_SIZE, _height);
+
+      for (unsigned int y = y0; y < y1; y++) {
+        for (unsigned int x = x0; x < x1; x++) {
+          unsigned int pixel = y * _width + x;
+
+          glm::vec3 sum(0.0f);
+          for (unsigned int i = 0; i < samplesPerPixel; i++) {
+            Sampler sampler(_samplerType, {x, y}, _width, _sampleCount + i);
+            glm::vec2 offset = randomInUnitCircle(sampler) * 0.5f;
+            float s = (x + offset.x) / _width;
+            float t = (y + offset.y) / _height;
+            Ray ray;
+            ray.origin = origin;
+            ray.direction = glm::normalize(
+                lowerLeftCorner + s * horizontal + t * vertical - origin);
+            sum += rayColor(scene, ray, sampler, lightCount);
+          }
+
+          _pixels[pixel] = _pixels[pixel] * oldWeight + sum * newWeight;
+        }
+      }
+    }
+  });
+
+  _sampleCount += samplesPerPixel;
+}
+
+void CpuRenderer::savePPM(const std::string &fileName) const {
+  PPM image(_width, _height);
+  for (unsigned int y = 0; y < _height; y++) {
+    for (unsigned int x = 0; x < _width; x++) {
+      glm::vec3 color =
+          glm::clamp(_pixels[y * _width + x], 0.0f, 1.0f) * 255.0f + 0.5f;
+      image.setPixel(x, _height - 1 - y, color.r, color.g, color.b);
+    }
+  }
+  image.savePPM(fileName);
+}
+
+void CpuRenderer::resetFrameCount() {
+  std::fill(_pixels.begin(), _pixels.end(), glm::vec3(0.0f));
+  _sampleCount = 0;
+}
@@ -7,6 +7,10 @@
 // Constructor loads a filename with the .ppm extension
 PPM::PPM(std::string fileName) { parsePPM(fileName); }
 
+PPM::PPM(int width, int height)
+    : _pixelData(width * height * 3, 0), _width(width), _height(height),
+      _maxColorValue(255) {}
+
 // Saves a PPM Image to a new file.
 void PPM::savePPM(std::string outFileName) const {
   std::ofstream outFile(outFileName);
@@ -4,13 +4,32 @@
 
 #include "glad/glad.h"
 
+#include "gpumodel/GpuWavefront.hpp"
+
 #include "imgui.h"
 #include "imgui_impl_opengl3.h"
 
+namespace {
+const std::vector<std::string> COMPUTE_SOURCES = {"shaders/compute.glsl"};
+// The stages share compute.glsl's traversal and shading
+const std::vector<std::string> WAVEFRONT_SOURCES = {"shaders/compute.glsl",
+                                                    "shaders/wavefront.glsl"};
+} // namespace
+
 Renderer::Renderer(const Window &window)
     : _camera(window.getWidth(), window.getHeight()),
       _shader("shaders/vert.glsl", "shaders/frag.glsl"),
       _computeShader("shaders/compute.glsl"),
+      _persistentShader(COMPUTE_SOURCES, "#define PERSISTENT_THREADS\n"),
+      _generateShader(WAVEFRONT_SOURCES,
+                      "#define WAVEFRONT_STAGE\n#define WAVEFRONT_GENERATE\n"),
+      _extendShader(WAVEFRONT_SOURCES,
+                    "#define WAVEFRONT_STAGE\n#define WAVEFRONT_EXTEND\n"),
+      _shadeShader(WAVEFRONT_SOURCES,
+                   "#define WAVEFRONT_STAGE\n#define WAVEFRONT_SHADE\n"),
+      _accumulateShader(WAVEFRONT_SOURCES,
+                        "#define WAVEFRONT_STAGE\n"
+                        "#define WAVEFRONT_ACCUMULATE\n"),
       _texture(window.getWidth(), window.getHeight()), _window(&window) {
   std::vector<MeshVertex> vertices = {
       {{-1, -1, 0}, {0, 0}, {0, 0, 1}},
@@ -28,21 +47,44 @@ Renderer::Renderer(const Window &window)
   _shader.use();
   _screenQuadLayout.bind();
   _texture.bind(0);
+
+  _workBuffer.createStorageBuffer(std::vector<uint32_t>(1), GL_DYNAMIC_COPY,
+                                  15);
+  _blueNoiseBuffer.createStorageBuffer(getBlueNoise(), GL_STATIC_DRAW, 19);
+
+  // A path per pixel, bounded by the window size rather than the scene
+  size_t pathCount = window.getWidth() * window.getHeight();
+  _pathBuffer.allocateStorageBuffer(pathCount * sizeof(GpuPath),
+                                    GL_DYNAMIC_COPY, 9);
+  _pathHitBuffer.allocateStorageBuffer(pathCount * sizeof(GpuPathHit),
+                                       GL_DYNAMIC_COPY, 10);
+  _rayQueueBuffer.allocateStorageBuffer(2 * pathCount * sizeof(uint32_t),
+                                        GL_DYNAMIC_COPY, 11);
+  _hitQueueBuffer.allocateStorageBuffer(pathCount * sizeof(uint32_t),
+                                        GL_DYNAMIC_COPY, 12);
+  _dispatchQueueBuffer.createStorageBuffer(
+      std::vector<GpuDispatchQueue>(HIT_QUEUE + 1), GL_DYNAMIC_COPY, 13);
+  // Accumulating adds to it, so it starts out cleared
+  _radianceBuffer.createStorageBuffer(std::vector<glm::vec4>(pathCount),
+                                      GL_DYNAMIC_COPY, 14);
 }
 
 void Renderer::render(const Scene &scene) const {
   _texture.bind(0);
 
-  _computeShader.use();
-  // Pass in scene data as uniforms
-  _computeShader.setVec3("u_CameraPosition", _camera.getPosition());
-  _computeShader.setVec3("u_CameraDirection", _camera.getViewDirection());
-  _computeShader.setVec3("u_CameraUp", _camera.getUpVector());
-  _computeShader.setUInt("u_FrameCount", _frameCount);
-  _computeShader.bindTextures(scene.textures, 1);
-
-  glDispatchCompute((GLuint)_window->getWidth() / 32,
-                    (GLuint)_window->getHeight() / 32, 1);
+  if (_traceMode == TraceMode::Wavefront) {
+    traceWavefront(scene);
+  } else if (_traceMode == TraceMode::PersistentThreads) {
+    _workBuffer.updateStorageBuffer(std::vector<uint32_t>{0});
+    _persistentShader.use();
+    setFrameUniforms(_persistentShader, scene);
+    glDispatchCompute(_persistentGroups, 1, 1);
+  } else {
+    _computeShader.use();
+    setFrameUniforms(_computeShader, scene);
+    glDispatchCompute((GLuint)_window->getWidth() / 32,
+                      (GLuint)_window->getHeight() / 32, 1);
+  }
   glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
 
   glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
@@ -66,6 +108,97 @@ void Renderer::render(const Scene &scene) const {
   ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 }
 
+void Renderer::setFrameUniforms(const Shader &shader,
+                                const Scene &scene) const {
+  // Pass in scene data as uniforms
+  shader.setVec3("u_CameraPosition", _camera.getPosition());
+  shader.setVec3("u_CameraDirection", _camera.getViewDirection());
+  shader.setVec3("u_CameraUp", _camera.getUpVector());
+  shader.setUInt("u_FrameCount", _frameCount);
+  setTraceUniforms(shader, scene);
+  shader.bindTextures(scene.textures, 1);
+}
+
+void Renderer::setTraceUniforms(const Shader &shader,
+                                const Scene &scene) const {
+  shader.setUInt("u_BvhWidth", scene.gpu.bvhWidth);
+  shader.setBool("u_CompressedBvh", scene.gpu.compressedBvh);
+  shader.setBool("u_StacklessBvh", _stacklessBvh);
+  shader.setUInt("u_LightCount", _lightSampling ? scene.gpu.lights.size() : 0);
+  shader.setFloat("u_LightArea", scene.gpu.lightArea);
+  shader.setUInt("u_Sampler", static_cast<unsigned int>(_samplerType));
+}
+
+void Renderer::traceWavefront(const Scene &scene) const {
+  GLuint pathCount = _window->getWidth() * _window->getHeight();
+  GLuint pathGroups =
+      (pathCount + WAVEFRONT_GROUP_SIZE - 1) / WAVEFRONT_GROUP_SIZE;
+  // Queues are read back by the next pass's shaders and dispatch, and reset
+  // from here
+  const GLbitfield queueBarrier = GL_SHADER_STORAGE_BARRIER_BIT |
+                                  GL_COMMAND_BARRIER_BIT |
+                                  GL_BUFFER_UPDATE_BARRIER_BIT;
+  glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, _dispatchQueueBuffer.ssbo);
+
+  for (unsigned int sample = 0; sample < SAMPLES_PER_FRAME; sample++) {
+    _generateShader.use();
+    _generateShader.setVec3("u_CameraPosition", _camera.getPosition());
+    _generateShader.setVec3("u_CameraDirection", _camera.getViewDirection());
+    _generateShader.setVec3("u_CameraUp", _camera.getUpVector());
+    _generateShader.setUInt("u_FrameCount", _frameCount);
+    _generateShader.setUInt("u_PathCount", pathCount);
+    _generateShader.setUInt("u_Sample", sample);
+    _generateShader.setUInt("u_Sampler",
+                            static_cast<unsigned int>(_samplerType));
+    glDispatchCompute(pathGroups, 1, 1);
+    setQueue(0, pathCount);
+    glMemoryBarrier(queueBarrier);
+
+    for (unsigned int bounce = 0; bounce < MAX_BOUNCES; bounce++) {
+      unsigned int rayQueue = bounce % 2;
+
+      setQueue(HIT_QUEUE);
+      _extendShader.use();
+      _extendShader.setUInt("u_PathCount", pathCount);
+      _extendShader.setUInt("u_RayQueue", rayQueue);
+      setTraceUniforms(_extendShader, scene);
+      glDispatchComputeIndirect(rayQueue * sizeof(GpuDispatchQueue));
+      glMemoryBarrier(queueBarrier);
+
+      setQueue(1 - rayQueue);
+      _shadeShader.use();
+      _shadeShader.setUInt("u_PathCount", pathCount);
+      _shadeShader.setUInt("u_RayQueue", rayQueue);
+      _shadeShader.setUInt("u_Bounce", bounce);
+      _shadeShader.setUInt("u_FrameCount", _frameCount);
+      _shadeShader.setUInt("u_Sample", sample);
+      // Shadow rays traverse too
+      setTraceUniforms(_shadeShader, scene);
+      _shadeShader.bindTextures(scene.textures, 1);
+      glDispatchComputeIndirect(HIT_QUEUE * sizeof(GpuDispatchQueue));
+      glMemoryBarrier(queueBarrier);
+    }
+  }
+
+  _accumulateShader.use();
+  _accumulateShader.setUInt("u_FrameCount", _frameCount);
+  _accumulateShader.setUInt("u_PathCount", pathCount);
+  _accumulateShader.setUInt("u_SampleCount", SAMPLES_PER_FRAME);
+  glDispatchCompute(pathGroups, 1, 1);
+  glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+}
+
+void Renderer::setQueue(unsigned int queue, unsigned int count) const {
+  GpuDispatchQueue dispatch;
+  dispatch.numGroupsX =
+      (count + WAVEFRONT_GROUP_SIZE - 1) / WAVEFRONT_GROUP_SIZE;
+  dispatch.count = count;
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, _dispatchQueueBuffer.ssbo);
+  glBufferSubData(GL_SHADER_STORAGE_BUFFER, queue * sizeof(GpuDispatchQueue),
+                  sizeof(GpuDispatchQueue), &dispatch);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
 void Renderer::createDebugFBO(unsigned int textureID) {
   glGenFramebuffers(1, &_debugFBO);
   glBindFramebuffer(GL_READ_FRAMEBUFFER, _debugFBO);
@@ -0,0 +1,208 @@
+#include "rendering/Sampler.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+namespace {
+// Width of the void and cluster filter, in texels
+constexpr float BLUE_NOISE_SIGMA = 1.5f;
+
+float toUnitFloat(uint32_t value) {
+  return (value >> 8) * (1.0f / 16777216.0f);
+}
+
+// bitfieldReverse in GLSL
+uint32_t reverseBits(uint32_t value) {
+  value = (value << 16) | (value >> 16);
+  value = ((value & 0x00FF00FFu) << 8) | ((value & 0xFF00FF00u) >> 8);
+  value = ((value & 0x0F0F0F0Fu) << 4) | ((value & 0xF0F0F0F0u) >> 4);
+  value = ((value & 0x33333333u) << 2) | ((value & 0xCCCCCCCCu) >> 2);
+  return ((value & 0x55555555u) << 1) | ((value & 0xAAAAAAAAu) >> 1);
+}
+
+// Gaussian energy that a set texel adds to every texel, over wrapped
+// offsets so the mask tiles
+std::vector<float> getBlueNoiseFilter() {
+  const int size = BLUE_NOISE_SIZE;
+  std::vector<float> filter(size * size);
+  for (int y = 0; y < size; y++) {
+    for (int x = 0; x < size; x++) {
+      int dx = std::min(x, size - x);
+      int dy = std::min(y, size - y);
+      filter[y * size + x] = std::exp(-float(dx * dx + dy * dy) /
+                                      (2.0f * BLUE_NOISE_SIGMA *
+                                       BLUE_NOISE_SIGMA));
+    }
+  }
+  return filter;
+}
+
+// The texels set in pattern, and the energy of each texel from them
+struct VoidAndCluster {
+  std::vector<bool> pattern;
+  std::vector<float> energy;
+  const std::vector<float> *filter;
+
+  void toggle(unsigned int texel) {
+    const int size = BLUE_NOISE_SIZE;
+    pattern[texel] = !pattern[texel];
+    float sign = pattern[texel] ? 1.0f : -1.0f;
+    int tx = texel % size;
+    int ty = texel / size;
+    for (int y = 0; y < size; y++) {
+      for (int x = 0; x < size; x++) {
+        int dx = (x - tx + size) % size;
+        int dy = (y - ty + size) % size;
+        energy[y * size + x] += sign * (*filter)[dy * size + dx];
+      }
+    }
+  }
+
+  // The set texel with the most energy, or the unset one with the least
+  unsigned int find(bool set) const {
+    unsigned int best = 0;
+    float bestEnergy = set ? -INFINITY : INFINITY;
+    for (unsigned int i = 0; i < pattern.size(); i++) {
+      if (pattern[i] == set &&
+          (set ? energy[i] > bestEnergy : energy[i] < bestEnergy)) {
+        best = i;
+        bestEnergy = energy[i];
+      }
+    }
+    return best;
+  }
+};
+
+std::vector<float> generateBlueNoise() {
+  const unsigned int count = BLUE_NOISE_SIZE * BLUE_NOISE_SIZE;
+  std::vector<float> filter = getBlueNoiseFilter();
+  VoidAndCluster mask{std::vector<bool>(count, false),
+                      std::vector<float>(count, 0.0f), &filter};
+
+  // Start from a tenth of the texels at random, then move the tightest
+  // cluster into the largest void until that would undo itself
+  std::mt19937 rng(1);
+  unsigned int initial = count / 10;
+  for (unsigned int set = 0; set < initial;) {
+    unsigned int texel = rng() % count;
+    if (!mask.pattern[texel]) {
+      mask.toggle(texel);
+      set++;
+    }
+  }
+  while (true) {
+    unsigned int cluster = mask.find(true);
+    mask.toggle(cluster);
+    unsigned int largestVoid = mask.find(false);
+    mask.toggle(largestVoid);
+    if (largestVoid == cluster) {
+      break;
+    }
+  }
+
+  // Rank the initial texels by taking the tightest clusters out first,
+  // then the rest by filling the largest voids. Once more than half are
+  // set, the largest void is also the tightest cluster of unset texels
+  std::vector<float> ranks(count);
+  VoidAndCluster prototype = mask;
+  for (unsigned int rank = initial; rank-- > 0;) {
+    unsigned int cluster = mask.find(true);
+    mask.toggle(cluster);
+    ranks[cluster] = rank;
+  }
+  mask = prototype;
+  for (unsigned int rank = initial; rank < count; rank++) {
+    unsigned int largestVoid = mask.find(false);
+    mask.toggle(largestVoid);
+    ranks[largestVoid] = rank;
+  }
+
+  for (float &rank : ranks) {
+    rank /= count;
+  }
+  return ranks;
+}
+} // namespace
+
+const std::vector<float> &getBlueNoise() {
+  static const std::vector<float> blueNoise = generateBlueNoise();
+  return blueNoise;
+}
+
+uint32_t hashUint(uint32_t value) {
+  uint32_t state = value * 747796405u + 2891336453u;
+  uint32_t word = ((state >> ((state >> 28) + 4)) ^ state) * 277803737u;
+  return (word >> 22) ^ word;
+}
+
+uint32_t owenScramble(uint32_t value, uint32_t seed) {
+  // The permutation only carries from low bits to high ones, so it runs on
+  // the reversed value to let every bit depend on the ones above it
+  value = reverseBits(value);
+  value += seed;
+  value ^= value * 0x6C50B47Cu;
+  value ^= value * 0xB82F1E52u;
+  value ^= value * 0xC7AFE638u;
+  value ^= value * 0x8D22F6E6u;
+  return reverseBits(value);
+}
+
+glm::uvec2 sobol2D(uint32_t index) {
+  // The first dimension is the bit reversed index. The second's direction
+  // numbers are the rows of Pascal's triangle mod 2
+  glm::uvec2 point(reverseBits(index), 0u);
+  uint32_t direction = 1u << 31;
+  for (; index != 0; index >>= 1, direction ^= direction >> 1) {
+    if (index & 1) {
+      point.y ^= direction;
+    }
+  }
+  return point;
+}
+
+Sampler::Sampler(SamplerType type, glm::uvec2 pixel, uint32_t width,
+                 uint32_t index)
+    : _type(type), _pixel(pixel), _pixelSeed(hashUint(pixel.y * width +
+                                                      pixel.x)),
+      _index(index), _rngState(hashUint(_pixelSeed ^ hashUint(index))) {}
+
+glm::vec2 Sampler::next2D() {
+  uint32_t dimension = _dimension++;
+  if (_type == SamplerType::Random) {
+    float x = nextRandom();
+    return glm::vec2(x, nextRandom());
+  }
+
+  // Every pair gets its own shuffle and scramble, so pairs never correlate.
+  // Under blue noise every pixel shares them
+  uint32_t seed = hashUint(dimension ^ (_type == SamplerType::Sobol
+                                            ? _pixelSeed
+                                            : 0x9E3779B9u));
+  glm::uvec2 point = sobol2D(owenScramble(_index, seed));
+  glm::vec2 sample(toUnitFloat(owenScramble(point.x, hashUint(seed ^ 1u))),
+                   toUnitFloat(owenScramble(point.y, hashUint(seed ^ 2u))));
+  if (_type == SamplerType::BlueNoise) {
+    // Each pair reads the mask from its own offsets, spread by the R2
+    // sequence so they stay apart
+    const auto &blueNoise = getBlueNoise();
+    glm::uvec2 offset(glm::fract(float(dimension) *
+                                 glm::vec2(0.7548776662f, 0.5698402910f)) *
+                      float(BLUE_NOISE_SIZE));
+    glm::uvec2 texelX = (_pixel + offset) % BLUE_NOISE_SIZE;
+    glm::uvec2 texelY = (_pixel + offset + BLUE_NOISE_SIZE / 2) %
+                        BLUE_NOISE_SIZE;
+    glm::vec2 shift(blueNoise[texelX.y * BLUE_NOISE_SIZE + texelX.x],
+                    blueNoise[texelY.y * BLUE_NOISE_SIZE + texelY.x]);
+    sample = glm::fract(sample + shift);
+  }
+  return sample;
+}
+
+float Sampler::nextRandom() {
+  _rngState = _rngState * 747796405u + 2891336453u;
+  uint32_t word =
+      ((_rngState >> ((_rngState >> 28) + 4)) ^ _rngState) * 277803737u;
+  word = (word >> 22) ^ word;
+  return toUnitFloat(word);
+}
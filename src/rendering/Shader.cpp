@@ -13,6 +13,17 @@ Shader::Shader(const std::string &computePath) {
   id = createComputeShaderProgram(source);
 }
 
+Shader::Shader(const std::vector<std::string> &computePaths,
+               const std::string &defines) {
+  std::string source;
+  for (const auto &path : computePaths) {
+    source += loadShaderAsString(path);
+  }
+  size_t versionEnd = source.find('\n') + 1;
+  source.insert(versionEnd, defines);
+  id = createComputeShaderProgram(source);
+}
+
 void Shader::load(const std::string &vertexPath,
                   const std::string &fragmentPath) {
   std::string vertexShaderSource = loadShaderAsString(vertexPath);
@@ -19,7 +19,12 @@ Texture::Texture(int width, int height) {
   glBindImageTexture(0, id, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
 }
 
-Texture::~Texture() { glDeleteTextures(1, &id); }
+Texture::~Texture() {
+  // Never created when loaded without a GL context
+  if (id != 0) {
+    glDeleteTextures(1, &id);
+  }
+}
 
 void Texture::loadFromFile() {
   glGenTextures(1, &id);
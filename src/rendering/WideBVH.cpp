@@ -0,0 +1,261 @@
+#include "rendering/WideBVH.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+void WideBVH::collapse(const std::vector<BVHNode> &nodes,
+                       const std::vector<unsigned int> &roots,
+                       unsigned int width, bool compressed) {
+  _width = std::clamp(width, 2u, MAX_WIDTH);
+  _compressed = compressed;
+  _data.clear();
+  _roots.clear();
+
+  for (unsigned int root : roots) {
+    _roots.push_back({root, collapseNode(nodes, root)});
+  }
+}
+
+unsigned int WideBVH::getRoot(unsigned int binaryRoot) const {
+  for (const auto &[binary, wide] : _roots) {
+    if (binary == binaryRoot) {
+      return wide;
+    }
+  }
+  return 0;
+}
+
+unsigned int WideBVH::collapseNode(const std::vector<BVHNode> &nodes,
+                                   unsigned int nodeIndex) {
+  unsigned int wideIndex = getNodeCount();
+  _data.resize(_data.size() + getNodeSize(), 0);
+
+  // Keep opening the largest inner child until the node is full, those are
+  // the ones rays are most likely to enter. Starting from the binary node
+  // itself means a leaf root still gets a wide node around it
+  unsigned int children[MAX_WIDTH] = {nodeIndex};
+  unsigned int numChildren = 1;
+  while (numChildren < _width) {
+    int largest = -1;
+    float largestArea = -1.0f;
+    for (unsigned int i = 0; i < numChildren; i++) {
+      const BVHNode &child = nodes[children[i]];
+      float area = AABB{child.aabbMin, child.aabbMax}.surfaceArea();
+      if (child.numObjects == 0 && area > largestArea) {
+        largest = i;
+        largestArea = area;
+      }
+    }
+    if (largest == -1) {
+      break;
+    }
+
+    unsigned int left = nodes[children[largest]].leftFirst;
+    children[largest] = left;
+    children[numChildren++] = left + 1;
+  }
+
+  AABB bounds[MAX_WIDTH];
+  for (unsigned int i = 0; i < numChildren; i++) {
+    bounds[i] = {nodes[children[i]].aabbMin, nodes[children[i]].aabbMax};
+  }
+  if (_compressed) {
+    writeCompressedBounds(wideIndex, bounds, numChildren);
+  } else {
+    writeBounds(wideIndex, bounds, numChildren);
+  }
+
+  size_t childOffset = wideIndex * getNodeSize() + getChildOffset();
+  for (unsigned int i = 0; i < _width; i++) {
+    if (i >= numChildren) {
+      _data[childOffset + i] = INVALID_CHILD;
+      continue;
+    }
+
+    const BVHNode &child = nodes[children[i]];
+    if (child.numObjects != 0) {
+      _data[childOffset + i] = child.leftFirst;
+      _data[childOffset + _width + i] = child.numObjects;
+    } else {
+      // Recursing grows _data, so no references into it are kept across this
+      unsigned int grandchild = collapseNode(nodes, children[i]);
+      _data[childOffset + i] = grandchild;
+    }
+  }
+
+  return wideIndex;
+}
+
+void WideBVH::writeBounds(unsigned int node, const AABB *bounds,
+                          unsigned int numChildren) {
+  size_t base = node * getNodeSize();
+  for (unsigned int i = 0; i < numChildren; i++) {
+    for (int axis = 0; axis < 3; axis++) {
+      setFloat(base + (MIN_X + axis) * _width + i, bounds[i].min[axis]);
+      setFloat(base + (MAX_X + axis) * _width + i, bounds[i].max[axis]);
+    }
+  }
+}
+
+void WideBVH::writeCompressedBounds(unsigned int node, const AABB *bounds,
+                                    unsigned int numChildren) {
+  size_t base = node * getNodeSize();
+
+  AABB nodeBounds;
+  for (unsigned int i = 0; i < numChildren; i++) {
+    nodeBounds.extend(bounds[i]);
+  }
+
+  // The smallest power of two steps that cover the node in 255 of them. The
+  // exponent is stored biased like a float's so the shader can build the
+  // scale straight from its bits
+  glm::vec3 scale;
+  uint32_t exponents = 0;
+  for (int axis = 0; axis < 3; axis++) {
+    float extent = nodeBounds.max[axis] - nodeBounds.min[axis];
+    int exponent = extent > 0.0f ? (int)std::ceil(std::log2(extent / 255.0f))
+                                 : -126;
+    exponent = std::clamp(exponent, -126, 127);
+    // Rounding the origin and the top step can still leave it short
+    while (exponent < 127 &&
+           nodeBounds.min[axis] + 255.0f * std::ldexp(1.0f, exponent) <
+               nodeBounds.max[axis]) {
+      exponent++;
+    }
+    scale[axis] = std::ldexp(1.0f, exponent);
+    exponents |= uint32_t(exponent + 127) << (8 * axis);
+  }
+
+  for (int axis = 0; axis < 3; axis++) {
+    setFloat(base + axis, nodeBounds.min[axis]);
+  }
+  _data[base + 3] = exponents;
+
+  // Round outwards, checking against the decoded value since the addition
+  // can round too
+  uint8_t *quantized =
+      reinterpret_cast<uint8_t *>(&_data[base + COMPRESSED_HEADER_SIZE]);
+  for (unsigned int i = 0; i < numChildren; i++) {
+    for (int axis = 0; axis < 3; axis++) {
+      float origin = nodeBounds.min[axis];
+      float min = bounds[i].min[axis];
+      float max = bounds[i].max[axis];
+
+      int qMin = (int)std::floor((min - origin) / scale[axis]);
+      qMin = std::clamp(qMin, 0, 255);
+      while (qMin > 0 && origin + qMin * scale[axis] > min) {
+        qMin--;
+      }
+      int qMax = (int)std::ceil((max - origin) / scale[axis]);
+      qMax = std::clamp(qMax, 0, 255);
+      while (qMax < 255 && origin + qMax * scale[axis] < max) {
+        qMax++;
+      }
+
+      quantized[(MIN_X + axis) * _width + i] = qMin;
+      quantized[(MAX_X + axis) * _width + i] = qMax;
+    }
+  }
+}
+
+AABB WideBVH::getChildBounds(unsigned int node, unsigned int child) const {
+  size_t base = node * getNodeSize();
+  AABB bounds;
+  if (!_compressed) {
+    for (int axis = 0; axis < 3; axis++) {
+      bounds.min[axis] = getFloat(base + (MIN_X + axis) * _width + child);
+      bounds.max[axis] = getFloat(base + (MAX_X + axis) * _width + child);
+    }
+    return bounds;
+  }
+
+  // Same decoding as compute.glsl
+  const uint8_t *quantized =
+      reinterpret_cast<const uint8_t *>(&_data[base + COMPRESSED_HEADER_SIZE]);
+  uint32_t exponents = _data[base + 3];
+  for (int axis = 0; axis < 3; axis++) {
+    float origin = getFloat(base + axis);
+    uint32_t scaleBits = ((exponents >> (8 * axis)) & 0xFF) << 23;
+    float scale;
+    std::memcpy(&scale, &scaleBits, sizeof(float));
+    bounds.min[axis] =
+        origin + quantized[(MIN_X + axis) * _width + child] * scale;
+    bounds.max[axis] =
+        origin + quantized[(MAX_X + axis) * _width + child] * scale;
+  }
+  return bounds;
+}
+
+float WideBVH::getFloat(size_t word) const {
+  float value;
+  std::memcpy(&value, &_data[word], sizeof(float));
+  return value;
+}
+
+void WideBVH::setFloat(size_t word, float value) {
+  std::memcpy(&_data[word], &value, sizeof(float));
+}
+
+float WideBVH::intersect(const Ray &ray, unsigned int root,
+                         const std::vector<GpuObject> &objects,
+                         const std::vector<Vertex> &vertices, float closest,
+                         TraversalStats &stats) const {
+  // Same traversal as hitWideBlas in compute.glsl
+  const float tMin = 0.001f;
+  unsigned int stack[64];
+  unsigned int stackSize = 0;
+  stack[stackSize++] = root;
+
+  while (stackSize > 0) {
+    unsigned int node = stack[--stackSize];
+    stats.nodeVisits++;
+
+    // Inner children that were hit, sorted far to near
+    float childDistance[MAX_WIDTH];
+    unsigned int childNode[MAX_WIDTH];
+    unsigned int numHits = 0;
+
+    for (unsigned int i = 0; i < _width; i++) {
+      uint32_t child = getChild(node, i);
+      if (child == INVALID_CHILD) {
+        break;
+      }
+
+      stats.boxTests++;
+      AABB bounds = getChildBounds(node, i);
+      glm::vec2 t = intersectAABB(ray, bounds.min, bounds.max);
+      if (t.x > t.y || t.x >= closest || t.y <= 0.0f) {
+        continue;
+      }
+
+      uint32_t numObjects = getNumObjects(node, i);
+      if (numObjects != 0) {
+        for (uint32_t j = child; j < child + numObjects; j++) {
+          stats.objectTests++;
+          float tHit;
+          if (intersectObject(ray, objects[j], vertices, tMin, closest,
+                              tHit)) {
+            closest = tHit;
+          }
+        }
+        continue;
+      }
+
+      unsigned int k = numHits++;
+      while (k > 0 && childDistance[k - 1] < t.x) {
+        childDistance[k] = childDistance[k - 1];
+        childNode[k] = childNode[k - 1];
+        k--;
+      }
+      childDistance[k] = t.x;
+      childNode[k] = child;
+    }
+
+    for (unsigned int i = 0; i < numHits && stackSize < 64; i++) {
+      stack[stackSize++] = childNode[i];
+    }
+  }
+
+  return closest;
+}